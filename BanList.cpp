@@ -0,0 +1,403 @@
+#include "BanList.hpp"
+#include <algorithm>
+
+static bool hasWildcard(const std::string &text, size_t from = 0, size_t to = std::string::npos) {
+    return text.find_first_of("*?", from) < std::min(to, text.size());
+}
+
+Glob::Glob(): _kind(GLOB_ANY) {}
+
+Glob::Glob(const std::string &pattern): _kind(GLOB_WILDCARD), _text(pattern) {
+    if (pattern.find_first_not_of('*') == std::string::npos) {
+        _kind = GLOB_ANY;
+        _text.clear();
+        return;
+    }
+    if (pattern.find('?') != std::string::npos)
+        return;
+
+    size_t size = pattern.size();
+    bool leading = pattern[0] == '*';
+    bool trailing = pattern[size - 1] == '*';
+    size_t begin = leading ? 1 : 0;
+    size_t end = trailing ? size - 1 : size;
+    if (hasWildcard(pattern, begin, end))
+        return;
+
+    _text = pattern.substr(begin, end - begin);
+    if (leading && trailing)
+        _kind = GLOB_CONTAINS;
+    else if (leading)
+        _kind = GLOB_SUFFIX;
+    else if (trailing)
+        _kind = GLOB_PREFIX;
+    else
+        _kind = GLOB_EXACT;
+}
+
+Glob::Kind Glob::kind() const {
+    return _kind;
+}
+
+// Iterative '*'/'?' matcher: on a mismatch it backs up to the last star and
+// lets it swallow one more character.
+static bool wildcardMatch(const char *pattern, const char *text) {
+    const char *star = NULL;
+    const char *resume = NULL;
+    while (*text) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = text;
+        } else if (*pattern == '?' || *pattern == *text) {
+            ++pattern;
+            ++text;
+        } else if (star) {
+            pattern = star + 1;
+            text = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*')
+        ++pattern;
+    return *pattern == '\0';
+}
+
+bool Glob::matches(const std::string &text) const {
+    switch (_kind) {
+        case GLOB_ANY:
+            return true;
+        case GLOB_EXACT:
+            return text == _text;
+        case GLOB_PREFIX:
+            return text.compare(0, _text.size(), _text) == 0;
+        case GLOB_SUFFIX:
+            return text.size() >= _text.size()
+                && text.compare(text.size() - _text.size(), _text.size(), _text) == 0;
+        case GLOB_CONTAINS:
+            return text.find(_text) != std::string::npos;
+        case GLOB_WILDCARD:
+            return wildcardMatch(_text.c_str(), text.c_str());
+    }
+    return false;
+}
+
+BanList::BanList(bool useBloom)
+    : _masks(0), _useBloom(useBloom), _bloomKeys(0), _nextSweep(0) {}
+
+// Expands the short forms to a full nick!user@host mask: "nick" bans the
+// nickname, "user@host" and "nick!user" leave the missing parts open.
+std::string BanList::normalize(const std::string &mask) {
+    size_t bang = mask.find('!');
+    size_t at = mask.find('@', bang == std::string::npos ? 0 : bang);
+    std::string nick, user, host;
+
+    if (bang == std::string::npos && at == std::string::npos) {
+        nick = mask;
+    } else if (bang == std::string::npos) {
+        user = mask.substr(0, at);
+        host = mask.substr(at + 1);
+    } else {
+        nick = mask.substr(0, bang);
+        if (at == std::string::npos) {
+            user = mask.substr(bang + 1);
+        } else {
+            user = mask.substr(bang + 1, at - bang - 1);
+            host = mask.substr(at + 1);
+        }
+    }
+    return (nick.empty() ? "*" : nick) + "!" + (user.empty() ? "*" : user) + "@" + (host.empty() ? "*" : host);
+}
+
+static bool isLive(time_t expires, time_t now) {
+    return expires == 0 || expires > now;
+}
+
+// Returns false, and only refreshes the expiry, when the ban already exists.
+bool BanList::add(const std::string &text, time_t expires) {
+    std::string canonical = normalize(text);
+    size_t bang = canonical.find('!');
+    size_t at = canonical.find('@', bang);
+    std::string nick = canonical.substr(0, bang);
+    std::string user = canonical.substr(bang + 1, at - bang - 1);
+    std::string host = canonical.substr(at + 1);
+
+    if (!hasWildcard(nick) && user == "*" && host == "*") {
+        time_t *existing = _exact.find(nick);
+        if (existing) {
+            *existing = expires;
+            return false;
+        }
+        _exact.insert(nick, expires);
+        bloomAdd(KEY_NICK, nick);
+        return true;
+    }
+
+    Mask mask;
+    mask.text = canonical;
+    mask.nick = Glob(nick);
+    mask.user = Glob(user);
+    mask.host = Glob(host);
+    mask.expires = expires;
+
+    if (mask.nick.kind() == Glob::GLOB_EXACT || mask.host.kind() == Glob::GLOB_EXACT) {
+        bool byNick = mask.nick.kind() == Glob::GLOB_EXACT;
+        HashMap<Bucket> &index = byNick ? _byNick : _byHost;
+        const std::string &key = byNick ? nick : host;
+        Bucket *bucket = index.find(key);
+        if (!bucket) {
+            index.insert(key, Bucket());
+            bucket = index.find(key);
+            bloomAdd(byNick ? KEY_NICK : KEY_HOST, key);
+        }
+        return addMask(*bucket, mask);
+    }
+    return addMask(_wildcard, mask);
+}
+
+bool BanList::addMask(Bucket &bucket, const Mask &mask) {
+    for (size_t i = 0; i < bucket.size(); ++i) {
+        if (bucket[i].text == mask.text) {
+            bucket[i].expires = mask.expires;
+            return false;
+        }
+    }
+    bucket.push_back(mask);
+    ++_masks;
+    return true;
+}
+
+bool BanList::remove(const std::string &text) {
+    std::string canonical = normalize(text);
+    size_t bang = canonical.find('!');
+    size_t at = canonical.find('@', bang);
+    std::string nick = canonical.substr(0, bang);
+    std::string host = canonical.substr(at + 1);
+
+    if (canonical == nick + "!*@*" && _exact.erase(nick))
+        return true;
+    if (removeFromBucket(_byNick, nick, canonical) || removeFromBucket(_byHost, host, canonical))
+        return true;
+    for (size_t i = 0; i < _wildcard.size(); ++i) {
+        if (_wildcard[i].text == canonical) {
+            _wildcard[i] = _wildcard.back();
+            _wildcard.pop_back();
+            --_masks;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool BanList::removeFromBucket(HashMap<Bucket> &index, const std::string &key, const std::string &text) {
+    Bucket *bucket = index.find(key);
+    if (!bucket)
+        return false;
+    for (size_t i = 0; i < bucket->size(); ++i) {
+        if ((*bucket)[i].text == text) {
+            (*bucket)[i] = bucket->back();
+            bucket->pop_back();
+            --_masks;
+            if (bucket->empty())
+                index.erase(key);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool BanList::matches(const std::string &nick, const std::string &user, const std::string &host, time_t now) {
+    if (now >= _nextSweep)
+        sweep(now);
+
+    if ((!_exact.empty() || !_byNick.empty()) && bloomMayContain(KEY_NICK, nick)) {
+        time_t *expires = _exact.find(nick);
+        if (expires) {
+            if (isLive(*expires, now))
+                return true;
+            _exact.erase(nick);
+        }
+        Bucket *bucket = _byNick.find(nick);
+        if (bucket && matchBucket(*bucket, nick, user, host, now))
+            return true;
+    }
+    if (!_byHost.empty() && bloomMayContain(KEY_HOST, host)) {
+        Bucket *bucket = _byHost.find(host);
+        if (bucket && matchBucket(*bucket, nick, user, host, now))
+            return true;
+    }
+    return matchBucket(_wildcard, nick, user, host, now);
+}
+
+// Expired masks met on the way are dropped; an emptied bucket stays in its
+// index until the next sweep.
+bool BanList::matchBucket(Bucket &bucket, const std::string &nick, const std::string &user,
+                          const std::string &host, time_t now) {
+    for (size_t i = 0; i < bucket.size(); ) {
+        const Mask &mask = bucket[i];
+        if (!isLive(mask.expires, now)) {
+            bucket[i] = bucket.back();
+            bucket.pop_back();
+            --_masks;
+            continue;
+        }
+        if (mask.nick.matches(nick) && mask.user.matches(user) && mask.host.matches(host))
+            return true;
+        ++i;
+    }
+    return false;
+}
+
+size_t BanList::size() const {
+    return _exact.size() + _masks;
+}
+
+// Three probes derived from one 64-bit FNV-1a hash of the domain-tagged key.
+static uint64_t bloomHash(char domain, const std::string &key) {
+    uint64_t hash = 14695981039346656037ull;
+    hash ^= static_cast<unsigned char>(domain);
+    hash *= 1099511628211ull;
+    for (size_t i = 0; i < key.size(); ++i) {
+        hash ^= static_cast<unsigned char>(key[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Bits can't be cleared, so removed keys linger as false positives until
+// the next rebuild; a full filter is rebuilt at twice the needed size.
+void BanList::bloomAdd(char domain, const std::string &key) {
+    if (!_useBloom)
+        return;
+    if ((_bloomKeys + 1) * BLOOM_BITS_PER_KEY > _bloom.size() * 64)
+        rebuildBloom();
+    bloomSet(domain, key);
+}
+
+void BanList::bloomSet(char domain, const std::string &key) {
+    uint64_t hash = bloomHash(domain, key);
+    uint64_t step = (hash >> 32) | 1;
+    size_t mask = _bloom.size() * 64 - 1;
+    for (int i = 0; i < 3; ++i, hash += step)
+        _bloom[(hash & mask) >> 6] |= 1ull << (hash & 63);
+    ++_bloomKeys;
+}
+
+// The filter is only allocated with the first key.
+bool BanList::bloomMayContain(char domain, const std::string &key) const {
+    if (!_useBloom || _bloom.empty())
+        return true;
+    uint64_t hash = bloomHash(domain, key);
+    uint64_t step = (hash >> 32) | 1;
+    size_t mask = _bloom.size() * 64 - 1;
+    for (int i = 0; i < 3; ++i, hash += step)
+        if (!(_bloom[(hash & mask) >> 6] & (1ull << (hash & 63))))
+            return false;
+    return true;
+}
+
+// Visitor collecting the keys of a HashMap, optionally only those whose
+// expiry has passed.
+struct KeyCollector {
+    std::vector<std::string>    keys;
+    time_t                      now;
+    bool                        expiredOnly;
+
+    KeyCollector(time_t now = 0, bool expiredOnly = false): now(now), expiredOnly(expiredOnly) {}
+
+    void operator()(const std::string &key, const time_t &expires) {
+        if (!expiredOnly || !isLive(expires, now))
+            keys.push_back(key);
+    }
+    template <typename V>
+    void operator()(const std::string &key, const V &) {
+        keys.push_back(key);
+    }
+};
+
+// Visitor listing the masks of the nickname set and of the buckets.
+struct MaskCollector {
+    std::vector<std::pair<std::string, time_t> > &out;
+
+    explicit MaskCollector(std::vector<std::pair<std::string, time_t> > &out): out(out) {}
+
+    void operator()(const std::string &nick, const time_t &expires) {
+        out.push_back(std::make_pair(nick + "!*@*", expires));
+    }
+    template <typename Bucket>
+    void operator()(const std::string &, const Bucket &bucket) {
+        for (size_t i = 0; i < bucket.size(); ++i)
+            out.push_back(std::make_pair(bucket[i].text, bucket[i].expires));
+    }
+};
+
+void BanList::entries(std::vector<std::pair<std::string, time_t> > &out) const {
+    MaskCollector collector(out);
+    _exact.visit(collector);
+    _byNick.visit(collector);
+    _byHost.visit(collector);
+    for (size_t i = 0; i < _wildcard.size(); ++i)
+        out.push_back(std::make_pair(_wildcard[i].text, _wildcard[i].expires));
+}
+
+void BanList::rebuildBloom() {
+    KeyCollector nicks, hosts;
+    _exact.visit(nicks);
+    _byNick.visit(nicks);
+    _byHost.visit(hosts);
+
+    size_t keys = nicks.keys.size() + hosts.keys.size() + 1;
+    size_t bits = BLOOM_MIN_BITS;
+    while (bits < keys * BLOOM_BITS_PER_KEY * 2)
+        bits *= 2;
+    _bloom.assign(bits / 64, 0);
+    _bloomKeys = 0;
+    for (size_t i = 0; i < nicks.keys.size(); ++i)
+        bloomSet(KEY_NICK, nicks.keys[i]);
+    for (size_t i = 0; i < hosts.keys.size(); ++i)
+        bloomSet(KEY_HOST, hosts.keys[i]);
+}
+
+// Drops expired bans nobody tried to join with since they ran out, and
+// empty buckets, then rebuilds the Bloom filter without their keys.
+void BanList::sweep(time_t now) {
+    _nextSweep = now + BAN_SWEEP_INTERVAL;
+    size_t before = size();
+
+    KeyCollector expired(now, true);
+    _exact.visit(expired);
+    for (size_t i = 0; i < expired.keys.size(); ++i)
+        _exact.erase(expired.keys[i]);
+
+    HashMap<Bucket> *indexes[2] = { &_byNick, &_byHost };
+    for (int i = 0; i < 2; ++i) {
+        KeyCollector keys;
+        indexes[i]->visit(keys);
+        for (size_t k = 0; k < keys.keys.size(); ++k) {
+            Bucket *bucket = indexes[i]->find(keys.keys[k]);
+            for (size_t m = 0; m < bucket->size(); ) {
+                if (isLive((*bucket)[m].expires, now)) {
+                    ++m;
+                    continue;
+                }
+                (*bucket)[m] = bucket->back();
+                bucket->pop_back();
+                --_masks;
+            }
+            if (bucket->empty())
+                indexes[i]->erase(keys.keys[k]);
+        }
+    }
+    for (size_t m = 0; m < _wildcard.size(); ) {
+        if (isLive(_wildcard[m].expires, now)) {
+            ++m;
+            continue;
+        }
+        _wildcard[m] = _wildcard.back();
+        _wildcard.pop_back();
+        --_masks;
+    }
+
+    if (_useBloom && size() != before)
+        rebuildBloom();
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <ctime>
+#include <stdint.h>
+#include "HashMap.hpp"
+
+#define BAN_SWEEP_INTERVAL 60
+#define BLOOM_BITS_PER_KEY 16
+#define BLOOM_MIN_BITS 1024
+
+// One component of a ban mask ('*' and '?' wildcards). The common shapes
+// -- "*", "abc", "abc*", "*abc", "*abc*" -- are recognised once at compile
+// time and matched with a single compare or search; only the rest walk the
+// general wildcard matcher.
+class Glob {
+    public:
+        enum Kind {
+            GLOB_ANY,
+            GLOB_EXACT,
+            GLOB_PREFIX,
+            GLOB_SUFFIX,
+            GLOB_CONTAINS,
+            GLOB_WILDCARD
+        };
+
+    private:
+        Kind        _kind;
+        std::string _text;
+
+    public:
+        Glob();
+        explicit Glob(const std::string &pattern);
+
+        Kind kind() const;
+        bool matches(const std::string &text) const;
+};
+
+// Bans of one channel, matched against nick!user@host on every JOIN.
+//  - Plain nickname bans (what KICK adds) live in a hash set.
+//  - Masks whose nick or host part has no wildcard are bucketed under that
+//    literal, so a JOIN only looks at the masks that could apply to it.
+//  - The remaining masks are scanned, each precompiled into three Globs.
+// An optional Bloom filter over the nick and host keys answers most misses
+// without probing the hash tables. Bans may carry an expiry time; expired
+// ones are dropped when met during a match and by a periodic sweep.
+class BanList {
+    private:
+        enum Domain {
+            KEY_NICK = 'n',
+            KEY_HOST = 'h'
+        };
+
+        struct Mask {
+            std::string text;
+            Glob        nick;
+            Glob        user;
+            Glob        host;
+            time_t      expires;
+        };
+        typedef std::vector<Mask> Bucket;
+
+        HashMap<time_t>         _exact;
+        HashMap<Bucket>         _byNick;
+        HashMap<Bucket>         _byHost;
+        Bucket                  _wildcard;
+        size_t                  _masks;
+
+        bool                    _useBloom;
+        std::vector<uint64_t>   _bloom;
+        size_t                  _bloomKeys;
+        time_t                  _nextSweep;
+
+        bool addMask(Bucket &bucket, const Mask &mask);
+        bool matchBucket(Bucket &bucket, const std::string &nick, const std::string &user,
+                         const std::string &host, time_t now);
+        bool removeFromBucket(HashMap<Bucket> &index, const std::string &key, const std::string &text);
+
+        void bloomAdd(char domain, const std::string &key);
+        void bloomSet(char domain, const std::string &key);
+        bool bloomMayContain(char domain, const std::string &key) const;
+        void rebuildBloom();
+        void sweep(time_t now);
+
+    public:
+        explicit BanList(bool useBloom = true);
+
+        bool add(const std::string &mask, time_t expires = 0);
+        bool remove(const std::string &mask);
+        bool matches(const std::string &nick, const std::string &user, const std::string &host, time_t now);
+        size_t size() const;
+        // every ban as its normalized mask and expiry, expired ones included
+        void entries(std::vector<std::pair<std::string, time_t> > &out) const;
+
+        static std::string normalize(const std::string &mask);
+};
@@ -10,10 +10,14 @@ std::string Channel::getName() const {
     return _name;
 }
 
-std::set<Client*> Channel::getMembers() const {
+const std::set<ClientHandle> &Channel::getMembers() const {
     return _members;
 }
 
+size_t Channel::getMemberCount() const {
+    return _members.size() + _remoteMembers.size();
+}
+
 std::string Channel::getPassword() const {
     return _password;
 }
@@ -23,54 +27,163 @@ void Channel::setPassword(const std::string &password) {
 }
 
 void Channel::addOp(Client *client) {
-    _ops.insert(client);
+    _ops.insert(client->getHandle());
 }
 
 bool Channel::isOp(Client *client) const{
-    return _ops.find(client) != _ops.end();
+    return _ops.find(client->getHandle()) != _ops.end();
 }
 
 void Channel::addMember(Client *client) {
-    _members.insert(client);
+    _members.insert(client->getHandle());
+    client->addChannel(this);
+    if (!_savedOps.empty() && _savedOps.erase(client->getNickname()))
+        _ops.insert(client->getHandle());
+}
+
+// An op that leaves stops being one, on disk too.
+void Channel::removeMember(Client *client) {
+    _members.erase(client->getHandle());
+    if (_ops.erase(client->getHandle()))
+        _server->journalChannel(RECORD_DEOP, _name, client->getNickname());
+    client->removeChannel(this);
 }
 
+// A member of another server is dropped here and by every other server
+// from the KICK passed on over the links.
 void Channel::kickMember(Client* client, const std::string& nickname) {
     if (isOp(client)) {
-    for (std::set<Client*>::iterator it = _members.begin(); it != _members.end(); ++it) {
-        if ((*it)->getNickname() == nickname) {
-            _server->sendMessage((*it)->getFd(), "You have been kicked from the channel\r\n");
-            _members.erase(*it);
-            _blacklist.push_back(nickname);
-            std::cout << RED_COLOR << nickname << " has been kicked from the channel " << getName() << RESET_COLOR << std::endl;
+        Client *target = _server->findClientByNickname(nickname);
+        RemoteUser *remote = target ? NULL : findRemoteMember(nickname);
+        if ((target && isMember(target)) || remote) {
+            if (target) {
+                _server->sendMessage(target->getFd(), "You have been kicked from the channel\r\n");
+                removeMember(target);
+            } else
+                removeRemoteMember(remote);
+            _bans.add(nickname);
+            _server->journalChannel(RECORD_BAN, _name, nickname);
+            _server->relayLine("KICK " + _name + " " + nickname);
+            LOG_INFO(RED_COLOR << nickname << " has been kicked from the channel " << getName() << RESET_COLOR);
             _server->sendMessage(client->getFd(), "SUCCESS :User has been kicked from the channel\r\n");
             return;
         }
-    }
-    _server->sendMessage(client->getFd(), "ERROR :User not found in this channel\r\n");
+        _server->sendError(client, "ERROR :User not found in this channel\r\n");
     } else {
-        _server->sendMessage(client->getFd(), "ERROR :You are not op\r\n");
+        _server->sendError(client, "ERROR :You are not op\r\n");
     }
 }
 
+// The line is encoded once and every recipient queues a reference to the
+// same buffer.
 void Channel::broadcastMessage(const std::string &message, Client *client) {
-    for (std::set<Client *>::iterator it = _members.begin(); it != _members.end(); ++it) {
-        if (client != *it) {
-            std::string formatted_message = client->getNickname() + ": " + message;
-            _server->sendMessage((*it)->getFd(), formatted_message);
-        }
+    broadcastText(client->getNickname() + ": " + message, client);
+}
+
+// Queues `text` to the members connected here, but `except`.
+void Channel::broadcastText(const std::string &text, Client *except) {
+    if (_members.size() < 2 && except && isMember(except))
+        return;
+
+    SharedBuffer *buffer = SharedBuffer::create(text);
+    for (std::set<ClientHandle>::iterator it = _members.begin(); it != _members.end(); ++it) {
+        Client *member = _server->getClient(*it);
+        if (member && member != except)
+            _server->sendBuffer(member, buffer);
+    }
+    buffer->release();
+}
+
+bool Channel::isBanned(Client *client) {
+    return _bans.matches(client->getNickname(), client->getUsername(), client->getHostname(), time(NULL));
+}
+
+// `expires` is an absolute time, 0 for a permanent ban.
+bool Channel::ban(const std::string &mask, time_t expires) {
+    return _bans.add(mask, expires);
+}
+
+bool Channel::unban(const std::string &mask) {
+    return _bans.remove(mask);
+}
+
+const BanList &Channel::getBans() const {
+    return _bans;
+}
+
+void Channel::restoreOp(const std::string &nickname) {
+    _savedOps.insert(nickname);
+}
+
+void Channel::forgetOp(const std::string &nickname) {
+    _savedOps.erase(nickname);
+}
+
+const std::set<std::string> &Channel::getSavedOps() const {
+    return _savedOps;
+}
+
+// Nicknames of the ops present and of those restored but not back yet.
+void Channel::opNicknames(std::vector<std::string> &out) const {
+    for (std::set<ClientHandle>::const_iterator it = _ops.begin(); it != _ops.end(); ++it) {
+        Client *op = _server->getClient(*it);
+        if (op)
+            out.push_back(op->getNickname());
     }
+    out.insert(out.end(), _savedOps.begin(), _savedOps.end());
+}
+
+void Channel::addRemoteMember(RemoteUser *user) {
+    if (!_remoteMembers.insert(std::make_pair(user->nickname, user)).second)
+        return;
+    user->channels.insert(this);
+    ++_links[user->link];
+}
+
+void Channel::removeRemoteMember(RemoteUser *user) {
+    std::map<std::string, RemoteUser*>::iterator it = _remoteMembers.find(user->nickname);
+    if (it == _remoteMembers.end() || it->second != user)
+        return;
+    _remoteMembers.erase(it);
+    user->channels.erase(this);
+    std::map<Link*, size_t>::iterator link = _links.find(user->link);
+    if (--link->second == 0)
+        _links.erase(link);
+}
+
+// Called once the user's nickname has changed.
+void Channel::renameRemoteMember(RemoteUser *user, const std::string &old_nickname) {
+    _remoteMembers.erase(old_nickname);
+    _remoteMembers[user->nickname] = user;
+}
+
+RemoteUser *Channel::findRemoteMember(const std::string &nickname) const {
+    std::map<std::string, RemoteUser*>::const_iterator it = _remoteMembers.find(nickname);
+    return it == _remoteMembers.end() ? NULL : it->second;
+}
+
+const std::map<std::string, RemoteUser*> &Channel::getRemoteMembers() const {
+    return _remoteMembers;
+}
+
+const std::map<Link*, size_t> &Channel::getLinks() const {
+    return _links;
 }
 
-bool Channel::isBlacklisted(Client *client) const {
-    return std::find(_blacklist.begin(), _blacklist.end(), client->getNickname()) != _blacklist.end();
+const std::string &Channel::getOrigin() const {
+    return _origin;
+}
+
+void Channel::setOrigin(const std::string &server) {
+    _origin = server;
 }
 
 bool Channel::isMember(Client *client) const {
-    return _members.find(client) != _members.end();
+    return _members.find(client->getHandle()) != _members.end();
 }
 
 void Channel::leaveChannel(Client* client) {
-        _members.erase(client);
+        removeMember(client);
     
         std::string message = client->getNickname() + " has left the channel " + _name + "\r\n";
 
@@ -79,28 +192,55 @@ void Channel::leaveChannel(Client* client) {
 
 void Channel::deleteChannel(Client *client) {
     if (isOp(client)) {
-        std::string message = "Channel " + _name + " has been deleted by " + client->getNickname() + "\r\n";
-        broadcastMessage(message, client);
+        _server->relayLine("DELETE " + _name + " " + client->getNickname());
+        dissolve(client->getNickname(), client);
+    } else {
+        _server->sendError(client, "ERROR :You are not op\r\n");
+    }
+}
 
-        for (std::set<Client *>::iterator it = _members.begin(); it != _members.end(); ) {
-            Client* member = *it;
-            ++it;
+// Tells the members here that `nickname` deleted the channel, lets them
+// leave and frees the channel. `client` is the deleting member when it is
+// connected here.
+void Channel::dissolve(const std::string &nickname, Client *client) {
+    std::string message = "Channel " + _name + " has been deleted by " + nickname + "\r\n";
+    broadcastText(nickname + ": " + message, client);
+
+    while (!_members.empty()) {
+        Client *member = _server->getClient(*_members.begin());
+        if (member)
             leaveChannel(member);
-        }
+        else
+            _members.erase(_members.begin());
+    }
+    while (!_remoteMembers.empty())
+        removeRemoteMember(_remoteMembers.begin()->second);
 
-        _server->removeChannel(this);
+    _server->removeChannel(this);
 
-        std::cout << "Channel " << _name << " deleted." << std::endl;
-        delete this;
-    } else {
-        _server->sendMessage(client->getFd(), "ERROR :You are not op\r\n");
-    }
+    LOG_INFO("Channel " << _name << " deleted.");
+    delete this;
 }
 
-void Channel::listMembers(Client *client) {
-    std::string member_list = "Members of channel " + _name + ":\r\n";
-    for (std::set<Client *>::iterator it = _members.begin(); it != _members.end(); ++it) {
-        member_list += (*it)->getNickname() + "\r\n";
+// Appends one "nick\r\n" line per member after `after` until `out` reaches
+// `limit` bytes, moving `after` along, then the same for the members of
+// other servers after `remoteAfter`. Returns true once the last member is
+// written. Resuming by handle and nickname keeps working when members join
+// or leave between two calls.
+bool Channel::appendMembers(std::string &out, ClientHandle &after, std::string &remoteAfter, size_t limit) const {
+    std::set<ClientHandle>::const_iterator it = _members.upper_bound(after);
+    for (; it != _members.end() && out.size() < limit; ++it) {
+        Client *member = _server->getClient(*it);
+        if (member)
+            out += member->getNickname() + "\r\n";
+        after = *it;
+    }
+    if (it != _members.end())
+        return false;
+    std::map<std::string, RemoteUser*>::const_iterator remote = _remoteMembers.upper_bound(remoteAfter);
+    for (; remote != _remoteMembers.end() && out.size() < limit; ++remote) {
+        out += remote->first + "\r\n";
+        remoteAfter = remote->first;
     }
-    _server->sendMessage(client->getFd(), member_list);
+    return remote == _remoteMembers.end();
 }
@@ -3,8 +3,11 @@
 #include <iostream>
 #include <string>
 #include <set>
+#include <map>
 #include <vector>
 #include "Client.hpp"
+#include "BanList.hpp"
+#include "Link.hpp"
 #include "Server.hpp"
 
 class Server;
@@ -13,16 +16,28 @@ class Channel {
     private:
         std::string         _name;
         std::string         _password;
-        std::set<Client*>   _members;
-        std::set<Client*>   _ops;
+        // handles, not pointers: a member that vanished without leaving
+        // resolves to NULL instead of dangling
+        std::set<ClientHandle> _members;
+        std::set<ClientHandle> _ops;
+        // ops restored from disk by nickname, see ServerStore.cpp: one is
+        // made op again when a client with that nickname joins
+        std::set<std::string> _savedOps;
+        // members connected to other servers, by nickname, and how many of
+        // them each link leads to (see ServerLink.cpp)
+        std::map<std::string, RemoteUser*> _remoteMembers;
+        std::map<Link*, size_t> _links;
+        // the server that created the channel, empty for this one
+        std::string         _origin;
         Server              *_server;
-        std::vector<std::string> _blacklist;
+        BanList             _bans;
 
     public:
         Channel();
         Channel(const std::string &name, Server *server);
         std::string getName() const;
-        std::set<Client *> getMembers() const;
+        const std::set<ClientHandle> &getMembers() const;
+        size_t getMemberCount() const;
         std::string getPassword() const;
         void setPassword(const std::string &password);
         void addOp(Client *client);
@@ -31,9 +46,27 @@ class Channel {
         void leaveChannel(Client* client);
         void deleteChannel(Client *client);
         void broadcastMessage(const std::string &message, Client *client);
+        void broadcastText(const std::string &text, Client *except);
         void addMember(Client *client);
+        void removeMember(Client *client);
         void kickMember(Client *client, const std::string& nickname);
-        void listMembers(Client *client);
-        bool isBlacklisted(Client *client) const;
+        void dissolve(const std::string &nickname, Client *client);
+        bool appendMembers(std::string &out, ClientHandle &after, std::string &remoteAfter, size_t limit) const;
+        bool isBanned(Client *client);
+        bool ban(const std::string &mask, time_t expires);
+        bool unban(const std::string &mask);
+        const BanList &getBans() const;
+        void restoreOp(const std::string &nickname);
+        void forgetOp(const std::string &nickname);
+        const std::set<std::string> &getSavedOps() const;
+        void opNicknames(std::vector<std::string> &out) const;
+        void addRemoteMember(RemoteUser *user);
+        void removeRemoteMember(RemoteUser *user);
+        void renameRemoteMember(RemoteUser *user, const std::string &old_nickname);
+        RemoteUser *findRemoteMember(const std::string &nickname) const;
+        const std::map<std::string, RemoteUser*> &getRemoteMembers() const;
+        const std::map<Link*, size_t> &getLinks() const;
+        const std::string &getOrigin() const;
+        void setOrigin(const std::string &server);
         ~Channel();
 };
@@ -0,0 +1,339 @@
+#include "ChannelStore.hpp"
+#include "Log.hpp"
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A record is framed as u32 length, u32 checksum of the payload, payload;
+// the payload starts with the record's number.
+#define RECORD_HEADER_SIZE 8
+#define SNAPSHOT_HEADER_SIZE 24
+
+static uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// FNV-1a; it only has to tell a torn record from a whole one.
+static uint32_t checksum(const char *data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool writeAll(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+ChannelStore::ChannelStore(): _journalFd(-1), _dirFd(-1), _mapped(NULL), _mappedSize(0), _running(false),
+    _stopping(false), _sequence(0), _encoder(NULL), _context(NULL), _interval(0), _unsnapshotted(0) {
+    std::memset(&_stats, 0, sizeof(_stats));
+    pthread_mutex_init(&_lock, NULL);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&_wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+}
+
+ChannelStore::~ChannelStore() {
+    stop();
+    releaseSnapshot();
+    if (_journalFd != -1)
+        close(_journalFd);
+    if (_dirFd != -1)
+        close(_dirFd);
+    pthread_cond_destroy(&_wake);
+    pthread_mutex_destroy(&_lock);
+}
+
+std::string ChannelStore::path(const char *file) const {
+    return _dir + "/" + file;
+}
+
+// Creates the directory if needed and opens the journal for appending.
+bool ChannelStore::open(const std::string &dir) {
+    _dir = dir;
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+        return false;
+    _dirFd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    _journalFd = ::open(path(JOURNAL_FILE).c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    return _dirFd != -1 && _journalFd != -1;
+}
+
+bool ChannelStore::isOpen() const {
+    return _journalFd != -1;
+}
+
+bool ChannelStore::mapSnapshot(const char *&body, size_t &size, uint64_t &sequence) {
+    body = NULL;
+    size = 0;
+    sequence = 0;
+    int fd = ::open(path(SNAPSHOT_FILE).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return errno == ENOENT;
+    struct stat info;
+    if (fstat(fd, &info) == -1 || info.st_size < SNAPSHOT_HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return false;
+    _mapped = static_cast<const char *>(mapped);
+    _mappedSize = info.st_size;
+    madvise(mapped, _mappedSize, MADV_SEQUENTIAL);
+
+    StateReader header(_mapped, SNAPSHOT_HEADER_SIZE);
+    uint32_t magic = header.u32();
+    uint32_t version = header.u32();
+    sequence = header.u64();
+    uint64_t length = header.u64();
+    if (magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION || length != _mappedSize - SNAPSHOT_HEADER_SIZE)
+        return false;
+    body = _mapped + SNAPSHOT_HEADER_SIZE;
+    size = length;
+    return true;
+}
+
+void ChannelStore::releaseSnapshot() {
+    if (_mapped)
+        munmap(const_cast<char *>(_mapped), _mappedSize);
+    _mapped = NULL;
+    _mappedSize = 0;
+}
+
+size_t ChannelStore::replay(uint64_t after, Replayer replayer, void *context) {
+    _sequence = after;
+    int fd = ::open(path(JOURNAL_FILE).c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1 || info.st_size == 0) {
+        if (fd != -1)
+            close(fd);
+        return 0;
+    }
+    void *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return 0;
+    const char *data = static_cast<const char *>(mapped);
+    size_t size = info.st_size;
+
+    size_t offset = 0;
+    size_t replayed = 0;
+    while (size - offset >= RECORD_HEADER_SIZE) {
+        StateReader frame(data + offset, RECORD_HEADER_SIZE);
+        uint32_t length = frame.u32();
+        uint32_t sum = frame.u32();
+        const char *payload = data + offset + RECORD_HEADER_SIZE;
+        if (length < sizeof(uint64_t) || length > size - offset - RECORD_HEADER_SIZE
+            || checksum(payload, length) != sum)
+            break;
+        StateReader record(payload, length);
+        uint64_t sequence = record.u64();
+        if (sequence > after) {
+            replayer(context, record);
+            _sequence = sequence;
+            ++replayed;
+        }
+        offset += RECORD_HEADER_SIZE + length;
+    }
+    munmap(mapped, size);
+    if (offset < size) {
+        LOG_WARN("Channel store: cutting " << size - offset << " bytes of a torn record off the journal");
+        if (ftruncate(_journalFd, offset) == -1 || fsync(_journalFd) == -1)
+            LOG_ERROR("Channel store: truncating the journal failed: " << strerror(errno));
+    }
+    _unsnapshotted = offset;
+    return replayed;
+}
+
+void ChannelStore::start(Encoder encoder, void *context, int interval) {
+    if (_running || !isOpen())
+        return;
+    _encoder = encoder;
+    _context = context;
+    _interval = interval;
+    _stopping = false;
+    if (pthread_create(&_writer, NULL, &ChannelStore::writerMain, this) == 0)
+        _running = true;
+    else
+        LOG_ERROR("Channel store: the writer thread could not be started");
+}
+
+void ChannelStore::stop() {
+    if (!_running)
+        return;
+    pthread_mutex_lock(&_lock);
+    _stopping = true;
+    pthread_cond_signal(&_wake);
+    pthread_mutex_unlock(&_lock);
+    pthread_join(_writer, NULL);
+    _running = false;
+}
+
+void ChannelStore::append(ChannelRecord type, const std::string &channel, const std::string &target,
+                          uint64_t expires, const std::string &password) {
+    pthread_mutex_lock(&_lock);
+    StateWriter record;
+    record.u64(++_sequence);
+    record.u8(type);
+    record.str(channel);
+    record.str(target);
+    record.u64(expires);
+    record.str(password);
+    const std::string &payload = record.data();
+    StateWriter frame;
+    frame.u32(payload.size());
+    frame.u32(checksum(payload.data(), payload.size()));
+    bool wake = _pending.empty();
+    _pending += frame.data();
+    _pending += payload;
+    ++_stats.records;
+    if (wake)
+        pthread_cond_signal(&_wake);
+    pthread_mutex_unlock(&_lock);
+}
+
+uint64_t ChannelStore::sequence() {
+    pthread_mutex_lock(&_lock);
+    uint64_t sequence = _sequence;
+    pthread_mutex_unlock(&_lock);
+    return sequence;
+}
+
+void ChannelStore::setSequence(uint64_t sequence) {
+    pthread_mutex_lock(&_lock);
+    _sequence = sequence;
+    pthread_mutex_unlock(&_lock);
+}
+
+StoreStats ChannelStore::stats() {
+    pthread_mutex_lock(&_lock);
+    StoreStats stats = _stats;
+    pthread_mutex_unlock(&_lock);
+    return stats;
+}
+
+void *ChannelStore::writerMain(void *arg) {
+    static_cast<ChannelStore *>(arg)->writerLoop();
+    return NULL;
+}
+
+// Group commit: whatever was appended while the last batch was written goes
+// out in the next write and sync. A snapshot is due once the interval has
+// passed with something in the journal, or the journal has grown large; a
+// snapshot that failed is only tried again after the interval.
+void ChannelStore::writerLoop() {
+    uint64_t lastSnapshot = monotonicNs();
+    bool lastFailed = false;
+    pthread_mutex_lock(&_lock);
+    while (true) {
+        uint64_t due = lastSnapshot + static_cast<uint64_t>(_interval) * 1000000000ULL;
+        bool snapshot = _unsnapshotted > 0
+            && (monotonicNs() >= due || (_unsnapshotted >= JOURNAL_SNAPSHOT_BYTES && !lastFailed));
+        if (_pending.empty() && !_stopping && !snapshot) {
+            if (_unsnapshotted == 0) {
+                pthread_cond_wait(&_wake, &_lock);
+            } else {
+                struct timespec deadline;
+                deadline.tv_sec = due / 1000000000ULL;
+                deadline.tv_nsec = due % 1000000000ULL;
+                pthread_cond_timedwait(&_wake, &_lock, &deadline);
+            }
+            continue;
+        }
+        std::string batch;
+        batch.swap(_pending);
+        bool stopping = _stopping;
+        pthread_mutex_unlock(&_lock);
+
+        bool failed = !batch.empty() && !writeJournal(batch);
+        if (snapshot && !stopping) {
+            lastFailed = !writeSnapshot(_encoder, _context);
+            lastSnapshot = monotonicNs();
+            failed = failed || lastFailed;
+        }
+
+        pthread_mutex_lock(&_lock);
+        if (!batch.empty())
+            _stats.journalBytes += batch.size();
+        if (failed)
+            ++_stats.errors;
+        if (stopping && _pending.empty())
+            break;
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+bool ChannelStore::writeJournal(const std::string &batch) {
+    if (!writeAll(_journalFd, batch.data(), batch.size()) || fdatasync(_journalFd) == -1) {
+        LOG_ERROR("Channel store: writing the journal failed: " << strerror(errno));
+        return false;
+    }
+    _unsnapshotted += batch.size();
+    return true;
+}
+
+// The encoder holds the server's lock while it runs; the file is written
+// without it.
+bool ChannelStore::writeSnapshot(Encoder encoder, void *context) {
+    uint64_t started = monotonicNs();
+    StateWriter body;
+    uint64_t sequence = encoder(context, body);
+    StateWriter header;
+    header.u32(SNAPSHOT_MAGIC);
+    header.u32(SNAPSHOT_VERSION);
+    header.u64(sequence);
+    header.u64(body.data().size());
+
+    std::string temporary = path(SNAPSHOT_FILE ".tmp");
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool written = fd != -1
+        && writeAll(fd, header.data().data(), header.data().size())
+        && writeAll(fd, body.data().data(), body.data().size())
+        && fsync(fd) == 0;
+    if (fd != -1)
+        close(fd);
+    if (!written || rename(temporary.c_str(), path(SNAPSHOT_FILE).c_str()) == -1 || fsync(_dirFd) == -1) {
+        LOG_ERROR("Channel store: writing the snapshot failed: " << strerror(errno));
+        unlink(temporary.c_str());
+        return false;
+    }
+    // Every record written so far is in the snapshot, and records still
+    // pending are only written after this.
+    if (ftruncate(_journalFd, 0) == -1 || fsync(_journalFd) == -1)
+        LOG_ERROR("Channel store: emptying the journal failed: " << strerror(errno));
+    else
+        _unsnapshotted = 0;
+
+    uint64_t took = monotonicNs() - started;
+    pthread_mutex_lock(&_lock);
+    ++_stats.snapshots;
+    _stats.snapshotBytes = header.data().size() + body.data().size();
+    _stats.snapshotNs = took;
+    pthread_mutex_unlock(&_lock);
+    LOG_INFO("Channel store: snapshot of " << _stats.snapshotBytes << " bytes up to record " << sequence
+             << " written in " << took / 1000 << " us");
+    return true;
+}
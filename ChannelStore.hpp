@@ -0,0 +1,114 @@
+#pragma once
+
+#include <string>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "StateCodec.hpp"
+
+#define SNAPSHOT_FILE "channels.snapshot"
+#define JOURNAL_FILE "channels.journal"
+#define SNAPSHOT_MAGIC 0x53484349u
+#define SNAPSHOT_VERSION 1
+// a journal this large is folded into a snapshot before the interval is up
+#define JOURNAL_SNAPSHOT_BYTES (64 * 1024 * 1024)
+
+// What a journal record changes. Every record carries a channel name, a
+// target (a nickname or ban mask), an expiry and a password; each type
+// uses the fields listed.
+enum ChannelRecord {
+    RECORD_CREATE = 1,  // channel, target (its first op), password
+    RECORD_DELETE,      // channel
+    RECORD_ADDOP,       // channel, target
+    RECORD_DEOP,        // channel, target
+    RECORD_BAN,         // channel, target, expiry
+    RECORD_UNBAN,       // channel, target
+    RECORD_PASSWORD     // channel, password
+};
+
+struct StoreStats {
+    uint64_t    records;
+    uint64_t    journalBytes;
+    uint64_t    snapshots;
+    uint64_t    snapshotBytes;
+    uint64_t    snapshotNs;
+    uint64_t    errors;
+};
+
+// Channel persistence on disk, in two files of one directory:
+//  - the journal, framed records appended as channels change;
+//  - the snapshot, every channel as of one journal record, in the flat
+//    StateCodec encoding so it is read straight from a read-only mapping.
+// Records are numbered. A snapshot names the last record it includes, so
+// replaying the journal on top of it skips what is already there, and a
+// crash between writing a snapshot and emptying the journal is harmless.
+//
+// Event loops only append records to a buffer. A writer thread writes
+// them out, syncs them, and now and then takes a snapshot: the encoder
+// runs on the writer thread, and a snapshot is written to a temporary file
+// and renamed over the previous one, so there always is a complete one.
+class ChannelStore {
+    public:
+        // Encodes every channel, after the header, and returns the number
+        // of the last record the encoding includes.
+        typedef uint64_t (*Encoder)(void *context, StateWriter &state);
+        // Applies one record, read past its number.
+        typedef void (*Replayer)(void *context, StateReader &record);
+
+    private:
+        std::string     _dir;
+        int             _journalFd;
+        int             _dirFd;
+        const char      *_mapped;
+        size_t          _mappedSize;
+
+        pthread_t       _writer;
+        pthread_mutex_t _lock;
+        pthread_cond_t  _wake;
+        bool            _running;
+        bool            _stopping;
+        std::string     _pending;
+        uint64_t        _sequence;
+        Encoder         _encoder;
+        void            *_context;
+        int             _interval;
+        // journal bytes written since the last snapshot, writer thread only
+        uint64_t        _unsnapshotted;
+        StoreStats      _stats;
+
+        ChannelStore(const ChannelStore &);
+        ChannelStore &operator=(const ChannelStore &);
+
+        static void *writerMain(void *arg);
+        void writerLoop();
+        bool writeJournal(const std::string &batch);
+        std::string path(const char *file) const;
+
+    public:
+        ChannelStore();
+        ~ChannelStore();
+
+        bool open(const std::string &dir);
+        bool isOpen() const;
+
+        // Start-up, before the writer runs. The body of the snapshot stays
+        // mapped until releaseSnapshot; without a snapshot, `body` is NULL.
+        bool mapSnapshot(const char *&body, size_t &size, uint64_t &sequence);
+        void releaseSnapshot();
+        // Replays the records numbered after `after` and returns how many
+        // ran. A torn record at the end, left by a crash, is cut off.
+        size_t replay(uint64_t after, Replayer replayer, void *context);
+
+        void start(Encoder encoder, void *context, int interval);
+        // Writes out what is pending and joins the writer.
+        void stop();
+        // Takes a snapshot right away; only while the writer is stopped.
+        bool writeSnapshot(Encoder encoder, void *context);
+
+        // Appends one record; callers keep the records in order.
+        void append(ChannelRecord type, const std::string &channel, const std::string &target,
+                    uint64_t expires, const std::string &password);
+        uint64_t sequence();
+        void setSequence(uint64_t sequence);
+        StoreStats stats();
+};
@@ -1,11 +1,25 @@
 #include "Client.hpp"
 
-Client::Client(int fd): _fd(fd), _isAuthenticated(false), _isOperator(false) {}
+Client::Client(int fd, int shard, uint32_t generation)
+    : _fd(fd), _shard(shard), _generation(generation), _isAuthenticated(false), _isOperator(false), _events(0), _isClosing(false), _isDirty(false), _pingSent(false), _isHeavy(false), _ringOps(0),
+      _sendHead(0), _sendQueueBytes(0), _sharedBytes(0), _tailWritable(false), _activeChannel(NULL), _listing(NULL),
+      _tokens(0), _tokensAt(0), _turn(0), _turnLines(0), _backlog(NULL), _seenAt(0), _activeAt(0) {
+    _timer.owner = fd;
+    updatePrefix();
+}
 
 int Client::getFd() const {
     return _fd;
 }
 
+int Client::getShard() const {
+    return _shard;
+}
+
+ClientHandle Client::getHandle() const {
+    return ClientHandle(_fd, _generation);
+}
+
 const std::string &Client::getNickname() const {
     return _nickname;
 }
@@ -26,6 +40,10 @@ const std::string &Client::getRealname() const {
     return _realname;
 }
 
+const std::string &Client::getPrefix() const {
+    return _prefix;
+}
+
 bool Client::getIsAuthenticated() const {
     return _isAuthenticated;
 }
@@ -36,18 +54,30 @@ bool Client::getIsOperator() const {
 
 void Client::setFd(int fd) {
     _fd = fd;
+    _timer.owner = fd;
 }
 
 void Client::setNickname(const std::string &nickname) {
     _nickname = nickname;
+    updatePrefix();
 }
 
 void Client::setUsername(const std::string &username) {
     _username = username;
+    updatePrefix();
 }
 
 void Client::setHostname(const std::string &hostname) {
     _hostname = hostname;
+    updatePrefix();
+}
+
+// Every reply starts with the prefix, so it is rendered once per identity
+// change instead of once per reply.
+void Client::updatePrefix() {
+    _prefix.clear();
+    _prefix.reserve(_nickname.size() + _username.size() + _hostname.size() + 4);
+    _prefix.append(1, ':').append(_nickname).append(1, '!').append(_username).append(1, '@').append(_hostname).append(1, ' ');
 }
 
 void Client::setServername(const std::string &servername) {
@@ -66,4 +96,411 @@ void Client::setIsOperator(bool isOperator) {
     _isOperator = isOperator;
 }
 
-Client::~Client() {}
\ No newline at end of file
+LineBuffer &Client::getInputBuffer() {
+    return _input;
+}
+
+const std::set<Channel*> &Client::getChannels() const {
+    return _channels;
+}
+
+Channel *Client::getActiveChannel() const {
+    return _activeChannel;
+}
+
+void Client::setActiveChannel(Channel *channel) {
+    _activeChannel = channel;
+}
+
+// The most recently joined channel becomes the target of channel commands
+// and plain text.
+void Client::addChannel(Channel *channel) {
+    _channels.insert(channel);
+    _activeChannel = channel;
+}
+
+void Client::removeChannel(Channel *channel) {
+    _channels.erase(channel);
+    if (_activeChannel == channel)
+        _activeChannel = _channels.empty() ? NULL : *_channels.begin();
+}
+
+// Private replies are appended to the last queued chunk while this client
+// is its only owner, so a burst of replies stays one contiguous write.
+void Client::queueMessage(const std::string &message) {
+    queueMessage(message.data(), message.size());
+}
+
+void Client::queueMessage(const char *data, size_t length) {
+    if (_tailWritable && _sendQueue.back().buffer->isUnique()) {
+        _sendQueue.back().buffer->append(data, length);
+    } else {
+        OutChunk chunk;
+        chunk.buffer = SharedBuffer::create(data, length);
+        chunk.offset = 0;
+        chunk.shared = false;
+        _sendQueue.push_back(chunk);
+        _tailWritable = true;
+    }
+    _sendQueueBytes += length;
+}
+
+void Client::queueBuffer(SharedBuffer *buffer) {
+    OutChunk chunk;
+    buffer->retain();
+    chunk.buffer = buffer;
+    chunk.offset = 0;
+    chunk.shared = true;
+    _sendQueue.push_back(chunk);
+    _sendQueueBytes += buffer->size();
+    _sharedBytes += buffer->size();
+    _tailWritable = false;
+}
+
+// Points up to `max` iovecs at the head of the queue. An io_uring send may
+// still read them after this returns, so the tail chunk stops taking appends.
+size_t Client::buildIov(struct iovec *iov, size_t max) {
+    size_t count = 0;
+    _tailWritable = false;
+    for (size_t i = _sendHead; i < _sendQueue.size() && count < max; ++i, ++count) {
+        const OutChunk &chunk = _sendQueue[i];
+        iov[count].iov_base = const_cast<char *>(chunk.buffer->data() + chunk.offset);
+        iov[count].iov_len = chunk.buffer->size() - chunk.offset;
+    }
+    return count;
+}
+
+// Drops `bytes` that reached the socket from the head of the queue.
+void Client::consumeSent(size_t bytes) {
+    _sendQueueBytes -= bytes;
+    while (bytes > 0) {
+        OutChunk &chunk = _sendQueue[_sendHead];
+        size_t left = chunk.buffer->size() - chunk.offset;
+        if (bytes < left) {
+            chunk.offset += bytes;
+            if (chunk.shared)
+                _sharedBytes -= bytes;
+            break;
+        }
+        bytes -= left;
+        if (chunk.shared)
+            _sharedBytes -= left;
+        chunk.buffer->release();
+        ++_sendHead;
+    }
+    compactSendQueue();
+}
+
+// Drops sent chunks from the front of the vector. A drained queue that grew
+// past SENDQ_KEEP_CHUNKS gives its memory back.
+void Client::compactSendQueue() {
+    if (_sendHead == _sendQueue.size()) {
+        if (_sendQueue.capacity() > SENDQ_KEEP_CHUNKS)
+            std::vector<OutChunk>().swap(_sendQueue);
+        else
+            _sendQueue.clear();
+        _sendHead = 0;
+        _tailWritable = false;
+    } else if (_sendHead > _sendQueue.size() / 2) {
+        _sendQueue.erase(_sendQueue.begin(), _sendQueue.begin() + _sendHead);
+        _sendHead = 0;
+    }
+}
+
+// Writes as much of the queue as the socket accepts, gathering up to
+// SENDQ_IOV_MAX chunks per sendmsg(), and adds the number of calls made to
+// `calls`. Every call but the one reaching the end of the queue passes
+// MSG_MORE, so the kernel doesn't emit a short segment between two of them.
+// A short write means the socket buffer is full, so the rest waits for
+// EPOLLOUT instead of a call that would only return EAGAIN. Returns false
+// when the connection is broken and the client has to be dropped.
+bool Client::flushSendQueue(size_t &calls) {
+    while (hasPendingOutput()) {
+        struct iovec iov[SENDQ_IOV_MAX];
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = buildIov(iov, SENDQ_IOV_MAX);
+        size_t wanted = 0;
+        for (size_t i = 0; i < msg.msg_iovlen; ++i)
+            wanted += iov[i].iov_len;
+        int flags = MSG_NOSIGNAL;
+        if (msg.msg_iovlen < getPendingChunks())
+            flags |= MSG_MORE;
+
+        ++calls;
+        ssize_t sent = sendmsg(_fd, &msg, flags);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            return false;
+        }
+        consumeSent(sent);
+        if (static_cast<size_t>(sent) < wanted)
+            break;
+    }
+    return true;
+}
+
+// Drops the queued chunks not a byte of which was written yet, so a final
+// line queued next directly follows a complete one. Only safe while no
+// io_uring send references the queue. Returns the bytes dropped.
+size_t Client::discardUnsent() {
+    size_t keep = _sendHead;
+    if (keep < _sendQueue.size() && _sendQueue[keep].offset > 0)
+        ++keep;
+    size_t dropped = 0;
+    for (size_t i = keep; i < _sendQueue.size(); ++i) {
+        size_t bytes = _sendQueue[i].buffer->size() - _sendQueue[i].offset;
+        dropped += bytes;
+        if (_sendQueue[i].shared)
+            _sharedBytes -= bytes;
+        _sendQueue[i].buffer->release();
+    }
+    _sendQueue.resize(keep);
+    _sendQueueBytes -= dropped;
+    _tailWritable = false;
+    compactSendQueue();
+    return dropped;
+}
+
+// Appends every byte queued and not yet written, in order.
+void Client::appendUnsent(std::string &out) const {
+    for (size_t i = _sendHead; i < _sendQueue.size(); ++i)
+        out.append(_sendQueue[i].buffer->data() + _sendQueue[i].offset,
+                   _sendQueue[i].buffer->size() - _sendQueue[i].offset);
+}
+
+size_t Client::getPendingChunks() const {
+    return _sendQueue.size() - _sendHead;
+}
+
+size_t Client::getSendQueueSize() const {
+    return _sendQueueBytes;
+}
+
+bool Client::hasPendingOutput() const {
+    return _sendHead < _sendQueue.size();
+}
+
+bool Client::isClosing() const {
+    return _isClosing;
+}
+
+void Client::setIsClosing(bool closing) {
+    _isClosing = closing;
+}
+
+bool Client::isDirty() const {
+    return _isDirty;
+}
+
+void Client::setIsDirty(bool dirty) {
+    _isDirty = dirty;
+}
+
+TimerNode &Client::getTimer() {
+    return _timer;
+}
+
+uint32_t Client::getSeenAt() const {
+    return _seenAt;
+}
+
+uint32_t Client::getActiveAt() const {
+    return _activeAt;
+}
+
+// Any input proves the connection alive and answers a pending PING.
+void Client::touch(uint32_t tick) {
+    _seenAt = tick;
+    _pingSent = false;
+}
+
+void Client::setActiveAt(uint32_t tick) {
+    _activeAt = tick;
+}
+
+bool Client::isPingSent() const {
+    return _pingSent;
+}
+
+void Client::setPingSent(bool sent) {
+    _pingSent = sent;
+}
+
+ClientMemory Client::memoryUsage() const {
+    ClientMemory memory;
+    memory.input = _input.capacity();
+    if (_backlog)
+        memory.input += sizeof(InputBacklog) + _backlog->data.capacity();
+    memory.shared = _sharedBytes;
+    memory.output = _sendQueueBytes - _sharedBytes + _sendQueue.capacity() * sizeof(OutChunk);
+    return memory;
+}
+
+ClientMemory Client::getAccounted() const {
+    ClientMemory memory;
+    memory.input = __atomic_load_n(&_accounted.input, __ATOMIC_RELAXED);
+    memory.output = __atomic_load_n(&_accounted.output, __ATOMIC_RELAXED);
+    memory.shared = __atomic_load_n(&_accounted.shared, __ATOMIC_RELAXED);
+    return memory;
+}
+
+void Client::setAccounted(const ClientMemory &memory) {
+    __atomic_store_n(&_accounted.input, memory.input, __ATOMIC_RELAXED);
+    __atomic_store_n(&_accounted.output, memory.output, __ATOMIC_RELAXED);
+    __atomic_store_n(&_accounted.shared, memory.shared, __ATOMIC_RELAXED);
+}
+
+bool Client::isHeavy() const {
+    return _isHeavy;
+}
+
+void Client::setIsHeavy(bool heavy) {
+    _isHeavy = heavy;
+}
+
+int Client::getRingOps() const {
+    return _ringOps;
+}
+
+void Client::setRingOps(int ops) {
+    _ringOps = ops;
+}
+
+uint32_t Client::getEvents() const {
+    return _events;
+}
+
+bool Client::watch(int epoll_fd, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = _fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, _fd, &ev) == -1)
+        return false;
+    _events = events;
+    return true;
+}
+
+bool Client::rewatch(int epoll_fd, uint32_t events) {
+    if (events == _events)
+        return true;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = _fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, _fd, &ev) == -1)
+        return false;
+    _events = events;
+    return true;
+}
+
+void Client::unwatch(int epoll_fd) {
+    if (_events == 0)
+        return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, _fd, NULL);
+    _events = 0;
+}
+
+ListCursor *Client::getListing() const {
+    return _listing;
+}
+
+// Replaces any listing still in progress.
+ListCursor *Client::startListing(ListCursor::Kind kind, const std::string &channel) {
+    bool queued = _listing && _listing->queued;
+    delete _listing;
+    _listing = new ListCursor(kind, channel);
+    _listing->queued = queued;
+    return _listing;
+}
+
+void Client::endListing() {
+    delete _listing;
+    _listing = NULL;
+}
+
+int32_t Client::getTokens() const {
+    return _tokens;
+}
+
+uint32_t Client::getTokensAt() const {
+    return _tokensAt;
+}
+
+void Client::resetTokens(int32_t tokens, uint32_t now) {
+    _tokens = tokens;
+    _tokensAt = now;
+}
+
+// `now` is a millisecond clock; the difference stays right across its wrap.
+void Client::refillTokens(uint32_t now, int32_t rate, int32_t limit) {
+    int64_t tokens = _tokens + static_cast<int64_t>(static_cast<uint32_t>(now - _tokensAt)) * rate;
+    _tokens = tokens > limit ? limit : static_cast<int32_t>(tokens);
+    _tokensAt = now;
+}
+
+void Client::spendTokens(int32_t amount) {
+    _tokens -= amount;
+}
+
+int &Client::lineBudget(uint32_t tick, int budget) {
+    if (_turn != tick) {
+        _turn = tick;
+        _turnLines = budget;
+    }
+    return _turnLines;
+}
+
+bool Client::isThrottled() const {
+    return _backlog != NULL;
+}
+
+InputBacklog *Client::getBacklog() const {
+    return _backlog;
+}
+
+void Client::startThrottle() {
+    if (!_backlog)
+        _backlog = new InputBacklog();
+}
+
+void Client::endThrottle() {
+    delete _backlog;
+    _backlog = NULL;
+}
+
+size_t Client::getBacklogSize() const {
+    return _backlog ? _backlog->data.size() - _backlog->head : 0;
+}
+
+void Client::appendBacklog(const char *data, size_t length) {
+    startThrottle();
+    if (_backlog->head > 0 && _backlog->head >= _backlog->data.size() / 2) {
+        _backlog->data.erase(0, _backlog->head);
+        _backlog->head = 0;
+    }
+    _backlog->data.append(data, length);
+}
+
+// Moves as much of the backlog into the line buffer as fits. Returns false
+// when there was nothing left to move.
+bool Client::refillInput() {
+    size_t left = getBacklogSize();
+    if (left == 0)
+        return false;
+    size_t chunk = std::min(left, _input.writable());
+    std::memcpy(_input.writePtr(), _backlog->data.data() + _backlog->head, chunk);
+    _input.commit(chunk);
+    _backlog->head += chunk;
+    return true;
+}
+
+Client::~Client() {
+    delete _listing;
+    delete _backlog;
+    for (size_t i = _sendHead; i < _sendQueue.size(); ++i)
+        _sendQueue[i].buffer->release();
+}
\ No newline at end of file
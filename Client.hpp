@@ -1,29 +1,141 @@
 #pragma once
 
 #include <iostream>
+#include <algorithm>
 #include <string>
+#include <set>
+#include <vector>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <cerrno>
+#include <cstring>
+#include "LineBuffer.hpp"
+#include "SharedBuffer.hpp"
+#include "ClientHandle.hpp"
+#include "TimerWheel.hpp"
+
+#define SENDQ_IOV_MAX 64
+#define SENDQ_KEEP_CHUNKS 4
+
+class Channel;
+
+// Where a LIST or LSTMEMBERS reply stopped. Long listings are sent a chunk at
+// a time as the client's send queue drains (see Server::continueListing).
+struct ListCursor {
+    enum Kind {
+        LIST_CHANNELS,
+        LIST_MEMBERS
+    };
+
+    Kind            kind;
+    std::string     channel;    // LIST: last channel sent; LSTMEMBERS: the channel listed
+    ClientHandle    member;     // LSTMEMBERS: last member sent
+    std::string     remote;     // LSTMEMBERS: last member of another server sent
+    bool            queued;     // waiting in the shard's resume list
+
+    ListCursor(Kind kind, const std::string &channel): kind(kind), channel(channel), queued(false) {}
+};
+
+// Input received while the client is throttled. It follows whatever is
+// still in the line buffer and is moved over as lines are run (see
+// Server::resumeInput).
+struct InputBacklog {
+    std::string     data;
+    size_t          head;       // bytes of data already moved over
+    // io_uring: the multishot receive was cancelled because the backlog
+    // is full, and has ended (see Server::resumeRecv)
+    bool            recvCancelled;
+    bool            recvStopped;
+
+    InputBacklog(): head(0), recvCancelled(false), recvStopped(false) {}
+};
+
+// Memory a client holds, by kind. Broadcast buffers are charged in full to
+// every client referencing them, since a stuck reader keeps them alive on
+// its own once the others are done (see Server::account).
+struct ClientMemory {
+    size_t  input;      // line buffer and throttle backlog
+    size_t  output;     // private send queue chunks and the queue itself
+    size_t  shared;     // broadcast buffers referenced by the send queue
+
+    ClientMemory(): input(0), output(0), shared(0) {}
+
+    size_t total() const {
+        return input + output + shared;
+    }
+};
 
 class Client {
     private:
         int         _fd;
+        int         _shard;
+        uint32_t    _generation;
         std::string _nickname;
         std::string _username;
         std::string _hostname;
         std::string _servername;
         std::string _realname;
+        std::string _prefix;        // ":nick!user@host ", see updatePrefix
         bool        _isAuthenticated;
         bool        _isOperator;
+        uint32_t    _events;
+        bool        _isClosing;
+        bool        _isDirty;
+        bool        _pingSent;      // a keepalive PING awaits its answer
+        bool        _isHeavy;       // in its shard's list of large consumers
+        int         _ringOps;
+        // offset fits 32 bits as the queue never grows past max-sendq
+        struct OutChunk {
+            SharedBuffer    *buffer;
+            uint32_t        offset;
+            bool            shared;     // a broadcast, see queueBuffer
+        };
+        // Chunks before _sendHead are already sent. A vector, unlike a
+        // deque, allocates nothing until the first message is queued.
+        std::vector<OutChunk> _sendQueue;
+        size_t      _sendHead;
+        size_t      _sendQueueBytes;
+        size_t      _sharedBytes;   // part of _sendQueueBytes in broadcasts
+        bool        _tailWritable;
+        LineBuffer  _input;
+        std::set<Channel*> _channels;
+        Channel     *_activeChannel;
+        // only allocated while a listing is in progress
+        ListCursor  *_listing;
+        // flood control balance, see refillTokens
+        int32_t     _tokens;
+        uint32_t    _tokensAt;
+        // lines left to run in event-loop iteration _turn
+        uint32_t    _turn;
+        int         _turnLines;
+        // only allocated while the client is throttled
+        InputBacklog *_backlog;
+        // the client's one deadline on its shard's wheel, and the ticks
+        // of its last input and of its last command other than PING/PONG
+        TimerNode   _timer;
+        uint32_t    _seenAt;
+        uint32_t    _activeAt;
+        // last memoryUsage() added to the shard's total; written by the
+        // owning shard, read by any thread rendering the top consumers
+        ClientMemory _accounted;
+
+        void compactSendQueue();
+        void updatePrefix();
 
     public:
-        std::string buffer;
-        Client(int fd);
+        Client(int fd, int shard = 0, uint32_t generation = 0);
 
         int getFd() const;
+        int getShard() const;
+        ClientHandle getHandle() const;
         const std::string &getNickname() const;
         const std::string &getUsername() const;
         const std::string &getHostname() const;
         const std::string &getServername() const;
         const std::string &getRealname() const;
+        const std::string &getPrefix() const;
         
         bool getIsAuthenticated() const;
         bool getIsOperator() const;
@@ -36,6 +148,84 @@ class Client {
         void setRealname(const std::string &realname);
         void setIsAuthenticated(bool authenticated);
         void setIsOperator(bool isOp);
-    
+
+        LineBuffer &getInputBuffer();
+
+        // channel membership, kept in sync by Channel::addMember/removeMember
+        const std::set<Channel*> &getChannels() const;
+        Channel *getActiveChannel() const;
+        void setActiveChannel(Channel *channel);
+        void addChannel(Channel *channel);
+        void removeChannel(Channel *channel);
+
+        // outbound queue
+        void queueMessage(const std::string &message);
+        void queueMessage(const char *data, size_t length);
+        void queueBuffer(SharedBuffer *buffer);
+        bool flushSendQueue(size_t &calls);
+        size_t buildIov(struct iovec *iov, size_t max);
+        void consumeSent(size_t bytes);
+        size_t getSendQueueSize() const;
+        size_t getPendingChunks() const;
+        bool hasPendingOutput() const;
+        size_t discardUnsent();
+        void appendUnsent(std::string &out) const;
+        bool isClosing() const;
+        void setIsClosing(bool closing);
+        bool isDirty() const;
+        void setIsDirty(bool dirty);
+
+        // chunked LIST/LSTMEMBERS output, NULL when none is in progress
+        ListCursor *getListing() const;
+        ListCursor *startListing(ListCursor::Kind kind, const std::string &channel);
+        void endListing();
+
+        // flood control: a token bucket in thousandths of a token, refilled
+        // at `rate` per millisecond up to `limit`. A line may run while the
+        // balance is positive and may take it below zero.
+        int32_t getTokens() const;
+        uint32_t getTokensAt() const;
+        void resetTokens(int32_t tokens, uint32_t now);
+        void refillTokens(uint32_t now, int32_t rate, int32_t limit);
+        void spendTokens(int32_t amount);
+
+        // lines the client may still run in loop iteration `tick`
+        int &lineBudget(uint32_t tick, int budget);
+
+        // input held back while the client waits for its next turn
+        bool isThrottled() const;
+        InputBacklog *getBacklog() const;
+        void startThrottle();
+        void endThrottle();
+        size_t getBacklogSize() const;
+        void appendBacklog(const char *data, size_t length);
+        bool refillInput();
+
+        // liveness, see Server::runTimers
+        TimerNode &getTimer();
+        uint32_t getSeenAt() const;
+        uint32_t getActiveAt() const;
+        void touch(uint32_t tick);
+        void setActiveAt(uint32_t tick);
+        bool isPingSent() const;
+        void setPingSent(bool sent);
+
+        // memory accounting, see Server::account
+        ClientMemory memoryUsage() const;
+        ClientMemory getAccounted() const;
+        void setAccounted(const ClientMemory &memory);
+        bool isHeavy() const;
+        void setIsHeavy(bool heavy);
+
+        // io_uring operations still referencing this client
+        int getRingOps() const;
+        void setRingOps(int ops);
+
+        // epoll registration
+        uint32_t getEvents() const;
+        bool watch(int epoll_fd, uint32_t events);
+        bool rewatch(int epoll_fd, uint32_t events);
+        void unwatch(int epoll_fd);
+
         ~Client();
 };
\ No newline at end of file
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+// Names one incarnation of a client: the fd it was accepted on plus the
+// generation of that fd's slab slot. Once the client disconnects the slot's
+// generation moves on, so a stale handle resolves to NULL instead of to
+// whoever reuses the descriptor.
+struct ClientHandle {
+    int         fd;
+    uint32_t    generation;
+
+    ClientHandle(): fd(-1), generation(0) {}
+    ClientHandle(int fd, uint32_t generation): fd(fd), generation(generation) {}
+
+    bool operator==(const ClientHandle &other) const {
+        return fd == other.fd && generation == other.generation;
+    }
+    bool operator!=(const ClientHandle &other) const {
+        return !(*this == other);
+    }
+    bool operator<(const ClientHandle &other) const {
+        return fd != other.fd ? fd < other.fd : generation < other.generation;
+    }
+};
@@ -0,0 +1,83 @@
+#include "ClientSlab.hpp"
+#include <new>
+#include <sys/mman.h>
+
+#define SLOT_LIVE 1u
+
+ClientSlab::ClientSlab(): _slots(NULL), _capacity(0), _size(0) {}
+
+// Live clients are owned by the server, which removes them before the slab
+// goes away; only the mapping is released here.
+ClientSlab::~ClientSlab() {
+    if (_slots)
+        munmap(_slots, _capacity * sizeof(Slot));
+}
+
+bool ClientSlab::init(size_t capacity) {
+    void *slots = mmap(NULL, capacity * sizeof(Slot), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slots == MAP_FAILED)
+        return false;
+    _slots = static_cast<Slot *>(slots);
+    _capacity = capacity;
+    return true;
+}
+
+size_t ClientSlab::capacity() const {
+    return _capacity;
+}
+
+size_t ClientSlab::size() const {
+    return _size;
+}
+
+Client *ClientSlab::object(Slot &slot) {
+    return reinterpret_cast<Client *>(slot.storage.bytes);
+}
+
+// Constructs the client for a freshly accepted fd under the next generation
+// of its slot. Returns NULL when the fd is beyond the slab.
+Client *ClientSlab::create(int fd, int shard) {
+    if (fd < 0 || static_cast<size_t>(fd) >= _capacity)
+        return NULL;
+    Slot &slot = _slots[fd];
+    uint32_t generation = (__atomic_load_n(&slot.tag, __ATOMIC_RELAXED) >> 1) + 1;
+    if (generation == 0 || generation > (UINT32_MAX >> 1))
+        generation = 1;
+    Client *client = new (slot.storage.bytes) Client(fd, shard, generation);
+    __atomic_store_n(&slot.tag, (generation << 1) | SLOT_LIVE, __ATOMIC_RELEASE);
+    ++_size;
+    return client;
+}
+
+Client *ClientSlab::find(int fd) const {
+    if (fd < 0 || static_cast<size_t>(fd) >= _capacity)
+        return NULL;
+    Slot &slot = _slots[fd];
+    if (!(__atomic_load_n(&slot.tag, __ATOMIC_ACQUIRE) & SLOT_LIVE))
+        return NULL;
+    return object(slot);
+}
+
+Client *ClientSlab::get(const ClientHandle &handle) const {
+    if (handle.fd < 0 || static_cast<size_t>(handle.fd) >= _capacity)
+        return NULL;
+    Slot &slot = _slots[handle.fd];
+    if (__atomic_load_n(&slot.tag, __ATOMIC_ACQUIRE) != ((handle.generation << 1) | SLOT_LIVE))
+        return NULL;
+    return object(slot);
+}
+
+// Makes the client unreachable through find() and every handle. The object
+// itself stays valid until destroy().
+void ClientSlab::unlink(Client *client) {
+    Slot &slot = _slots[client->getFd()];
+    __atomic_store_n(&slot.tag, client->getHandle().generation << 1, __ATOMIC_RELEASE);
+    --_size;
+}
+
+// Must run before the fd is closed: once it is, the descriptor and its slot
+// can be handed to a new connection.
+void ClientSlab::destroy(Client *client) {
+    client->~Client();
+}
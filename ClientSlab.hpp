@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include "Client.hpp"
+#include "ClientHandle.hpp"
+
+// Preallocated Client storage indexed by fd. Clients are constructed in
+// place in their descriptor's slot and destroyed there, so connection churn
+// never reaches the global allocator and an fd lookup is a bounds-checked
+// array index. The slots are one anonymous mapping; pages of descriptors
+// that are never used are never touched.
+//
+// Each slot carries a tag, (generation << 1) | live, read and written
+// atomically: the owning shard creates and unlinks its clients while other
+// shards resolve handles. The live count is kept by create() and unlink(),
+// which the server calls under its state lock.
+class ClientSlab {
+    private:
+        struct Slot {
+            union {
+                char        bytes[sizeof(Client)];
+                long double align;
+            }           storage;
+            uint32_t    tag;
+        };
+
+        Slot    *_slots;
+        size_t  _capacity;
+        size_t  _size;
+
+        ClientSlab(const ClientSlab &);
+        ClientSlab &operator=(const ClientSlab &);
+
+        static Client *object(Slot &slot);
+
+    public:
+        ClientSlab();
+        ~ClientSlab();
+
+        bool init(size_t capacity);
+        size_t capacity() const;
+        size_t size() const;
+
+        Client *create(int fd, int shard);
+        Client *find(int fd) const;
+        Client *get(const ClientHandle &handle) const;
+        void unlink(Client *client);
+        void destroy(Client *client);
+};
@@ -0,0 +1,152 @@
+#include "Config.hpp"
+#include "Log.hpp"
+#include <cstdlib>
+
+#define MAX_THREADS 64
+#define MAX_CLIENTS_LIMIT 10000000
+#define MAX_FLOOD_RATE 1000000
+#define MAX_COMMAND_COST 1000
+#define MAX_LINE_BUDGET 1000000
+#define MAX_RECVQ_LIMIT (64 * 1024 * 1024)
+#define MAX_TIMEOUT (7 * 24 * 3600)
+// keeps every send queue offset within 32 bits, see Client::OutChunk
+#define MAX_SENDQ_LIMIT (1024 * 1024 * 1024)
+#define MAX_MEMORY_BUDGET (1L << 40)
+#define MAX_PORT 65535
+
+ServerConfig::ServerConfig(): edgeTriggered(false), threads(1), ioUring(false), maxClients(DEFAULT_MAX_CLIENTS), metrics(true), logLevel(LOG_LEVEL_INFO), tcpPolicy(TCP_POLICY_NAGLE), floodRate(0), floodBurst(DEFAULT_FLOOD_BURST), lineBudget(DEFAULT_LINE_BUDGET), maxRecvq(DEFAULT_MAX_RECVQ), registrationTimeout(DEFAULT_REGISTRATION_TIMEOUT), pingInterval(DEFAULT_PING_INTERVAL), pingTimeout(DEFAULT_PING_TIMEOUT), idleTimeout(0), maxSendq(DEFAULT_MAX_SENDQ), memoryBudget(0), snapshotInterval(DEFAULT_SNAPSHOT_INTERVAL), linkPort(0) {}
+
+// Parses the numeric part of a "--name=value" option.
+static bool parseCount(const std::string &option, size_t prefix, long max, int &out) {
+    std::string value = option.substr(prefix);
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    long parsed = std::atol(value.c_str());
+    if (parsed < 1 || parsed > max)
+        return false;
+    out = static_cast<int>(parsed);
+    return true;
+}
+
+// Like parseCount, but 0 is allowed and means "off".
+static bool parseTimeout(const std::string &option, size_t prefix, int &out) {
+    if (option.compare(prefix, std::string::npos, "0") == 0) {
+        out = 0;
+        return true;
+    }
+    return parseCount(option, prefix, MAX_TIMEOUT, out);
+}
+
+// A byte count with an optional k, m or g suffix.
+static bool parseBytes(const std::string &option, size_t prefix, long min, long max, size_t &out) {
+    std::string value = option.substr(prefix);
+    long unit = 1;
+    if (!value.empty()) {
+        char suffix = value[value.size() - 1];
+        if (suffix == 'k' || suffix == 'K')
+            unit = 1024;
+        else if (suffix == 'm' || suffix == 'M')
+            unit = 1024 * 1024;
+        else if (suffix == 'g' || suffix == 'G')
+            unit = 1024 * 1024 * 1024;
+        if (unit != 1)
+            value.erase(value.size() - 1);
+    }
+    if (value.empty() || value.size() > 12 || value.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    long parsed = std::atol(value.c_str());
+    if (parsed > max / unit || parsed * unit < min)
+        return false;
+    out = static_cast<size_t>(parsed * unit);
+    return true;
+}
+
+// "--command-cost=NAME:N"; the name is checked against the command table
+// when the server starts.
+static bool parseCommandCost(const std::string &value, std::vector<std::pair<std::string, int> > &costs) {
+    size_t colon = value.find(':');
+    if (colon == 0 || colon == std::string::npos || colon + 1 == value.size())
+        return false;
+    std::string cost = value.substr(colon + 1);
+    if (cost.find_first_not_of("0123456789") != std::string::npos || cost.size() > 4)
+        return false;
+    int parsed = std::atoi(cost.c_str());
+    if (parsed > MAX_COMMAND_COST)
+        return false;
+    costs.push_back(std::make_pair(value.substr(0, colon), parsed));
+    return true;
+}
+
+// A server name travels as one word of the link protocol.
+static bool parseName(const std::string &value, std::string &out) {
+    if (value.empty() || value.find_first_of(" \t\r\n:") != std::string::npos)
+        return false;
+    out = value;
+    return true;
+}
+
+bool ServerConfig::parseOption(const std::string &option) {
+    if (option == "--edge-triggered")
+        edgeTriggered = true;
+    else if (option == "--level-triggered")
+        edgeTriggered = false;
+    else if (option == "--io-uring")
+        ioUring = true;
+    else if (option == "--epoll")
+        ioUring = false;
+    else if (option.compare(0, 10, "--threads=") == 0)
+        return parseCount(option, 10, MAX_THREADS, threads);
+    else if (option.compare(0, 14, "--max-clients=") == 0)
+        return parseCount(option, 14, MAX_CLIENTS_LIMIT, maxClients);
+    else if (option == "--metrics")
+        metrics = true;
+    else if (option == "--no-metrics")
+        metrics = false;
+    else if (option.compare(0, 15, "--admin-socket=") == 0 && option.size() > 15)
+        adminSocket = option.substr(15);
+    else if (option.compare(0, 16, "--oper-password=") == 0 && option.size() > 16)
+        operPassword = option.substr(16);
+    else if (option == "--tcp-policy=nagle")
+        tcpPolicy = TCP_POLICY_NAGLE;
+    else if (option == "--tcp-policy=nodelay")
+        tcpPolicy = TCP_POLICY_NODELAY;
+    else if (option.compare(0, 13, "--flood-rate=") == 0)
+        return parseCount(option, 13, MAX_FLOOD_RATE, floodRate);
+    else if (option.compare(0, 14, "--flood-burst=") == 0)
+        return parseCount(option, 14, MAX_FLOOD_RATE, floodBurst);
+    else if (option.compare(0, 15, "--command-cost=") == 0)
+        return parseCommandCost(option.substr(15), commandCosts);
+    else if (option.compare(0, 14, "--line-budget=") == 0)
+        return parseCount(option, 14, MAX_LINE_BUDGET, lineBudget);
+    else if (option.compare(0, 12, "--max-recvq=") == 0)
+        return parseCount(option, 12, MAX_RECVQ_LIMIT, maxRecvq);
+    else if (option.compare(0, 23, "--registration-timeout=") == 0)
+        return parseTimeout(option, 23, registrationTimeout);
+    else if (option.compare(0, 16, "--ping-interval=") == 0)
+        return parseTimeout(option, 16, pingInterval);
+    else if (option.compare(0, 15, "--ping-timeout=") == 0)
+        return parseTimeout(option, 15, pingTimeout);
+    else if (option.compare(0, 15, "--idle-timeout=") == 0)
+        return parseTimeout(option, 15, idleTimeout);
+    else if (option.compare(0, 12, "--max-sendq=") == 0)
+        return parseBytes(option, 12, 1, MAX_SENDQ_LIMIT, maxSendq);
+    else if (option.compare(0, 16, "--memory-budget=") == 0)
+        return parseBytes(option, 16, 0, MAX_MEMORY_BUDGET, memoryBudget);
+    else if (option.compare(0, 12, "--state-dir=") == 0 && option.size() > 12)
+        stateDir = option.substr(12);
+    else if (option.compare(0, 20, "--snapshot-interval=") == 0)
+        return parseCount(option, 20, MAX_TIMEOUT, snapshotInterval);
+    else if (option.compare(0, 14, "--server-name=") == 0)
+        return parseName(option.substr(14), serverName);
+    else if (option.compare(0, 12, "--link-port=") == 0)
+        return parseCount(option, 12, MAX_PORT, linkPort);
+    else if (option.compare(0, 16, "--link-password=") == 0 && option.size() > 16)
+        linkPassword = option.substr(16);
+    else if (option.compare(0, 7, "--link=") == 0 && option.find(':', 7) != std::string::npos)
+        links.push_back(option.substr(7));
+    else if (option.compare(0, 12, "--log-level=") == 0)
+        return Logger::parseLevel(option.substr(12), logLevel);
+    else
+        return false;
+    return true;
+}
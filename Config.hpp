@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#define DEFAULT_MAX_CLIENTS 100000
+#define DEFAULT_FLOOD_BURST 10
+#define DEFAULT_LINE_BUDGET 32
+#define DEFAULT_MAX_RECVQ 65536
+#define DEFAULT_REGISTRATION_TIMEOUT 30
+#define DEFAULT_PING_INTERVAL 120
+#define DEFAULT_PING_TIMEOUT 60
+#define DEFAULT_MAX_SENDQ (1024 * 1024)
+#define DEFAULT_SNAPSHOT_INTERVAL 300
+
+// How client sockets batch outgoing segments. Output is written once per
+// event-loop iteration, in one sendmsg per client unless the queue holds more
+// than SENDQ_IOV_MAX chunks; NODELAY then sends it without waiting for ACKs
+// (Nagle).
+enum TcpPolicy {
+    TCP_POLICY_NAGLE,
+    TCP_POLICY_NODELAY
+};
+
+struct ServerConfig {
+    bool        edgeTriggered;
+    int         threads;
+    bool        ioUring;
+    int         maxClients;
+    bool        metrics;
+    std::string adminSocket;
+    std::string operPassword;
+    int         logLevel;
+    TcpPolicy   tcpPolicy;
+    // Flood control: every client earns floodRate tokens per second up to
+    // floodBurst, and each line costs its command's cost (0 = no limit).
+    int         floodRate;
+    int         floodBurst;
+    std::vector<std::pair<std::string, int> > commandCosts;
+    // lines run per client before the loop moves on to the next one
+    int         lineBudget;
+    // input a throttled client may have waiting before it is disconnected
+    int         maxRecvq;
+    // Deadlines in seconds, 0 turns one off: a connection must register
+    // within registrationTimeout; one quiet for pingInterval is sent a PING
+    // and dropped unless it answers within pingTimeout; one that sends no
+    // command but PING and PONG for idleTimeout is dropped.
+    int         registrationTimeout;
+    int         pingInterval;
+    int         pingTimeout;
+    int         idleTimeout;
+    // A client whose send queue grows past maxSendq bytes is evicted. Once
+    // all clients together hold more than memoryBudget bytes (0 = no
+    // budget), the largest consumers are evicted until they fit again.
+    size_t      maxSendq;
+    size_t      memoryBudget;
+    // Channels are persisted in stateDir (empty = not at all): a journal of
+    // every change plus a snapshot taken every snapshotInterval seconds.
+    std::string stateDir;
+    int         snapshotInterval;
+    // Server links, see ServerLink.cpp: this server's name on the network
+    // (ircserv.<port> by default), the port other servers link to, the
+    // password both ends of a link give, and the servers dialled here
+    // ("ADDRESS:PORT", IPv4).
+    std::string serverName;
+    int         linkPort;
+    std::string linkPassword;
+    std::vector<std::string> links;
+
+    ServerConfig();
+    bool parseOption(const std::string &option);
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+
+#define HASHMAP_MIN_SLOTS 16
+
+// Open-addressing hash map from strings to small values, with linear probing
+// and tombstones. Lookups also accept a raw (pointer, length) key, so callers
+// holding a Slice into an input buffer never build a temporary std::string.
+// No slots are allocated until the first insert: a channel's ban list is
+// usually empty, and there may be hundreds of thousands of channels.
+template <typename V>
+class HashMap {
+    private:
+        enum SlotState {
+            SLOT_EMPTY,
+            SLOT_FULL,
+            SLOT_DELETED
+        };
+
+        struct Slot {
+            std::string     key;
+            V               value;
+            uint32_t        hash;
+            unsigned char   state;
+
+            Slot(): value(), hash(0), state(SLOT_EMPTY) {}
+        };
+
+        std::vector<Slot>   _slots;
+        size_t              _size;
+        size_t              _used;
+
+        static uint32_t hashKey(const char *key, size_t length) {
+            uint32_t hash = 2166136261u;
+            for (size_t i = 0; i < length; ++i) {
+                hash ^= static_cast<unsigned char>(key[i]);
+                hash *= 16777619u;
+            }
+            return hash;
+        }
+
+        size_t locate(const char *key, size_t length, uint32_t hash) const {
+            if (_slots.empty())
+                return 0;
+            size_t mask = _slots.size() - 1;
+            for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+                const Slot &slot = _slots[i];
+                if (slot.state == SLOT_EMPTY)
+                    return _slots.size();
+                if (slot.state == SLOT_FULL && slot.hash == hash && slot.key.size() == length
+                    && std::memcmp(slot.key.data(), key, length) == 0)
+                    return i;
+            }
+        }
+
+        void rehash(size_t capacity) {
+            std::vector<Slot> old(capacity);
+            old.swap(_slots);
+            _used = _size;
+            size_t mask = capacity - 1;
+            for (size_t i = 0; i < old.size(); ++i) {
+                if (old[i].state != SLOT_FULL)
+                    continue;
+                size_t j = old[i].hash & mask;
+                while (_slots[j].state != SLOT_EMPTY)
+                    j = (j + 1) & mask;
+                _slots[j].key.swap(old[i].key);
+                _slots[j].value = old[i].value;
+                _slots[j].hash = old[i].hash;
+                _slots[j].state = SLOT_FULL;
+            }
+        }
+
+    public:
+        HashMap(): _size(0), _used(0) {}
+
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+
+        V *find(const char *key, size_t length) {
+            size_t i = locate(key, length, hashKey(key, length));
+            return i == _slots.size() ? NULL : &_slots[i].value;
+        }
+        const V *find(const char *key, size_t length) const {
+            size_t i = locate(key, length, hashKey(key, length));
+            return i == _slots.size() ? NULL : &_slots[i].value;
+        }
+        V *find(const std::string &key) { return find(key.data(), key.size()); }
+        const V *find(const std::string &key) const { return find(key.data(), key.size()); }
+
+        // Returns false and leaves the map untouched when the key exists.
+        bool insert(const std::string &key, const V &value) {
+            uint32_t hash = hashKey(key.data(), key.size());
+            if (locate(key.data(), key.size(), hash) != _slots.size())
+                return false;
+            if (_slots.empty())
+                rehash(HASHMAP_MIN_SLOTS);
+            else if ((_used + 1) * 10 > _slots.size() * 7)
+                rehash(_size * 2 >= _slots.size() / 2 ? _slots.size() * 2 : _slots.size());
+            size_t mask = _slots.size() - 1;
+            size_t i = hash & mask;
+            while (_slots[i].state == SLOT_FULL)
+                i = (i + 1) & mask;
+            if (_slots[i].state == SLOT_EMPTY)
+                ++_used;
+            _slots[i].key = key;
+            _slots[i].value = value;
+            _slots[i].hash = hash;
+            _slots[i].state = SLOT_FULL;
+            ++_size;
+            return true;
+        }
+
+        bool erase(const char *key, size_t length) {
+            size_t i = locate(key, length, hashKey(key, length));
+            if (i == _slots.size())
+                return false;
+            _slots[i].key.clear();
+            _slots[i].value = V();
+            _slots[i].state = SLOT_DELETED;
+            --_size;
+            return true;
+        }
+        bool erase(const std::string &key) { return erase(key.data(), key.size()); }
+
+        // Calls visitor(key, value) for every entry. The map must not be
+        // modified until it returns.
+        template <typename Visitor>
+        void visit(Visitor &visitor) const {
+            for (size_t i = 0; i < _slots.size(); ++i)
+                if (_slots[i].state == SLOT_FULL)
+                    visitor(_slots[i].key, _slots[i].value);
+        }
+};
@@ -0,0 +1,190 @@
+#include "IoUring.hpp"
+
+#ifndef NO_IO_URING
+
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+IoUring::IoUring()
+    : _fd(-1), _sqRing(MAP_FAILED), _sqRingSize(0), _cqRing(MAP_FAILED), _cqRingSize(0),
+      _sqes(NULL), _sqesSize(0), _sqHead(NULL), _sqTail(NULL), _sqMask(0), _sqArray(NULL), _sqLocalTail(0),
+      _cqHead(NULL), _cqTail(NULL), _cqMask(0), _cqes(NULL),
+      _bufRing(NULL), _bufRingSize(0), _buffers(NULL), _bufMask(URING_BUFFER_COUNT - 1) {}
+
+IoUring::~IoUring()
+{
+    if (_bufRing)
+        munmap(_bufRing, _bufRingSize);
+    if (_buffers)
+        munmap(_buffers, URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    if (_sqes)
+        munmap(_sqes, _sqesSize);
+    if (_cqRing != MAP_FAILED && _cqRing != _sqRing)
+        munmap(_cqRing, _cqRingSize);
+    if (_sqRing != MAP_FAILED)
+        munmap(_sqRing, _sqRingSize);
+    if (_fd != -1)
+        close(_fd);
+}
+
+// Multishot receive, which the backend relies on, appeared in Linux 6.0.
+static bool kernelSupportsMultishot()
+{
+    struct utsname name;
+    if (uname(&name) == -1)
+        return false;
+    char *end;
+    long major = std::strtol(name.release, &end, 10);
+    return major >= 6;
+}
+
+bool IoUring::init(unsigned entries)
+{
+    if (!kernelSupportsMultishot())
+        return false;
+
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    _fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (_fd == -1)
+        return false;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+        return false;
+
+    _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (_cqRingSize > _sqRingSize)
+        _sqRingSize = _cqRingSize;
+    _cqRingSize = _sqRingSize;
+
+    _sqRing = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    if (_sqRing == MAP_FAILED)
+        return false;
+    _cqRing = _sqRing;
+
+    _sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return false;
+    _sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+    char *sq = static_cast<char *>(_sqRing);
+    _sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    _sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    _sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    _sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    _sqLocalTail = *_sqTail;
+
+    char *cq = static_cast<char *>(_cqRing);
+    _cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    _cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    _cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    _cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    return setupBuffers();
+}
+
+// Registers URING_BUFFER_COUNT receive buffers of URING_BUFFER_SIZE bytes.
+// Multishot receives pick one per completion and the loop hands it back
+// after copying the bytes into the client's line buffer.
+bool IoUring::setupBuffers()
+{
+    _bufRingSize = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    void *ring = mmap(NULL, _bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED)
+        return false;
+    _bufRing = static_cast<struct io_uring_buf_ring *>(ring);
+
+    void *buffers = mmap(NULL, URING_BUFFER_COUNT * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED)
+        return false;
+    _buffers = static_cast<char *>(buffers);
+
+    struct io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uintptr_t>(_bufRing);
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        return false;
+
+    struct io_uring_buf *bufs = reinterpret_cast<struct io_uring_buf *>(_bufRing);
+    for (unsigned i = 0; i < URING_BUFFER_COUNT; ++i)
+    {
+        bufs[i].addr = reinterpret_cast<uintptr_t>(_buffers + i * URING_BUFFER_SIZE);
+        bufs[i].len = URING_BUFFER_SIZE;
+        bufs[i].bid = i;
+    }
+    __atomic_store_n(&_bufRing->tail, static_cast<unsigned short>(URING_BUFFER_COUNT), __ATOMIC_RELEASE);
+    return true;
+}
+
+// Returns a zeroed SQE. When the submission ring is full the prepared
+// entries are pushed to the kernel first.
+struct io_uring_sqe *IoUring::getSqe()
+{
+    unsigned entries = _sqMask + 1;
+    if (_sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= entries)
+        submitAndWait(0);
+    unsigned index = _sqLocalTail & _sqMask;
+    struct io_uring_sqe *sqe = &_sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    _sqArray[index] = index;
+    ++_sqLocalTail;
+    return sqe;
+}
+
+int IoUring::submitAndWait(unsigned waitFor)
+{
+    __atomic_store_n(_sqTail, _sqLocalTail, __ATOMIC_RELEASE);
+    unsigned toSubmit = _sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+    if (waitFor > 0 && peekCqe())
+        waitFor = 0;
+    if (toSubmit == 0 && waitFor == 0)
+        return 0;
+    unsigned flags = waitFor > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret = syscall(__NR_io_uring_enter, _fd, toSubmit, waitFor, flags, NULL, 0);
+    if (ret == -1 && (errno == EINTR || errno == EBUSY || errno == EAGAIN))
+        return 0;
+    return ret;
+}
+
+struct io_uring_cqe *IoUring::peekCqe()
+{
+    unsigned head = *_cqHead;
+    if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &_cqes[head & _cqMask];
+}
+
+void IoUring::seenCqe()
+{
+    __atomic_store_n(_cqHead, *_cqHead + 1, __ATOMIC_RELEASE);
+}
+
+char *IoUring::buffer(unsigned short id) const
+{
+    return _buffers + static_cast<size_t>(id) * URING_BUFFER_SIZE;
+}
+
+void IoUring::recycleBuffer(unsigned short id)
+{
+    struct io_uring_buf *bufs = reinterpret_cast<struct io_uring_buf *>(_bufRing);
+    unsigned short tail = _bufRing->tail;
+    struct io_uring_buf &buf = bufs[tail & _bufMask];
+    buf.addr = reinterpret_cast<uintptr_t>(buffer(id));
+    buf.len = URING_BUFFER_SIZE;
+    buf.bid = id;
+    __atomic_store_n(&_bufRing->tail, static_cast<unsigned short>(tail + 1), __ATOMIC_RELEASE);
+}
+
+#endif
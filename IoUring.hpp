@@ -0,0 +1,62 @@
+#pragma once
+
+#ifndef NO_IO_URING
+
+#include <stdint.h>
+#include <cstddef>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 4096
+#define URING_BUFFER_COUNT 4096
+#define URING_BUFFER_SIZE 512
+#define URING_BUFFER_GROUP 0
+
+// Minimal io_uring wrapper on top of the raw system calls: one submission
+// and completion ring plus a ring of provided receive buffers. SQEs are only
+// prepared here; they reach the kernel in the single io_uring_enter() issued
+// by submitAndWait() once per event-loop iteration.
+class IoUring {
+    private:
+        int                     _fd;
+        void                    *_sqRing;
+        size_t                  _sqRingSize;
+        void                    *_cqRing;
+        size_t                  _cqRingSize;
+        struct io_uring_sqe     *_sqes;
+        size_t                  _sqesSize;
+        unsigned                *_sqHead;
+        unsigned                *_sqTail;
+        unsigned                _sqMask;
+        unsigned                *_sqArray;
+        unsigned                _sqLocalTail;
+        unsigned                *_cqHead;
+        unsigned                *_cqTail;
+        unsigned                _cqMask;
+        struct io_uring_cqe     *_cqes;
+
+        struct io_uring_buf_ring *_bufRing;
+        size_t                  _bufRingSize;
+        char                    *_buffers;
+        unsigned                _bufMask;
+
+        IoUring(const IoUring &);
+        IoUring &operator=(const IoUring &);
+
+    public:
+        IoUring();
+        ~IoUring();
+
+        bool init(unsigned entries);
+        bool setupBuffers();
+
+        struct io_uring_sqe *getSqe();
+        int submitAndWait(unsigned waitFor);
+
+        struct io_uring_cqe *peekCqe();
+        void seenCqe();
+
+        char *buffer(unsigned short id) const;
+        void recycleBuffer(unsigned short id);
+};
+
+#endif
@@ -0,0 +1,130 @@
+#include "LineBuffer.hpp"
+
+// Free blocks are chained through their first bytes. A block goes back to
+// the pool of the thread that releases it, which is the client's shard.
+static __thread char *pool = NULL;
+static __thread size_t pooled = 0;
+
+static char *takeBlock() {
+    char *block = pool;
+    if (!block)
+        return new char[LINE_BUFFER_CAPACITY];
+    std::memcpy(&pool, block, sizeof(pool));
+    --pooled;
+    return block;
+}
+
+static void giveBlock(char *block) {
+    if (pooled >= LINE_BUFFER_POOL_SIZE) {
+        delete[] block;
+        return;
+    }
+    std::memcpy(block, &pool, sizeof(pool));
+    pool = block;
+    ++pooled;
+}
+
+LineBuffer::LineBuffer(): _data(NULL), _start(0), _end(0), _discarding(false) {}
+
+LineBuffer::~LineBuffer() {
+    if (_data)
+        giveBlock(_data);
+}
+
+char *LineBuffer::writePtr() {
+    return _data + _end;
+}
+
+// Must be called before writePtr(): it allocates and compacts the storage.
+size_t LineBuffer::writable() {
+    if (!_data)
+        _data = takeBlock();
+    if (_start == _end) {
+        _start = 0;
+        _end = 0;
+    } else if (_end == LINE_BUFFER_CAPACITY && _start > 0) {
+        std::memmove(_data, _data + _start, _end - _start);
+        _end -= _start;
+        _start = 0;
+    }
+    return LINE_BUFFER_CAPACITY - _end;
+}
+
+void LineBuffer::commit(size_t bytes) {
+    _end += bytes;
+}
+
+// Frames the next line terminated by "\r\n" or a bare "\n". Lines longer than
+// MAX_LINE_LENGTH (terminator included) are dropped up to their terminator
+// and reported once as LINE_TOO_LONG.
+LineBuffer::Status LineBuffer::nextLine(Slice &line) {
+    if (_start == _end)
+        return LINE_NONE;
+    const char *begin = _data + _start;
+    size_t available = _end - _start;
+    const char *newline = static_cast<const char *>(std::memchr(begin, '\n', available));
+
+    if (!newline) {
+        if (_discarding) {
+            _start = _end;
+            return LINE_NONE;
+        }
+        if (available >= MAX_LINE_LENGTH) {
+            _discarding = true;
+            _start = _end;
+            return LINE_TOO_LONG;
+        }
+        return LINE_NONE;
+    }
+
+    size_t length = newline - begin + 1;
+    _start += length;
+    if (_discarding) {
+        _discarding = false;
+        return nextLine(line);
+    }
+    if (length > MAX_LINE_LENGTH)
+        return LINE_TOO_LONG;
+
+    size_t content = length - 1;
+    if (content > 0 && begin[content - 1] == '\r')
+        --content;
+    line = Slice(begin, content);
+    return LINE_READY;
+}
+
+// Whether nextLine() would hand out a line or report one as too long.
+bool LineBuffer::hasLine() const {
+    size_t available = _end - _start;
+    if (available >= MAX_LINE_LENGTH && !_discarding)
+        return true;
+    return available > 0 && std::memchr(_data + _start, '\n', available) != NULL;
+}
+
+size_t LineBuffer::size() const {
+    return _end - _start;
+}
+
+const char *LineBuffer::data() const {
+    return _data + _start;
+}
+
+size_t LineBuffer::capacity() const {
+    return _data ? LINE_BUFFER_CAPACITY : 0;
+}
+
+void LineBuffer::clear() {
+    _start = 0;
+    _end = 0;
+    _discarding = false;
+}
+
+// Hands the storage back when no partial line is pending.
+void LineBuffer::release() {
+    if (_start != _end || !_data)
+        return;
+    giveBlock(_data);
+    _data = NULL;
+    _start = 0;
+    _end = 0;
+}
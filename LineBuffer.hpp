@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstring>
+#include "Message.hpp"
+
+#define MAX_LINE_LENGTH 512
+#define LINE_BUFFER_CAPACITY (2 * MAX_LINE_LENGTH)
+// Released storage is kept on a per-thread free list up to this many
+// blocks, so a client's next burst of input allocates nothing.
+#define LINE_BUFFER_POOL_SIZE 256
+
+// Fixed-size per-client input buffer. recv() writes straight into it and
+// complete lines are handed out as slices pointing into the storage, so
+// framing never allocates. A partial line is moved to the front only when
+// the free tail runs out. The storage is taken on the first writable() and
+// handed back by release() once drained, so idle connections hold none;
+// both go through the thread's pool rather than new[] and delete[].
+class LineBuffer {
+    private:
+        char    *_data;
+        size_t  _start;
+        size_t  _end;
+        bool    _discarding;
+
+        LineBuffer(const LineBuffer &);
+        LineBuffer &operator=(const LineBuffer &);
+
+    public:
+        enum Status {
+            LINE_NONE,
+            LINE_READY,
+            LINE_TOO_LONG
+        };
+
+        LineBuffer();
+        ~LineBuffer();
+
+        char *writePtr();
+        size_t writable();
+        void commit(size_t bytes);
+        Status nextLine(Slice &line);
+        bool hasLine() const;
+        size_t size() const;
+        // the size() bytes received and not yet framed
+        const char *data() const;
+        // bytes of storage held, 0 between bursts of input
+        size_t capacity() const;
+        void clear();
+        void release();
+};
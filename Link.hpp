@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <set>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "TimerWheel.hpp"
+
+// a dialled link that is down is tried again after this long
+#define LINK_RETRY_MS 2000
+#define LINK_READ_SIZE 65536
+// a peer that lets this much output pile up is dropped
+#define LINK_MAX_SENDQ (64 * 1024 * 1024)
+// Until a peer has sent SERVER it is nobody: it gets this many seconds and
+// this many bytes of line to do so, and only so many of them are accepted
+// at a time. A registered peer's lines are bounded by LINK_MAX_LINE.
+#define LINK_REGISTRATION_TIMEOUT 10
+#define LINK_MAX_UNREGISTERED_LINE 512
+#define LINK_MAX_UNREGISTERED 8
+#define LINK_MAX_LINE 65536
+
+class Channel;
+
+// One connection to another ircserv, see ServerLink.cpp. Links are dialled
+// (--link) or accepted (--link-port); either way their sockets are only
+// read and written by shard 0. `pending` is filled under link_lock by
+// whichever shard produced the line and moved to `output` by shard 0.
+struct Link {
+    uint32_t            id;             // in io_uring user_data, new for every connection
+    int                 fd;
+    std::string         target;         // "host:port" dialled, empty when accepted
+    struct sockaddr_in  address;
+    std::string         name;           // the peer's server name, once known
+    bool                connecting;     // a non-blocking connect is under way
+    bool                established;    // SERVER exchanged
+    bool                pollArmed;      // in shard 0's epoll set, or its io_uring input poll is pending
+    bool                waitingOut;     // the socket is full, polling for room
+    std::string         input;
+    std::string         pending;
+    std::string         output;
+    // written by shard 0, read by STATS on any thread
+    uint64_t            linesIn;
+    uint64_t            linesOut;
+    uint64_t            bytesIn;
+    uint64_t            bytesOut;
+    uint64_t            queued;         // bytes of `output` not written yet
+    TimerNode           timer;          // registration deadline, on shard 0's wheel
+
+    Link(uint32_t id, int fd): id(id), fd(fd), address(), connecting(false), established(false),
+        pollArmed(false), waitingOut(false), linesIn(0), linesOut(0), bytesIn(0), bytesOut(0), queued(0) {}
+};
+
+// A client of another server, known by the nickname it registered there.
+// `link` is the next hop towards it; every channel it is in lists it.
+struct RemoteUser {
+    std::string         nickname;
+    std::string         server;
+    Link                *link;
+    std::set<Channel*>  channels;
+};
@@ -0,0 +1,211 @@
+#include "Log.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+// Lines are batched per write; a change of stream flushes the batch so
+// stdout and stderr lines keep their order when both go to one file.
+#define LOG_BATCH_SIZE 65536
+
+typedef char logRingSizeIsPowerOfTwo[(LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0 ? 1 : -1];
+
+// Bounded multi-producer queue: a slot whose sequence equals a producer's
+// claimed position is free for it, one ahead holds a line for the writer.
+struct LogSlot {
+    uint64_t    sequence;
+    int         level;
+    size_t      length;
+    char        text[LOG_LINE_SIZE];
+};
+
+static LogSlot ring[LOG_RING_SIZE];
+static uint64_t enqueuePos = 0;
+static uint64_t dequeuePos = 0;
+static uint64_t droppedLines = 0;
+static uint64_t reportedDrops = 0;
+
+static int minLevel = LOG_LEVEL_INFO;
+static bool running = false;
+static int stopping = 0;
+static int sleeping = 0;
+static int wakeFd = -1;
+static pthread_t writer;
+
+static char batch[LOG_BATCH_SIZE];
+static size_t batchLength = 0;
+static int batchFd = STDOUT_FILENO;
+
+static int streamOf(int level) {
+    return level >= LOG_LEVEL_WARN ? STDERR_FILENO : STDOUT_FILENO;
+}
+
+// Blocks only the calling thread, which is the writer once started.
+static void writeAll(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+static void flushBatch() {
+    writeAll(batchFd, batch, batchLength);
+    batchLength = 0;
+}
+
+static void appendLine(int fd, const char *text, size_t length) {
+    if (fd != batchFd || batchLength + length + 1 > sizeof(batch)) {
+        flushBatch();
+        batchFd = fd;
+    }
+    std::memcpy(batch + batchLength, text, length);
+    batchLength += length;
+    batch[batchLength++] = '\n';
+}
+
+static bool ringEmpty() {
+    LogSlot &slot = ring[dequeuePos & (LOG_RING_SIZE - 1)];
+    return __atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) != dequeuePos + 1;
+}
+
+static void drain() {
+    while (!ringEmpty()) {
+        LogSlot &slot = ring[dequeuePos & (LOG_RING_SIZE - 1)];
+        appendLine(streamOf(slot.level), slot.text, slot.length);
+        __atomic_store_n(&slot.sequence, dequeuePos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        ++dequeuePos;
+    }
+    uint64_t drops = __atomic_load_n(&droppedLines, __ATOMIC_RELAXED);
+    if (drops != reportedDrops) {
+        char text[64];
+        int length = snprintf(text, sizeof(text), "Logger: %llu lines dropped, the ring was full",
+                              static_cast<unsigned long long>(drops - reportedDrops));
+        appendLine(STDERR_FILENO, text, length);
+        reportedDrops = drops;
+    }
+    flushBatch();
+}
+
+// Sleeps on the eventfd only after announcing it and checking the ring once
+// more, so a line published in between is never left behind.
+static void *writerLoop(void *) {
+    while (true) {
+        drain();
+        if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+            break;
+        __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        uint64_t wakeups;
+        if (ringEmpty() && !__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)
+            && read(wakeFd, &wakeups, sizeof(wakeups)) == -1 && errno != EINTR)
+            break;
+        __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+    }
+    drain();
+    return NULL;
+}
+
+static void stopAtExit() {
+    Logger::stop();
+}
+
+void Logger::start() {
+    if (running)
+        return;
+    for (size_t i = 0; i < LOG_RING_SIZE; ++i)
+        ring[i].sequence = i;
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    if (wakeFd == -1 || pthread_create(&writer, NULL, writerLoop, NULL) != 0) {
+        if (wakeFd != -1)
+            close(wakeFd);
+        wakeFd = -1;
+        return;
+    }
+    running = true;
+    std::atexit(stopAtExit);
+}
+
+void Logger::stop() {
+    if (!running)
+        return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) == -1)
+        return;
+    pthread_join(writer, NULL);
+    running = false;
+    close(wakeFd);
+    wakeFd = -1;
+}
+
+void Logger::setLevel(int level) {
+    minLevel = level;
+}
+
+bool Logger::parseLevel(const std::string &name, int &level) {
+    static const char *names[] = { "debug", "info", "warn", "error" };
+    for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_ERROR; ++i) {
+        if (name == names[i]) {
+            level = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Logger::enabled(int level) {
+    return level >= minLevel;
+}
+
+void Logger::submit(int level, const char *text, size_t length) {
+    if (!running) {
+        char line[LOG_LINE_SIZE + 1];
+        std::memcpy(line, text, length);
+        line[length] = '\n';
+        writeAll(streamOf(level), line, length + 1);
+        return;
+    }
+
+    uint64_t pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    LogSlot *slot;
+    while (true) {
+        slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        int64_t ahead = static_cast<int64_t>(sequence - pos);
+        if (ahead == 0) {
+            if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (ahead < 0) {
+            // the writer hasn't freed this slot yet: the ring is full
+            __atomic_fetch_add(&droppedLines, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+    slot->level = level;
+    slot->length = length;
+    std::memcpy(slot->text, text, length);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sleeping, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) == -1)
+            return;
+    }
+}
+
+uint64_t Logger::dropped() {
+    return __atomic_load_n(&droppedLines, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+// Levels below LOG_MIN_LEVEL are compiled out, e.g. `make LOG_LEVEL=WARN`.
+// Their statements still have to compile, so they cannot rot.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Slots of the ring and the longest line kept; longer lines are truncated.
+#define LOG_RING_SIZE 4096
+#define LOG_LINE_SIZE 240
+
+// Lines are formatted on the caller's stack and copied into a preallocated
+// ring. A background thread writes them out, so a stalled stdout never
+// blocks an event loop: once the ring is full, lines are dropped and
+// counted instead.
+//
+//   LOG_INFO(GREEN_COLOR << "New client connected: FD " << fd << RESET_COLOR);
+#define LOG_AT(level, expr) \
+    do { \
+        if ((level) >= LOG_MIN_LEVEL && Logger::enabled(level)) { \
+            LogLine _logLine(level); \
+            _logLine.stream() << expr; \
+        } \
+    } while (0)
+
+#define LOG_DEBUG(expr) LOG_AT(LOG_LEVEL_DEBUG, expr)
+#define LOG_INFO(expr) LOG_AT(LOG_LEVEL_INFO, expr)
+#define LOG_WARN(expr) LOG_AT(LOG_LEVEL_WARN, expr)
+#define LOG_ERROR(expr) LOG_AT(LOG_LEVEL_ERROR, expr)
+
+class Logger {
+    public:
+        // Starts the writer thread; lines logged before are written
+        // synchronously. The ring is drained again at exit.
+        static void start();
+        static void stop();
+
+        static void setLevel(int level);
+        static bool parseLevel(const std::string &name, int &level);
+        static bool enabled(int level);
+
+        static void submit(int level, const char *text, size_t length);
+        static uint64_t dropped();
+};
+
+// Streams into a fixed buffer: output past its end is cut off instead of
+// allocating.
+class LogBuffer : public std::streambuf {
+    public:
+        LogBuffer(char *buffer, size_t size) {
+            setp(buffer, buffer + size);
+        }
+
+        size_t length() const {
+            return pptr() - pbase();
+        }
+};
+
+// One line being formatted, submitted when it goes out of scope.
+class LogLine {
+    private:
+        int             _level;
+        char            _text[LOG_LINE_SIZE];
+        LogBuffer       _buffer;
+        std::ostream    _stream;
+
+        LogLine(const LogLine &);
+        LogLine &operator=(const LogLine &);
+
+    public:
+        explicit LogLine(int level): _level(level), _buffer(_text, sizeof(_text)), _stream(&_buffer) {}
+        ~LogLine() {
+            Logger::submit(_level, _text, _buffer.length());
+        }
+
+        std::ostream &stream() {
+            return _stream;
+        }
+};
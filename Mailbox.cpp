@@ -0,0 +1,25 @@
+#include "Mailbox.hpp"
+
+Mailbox::Mailbox(): _head(0), _tail(0) {}
+
+// Producer side. Returns false when the ring is full.
+bool Mailbox::push(const Delivery &delivery) {
+    size_t tail = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+    if (tail - head == MAILBOX_CAPACITY)
+        return false;
+    _ring[tail % MAILBOX_CAPACITY] = delivery;
+    __atomic_store_n(&_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Consumer side. Returns false when the ring is empty.
+bool Mailbox::pop(Delivery &delivery) {
+    size_t head = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return false;
+    delivery = _ring[head % MAILBOX_CAPACITY];
+    __atomic_store_n(&_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include "SharedBuffer.hpp"
+#include "ClientHandle.hpp"
+
+#define MAILBOX_CAPACITY 1024
+
+// A payload handed from one event loop to the loop that owns the recipient.
+// The recipient is named by handle, never by pointer, so a client that
+// disconnected in the meantime is simply skipped.
+struct Delivery {
+    ClientHandle    client;
+    SharedBuffer    *buffer;
+};
+
+// Bounded single-producer/single-consumer ring. Every pair of event loops
+// gets its own mailbox, so neither side ever takes a lock.
+class Mailbox {
+    private:
+        Delivery    _ring[MAILBOX_CAPACITY];
+        char        _pad0[64];
+        size_t      _head;
+        char        _pad1[64];
+        size_t      _tail;
+        char        _pad2[64];
+
+        Mailbox(const Mailbox &);
+        Mailbox &operator=(const Mailbox &);
+
+    public:
+        Mailbox();
+
+        bool push(const Delivery &delivery);
+        bool pop(Delivery &delivery);
+};
@@ -0,0 +1,45 @@
+#include "Message.hpp"
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Splits a framed line into its command and whitespace separated parameters
+// without copying. Once MAX_PARAMS is reached the last parameter swallows the
+// rest of the line. Returns false for blank lines.
+bool parseMessage(const Slice &line, Message &message) {
+    const char *p = line.data();
+    const char *end = line.end();
+
+    while (end > p && isSpace(end[-1]))
+        --end;
+    while (p < end && isSpace(*p))
+        ++p;
+    if (p == end)
+        return false;
+
+    message = Message();
+    message.line = Slice(p, end - p);
+    message.params.setLineEnd(end);
+
+    const char *start = p;
+    while (p < end && !isSpace(*p))
+        ++p;
+    message.command = Slice(start, p - start);
+
+    while (p < end) {
+        while (p < end && isSpace(*p))
+            ++p;
+        if (p == end)
+            break;
+        start = p;
+        if (message.params.size() == MAX_PARAMS - 1) {
+            message.params.push(Slice(start, end - start));
+            break;
+        }
+        while (p < end && !isSpace(*p))
+            ++p;
+        message.params.push(Slice(start, p - start));
+    }
+    return true;
+}
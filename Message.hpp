@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+
+#define MAX_PARAMS 15
+
+// Non-owning view into a client's input buffer. Only valid until the buffer
+// is read into again, so handlers copy with str() whatever they keep.
+class Slice {
+    private:
+        const char  *_data;
+        size_t      _size;
+
+    public:
+        Slice(): _data(""), _size(0) {}
+        Slice(const char *data, size_t size): _data(data), _size(size) {}
+
+        const char *data() const { return _data; }
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+        const char *end() const { return _data + _size; }
+        std::string str() const { return std::string(_data, _size); }
+
+        bool operator==(const Slice &other) const {
+            return _size == other._size && std::memcmp(_data, other._data, _size) == 0;
+        }
+        bool operator==(const std::string &other) const {
+            return _size == other.size() && std::memcmp(_data, other.data(), _size) == 0;
+        }
+        // tokens may hold a NUL, so compare lengths first and never strncmp
+        bool operator==(const char *other) const {
+            size_t n = std::strlen(other);
+            return _size == n && std::memcmp(_data, other, n) == 0;
+        }
+        template <typename T>
+        bool operator!=(const T &other) const { return !(*this == other); }
+};
+
+inline bool operator==(const std::string &lhs, const Slice &rhs) { return rhs == lhs; }
+inline bool operator!=(const std::string &lhs, const Slice &rhs) { return !(rhs == lhs); }
+
+class Params {
+    private:
+        Slice       _items[MAX_PARAMS];
+        size_t      _count;
+        const char  *_lineEnd;
+
+    public:
+        Params(): _count(0), _lineEnd(NULL) {}
+
+        size_t size() const { return _count; }
+        bool empty() const { return _count == 0; }
+        const Slice &operator[](size_t index) const { return _items[index]; }
+
+        // Everything from parameter `index` to the end of the line, with the
+        // original spacing preserved.
+        Slice rest(size_t index) const {
+            return Slice(_items[index].data(), _lineEnd - _items[index].data());
+        }
+
+        void push(const Slice &param) { _items[_count++] = param; }
+        void setLineEnd(const char *end) { _lineEnd = end; }
+        bool full() const { return _count == MAX_PARAMS; }
+};
+
+struct Message {
+    Slice   line;
+    Slice   command;
+    Params  params;
+};
+
+bool parseMessage(const Slice &line, Message &message);
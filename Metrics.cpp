@@ -0,0 +1,161 @@
+#include "Metrics.hpp"
+#include <cstring>
+#include <ctime>
+
+Histogram::Histogram(): _sum(0) {
+    std::memset(_buckets, 0, sizeof(_buckets));
+}
+
+size_t Histogram::bucketOf(uint64_t value) {
+    if (value < (1u << HISTOGRAM_SUB_BITS))
+        return value;
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HISTOGRAM_MAX_BITS)
+        return HISTOGRAM_BUCKETS - 1;
+    size_t sub = (value >> (msb - HISTOGRAM_SUB_BITS)) & ((1u << HISTOGRAM_SUB_BITS) - 1);
+    return ((msb - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+uint64_t Histogram::bucketLimit(size_t index) {
+    if (index < (1u << HISTOGRAM_SUB_BITS))
+        return index;
+    if (index == HISTOGRAM_BUCKETS - 1)
+        return static_cast<uint64_t>(-1);
+    int msb = (index >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = index & ((1u << HISTOGRAM_SUB_BITS) - 1);
+    uint64_t width = 1ULL << (msb - HISTOGRAM_SUB_BITS);
+    return ((1ULL << HISTOGRAM_SUB_BITS) + sub + 1) * width - 1;
+}
+
+void Histogram::record(uint64_t value) {
+    metricAdd(_buckets[bucketOf(value)], 1);
+    metricAdd(_sum, value);
+}
+
+void Histogram::merge(const Histogram &other) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        _buckets[i] += metricRead(other._buckets[i]);
+    _sum += metricRead(other._sum);
+}
+
+uint64_t Histogram::count() const {
+    uint64_t total = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        total += metricRead(_buckets[i]);
+    return total;
+}
+
+uint64_t Histogram::sum() const {
+    return metricRead(_sum);
+}
+
+uint64_t Histogram::bucket(size_t index) const {
+    return metricRead(_buckets[index]);
+}
+
+uint64_t Histogram::percentile(double fraction) const {
+    uint64_t total = count();
+    if (total == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(fraction * total);
+    if (rank >= total)
+        rank = total - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += metricRead(_buckets[i]);
+        if (seen > rank)
+            return bucketLimit(i);
+    }
+    return bucketLimit(HISTOGRAM_BUCKETS - 1);
+}
+
+Metrics::Metrics() {
+    std::memset(_counters, 0, sizeof(_counters));
+}
+
+void Metrics::init(size_t commands) {
+    _commands.assign(commands, CommandStats());
+}
+
+// Only used on a private copy, so the destination is written plainly.
+void Metrics::merge(const Metrics &other) {
+    for (size_t i = 0; i < COUNTER_COUNT; ++i)
+        _counters[i] += metricRead(other._counters[i]);
+    if (_commands.size() < other._commands.size())
+        _commands.resize(other._commands.size());
+    for (size_t i = 0; i < other._commands.size(); ++i) {
+        _commands[i].calls += metricRead(other._commands[i].calls);
+        _commands[i].errors += metricRead(other._commands[i].errors);
+        _commands[i].latency.merge(other._commands[i].latency);
+    }
+    _loopTime.merge(other._loopTime);
+    _sendQueue.merge(other._sendQueue);
+}
+
+void Metrics::count(Counter counter, uint64_t amount) {
+    metricAdd(_counters[counter], amount);
+}
+
+void Metrics::commandDone(size_t command, uint64_t nanoseconds, bool failed) {
+    CommandStats &stats = _commands[command];
+    metricAdd(stats.calls, 1);
+    if (failed)
+        metricAdd(stats.errors, 1);
+    stats.latency.record(nanoseconds);
+}
+
+void Metrics::loopDone(uint64_t nanoseconds) {
+    _loopTime.record(nanoseconds);
+}
+
+void Metrics::sendQueued(uint64_t bytes) {
+    _sendQueue.record(bytes);
+}
+
+uint64_t Metrics::counter(Counter counter) const {
+    return metricRead(_counters[counter]);
+}
+
+size_t Metrics::commandCount() const {
+    return _commands.size();
+}
+
+const CommandStats &Metrics::command(size_t command) const {
+    return _commands[command];
+}
+
+const Histogram &Metrics::loopTime() const {
+    return _loopTime;
+}
+
+const Histogram &Metrics::sendQueue() const {
+    return _sendQueue;
+}
+
+const char *Metrics::counterName(Counter counter) {
+    static const char *names[COUNTER_COUNT] = {
+        "connections_accepted",
+        "connections_rejected",
+        "connections_closed",
+        "messages_in",
+        "messages_out",
+        "bytes_in",
+        "bytes_out",
+        "send_calls",
+        "flood_disconnects",
+        "timeout_disconnects",
+        "sendq_evictions",
+        "budget_evictions",
+        "link_lines_in",
+        "link_lines_out",
+        "link_bytes_in",
+        "link_bytes_out"
+    };
+    return names[counter];
+}
+
+uint64_t Metrics::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-bucketed histogram: values below 2^HISTOGRAM_SUB_BITS get a bucket
+// each, every power of two above is split into 2^HISTOGRAM_SUB_BITS
+// sub-buckets, so a bucket's bounds are within 25% of each other. Values of
+// 2^HISTOGRAM_MAX_BITS and more share the last bucket.
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// Every metric is written by a single shard thread and read by whichever
+// thread renders them, so plain relaxed loads and stores are enough: no
+// increment is ever lost and no locked instruction is needed.
+inline void metricAdd(uint64_t &value, uint64_t amount)
+{
+    __atomic_store_n(&value, __atomic_load_n(&value, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+inline uint64_t metricRead(const uint64_t &value)
+{
+    return __atomic_load_n(&value, __ATOMIC_RELAXED);
+}
+
+class Histogram {
+    private:
+        uint64_t    _buckets[HISTOGRAM_BUCKETS];
+        uint64_t    _sum;
+
+    public:
+        Histogram();
+
+        void record(uint64_t value);
+        void merge(const Histogram &other);
+
+        uint64_t count() const;
+        uint64_t sum() const;
+        uint64_t bucket(size_t index) const;
+        // largest value of the bucket holding the given fraction of samples
+        uint64_t percentile(double fraction) const;
+
+        static size_t bucketOf(uint64_t value);
+        static uint64_t bucketLimit(size_t index);
+};
+
+struct CommandStats {
+    uint64_t    calls;
+    uint64_t    errors;
+    Histogram   latency;
+
+    CommandStats(): calls(0), errors(0) {}
+};
+
+// Telemetry of one shard. Server merges the shards' instances to answer
+// STATS and the admin socket.
+class Metrics {
+    public:
+        enum Counter {
+            CONNECTIONS_ACCEPTED,
+            CONNECTIONS_REJECTED,
+            CONNECTIONS_CLOSED,
+            MESSAGES_IN,
+            MESSAGES_OUT,
+            BYTES_IN,
+            BYTES_OUT,
+            SEND_CALLS,
+            FLOOD_DISCONNECTS,
+            TIMEOUT_DISCONNECTS,
+            SENDQ_EVICTIONS,
+            BUDGET_EVICTIONS,
+            LINK_LINES_IN,      // server links, see ServerLink.cpp
+            LINK_LINES_OUT,
+            LINK_BYTES_IN,
+            LINK_BYTES_OUT,
+            COUNTER_COUNT
+        };
+
+    private:
+        uint64_t                    _counters[COUNTER_COUNT];
+        std::vector<CommandStats>   _commands;
+        Histogram                   _loopTime;
+        Histogram                   _sendQueue;
+
+    public:
+        Metrics();
+
+        void init(size_t commands);
+        void merge(const Metrics &other);
+
+        void count(Counter counter, uint64_t amount = 1);
+        void commandDone(size_t command, uint64_t nanoseconds, bool failed);
+        void loopDone(uint64_t nanoseconds);
+        void sendQueued(uint64_t bytes);
+
+        uint64_t counter(Counter counter) const;
+        size_t commandCount() const;
+        const CommandStats &command(size_t command) const;
+        const Histogram &loopTime() const;
+        const Histogram &sendQueue() const;
+
+        static const char *counterName(Counter counter);
+        static uint64_t now();
+};
@@ -4,22 +4,69 @@
 #include <string>
 #include <map>
 #include <vector>
-#include <poll.h>
+#include <sys/epoll.h>
 #include <fcntl.h>
 #include <algorithm>
 #include <cstring>
 #include <cerrno>
 #include <cstdlib>
+#include <climits>
 #include <sstream>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <signal.h>
 #include "Client.hpp"
 #include "Channel.hpp"
+#include "Config.hpp"
+#include "Message.hpp"
+#include "HashMap.hpp"
+#include "Shard.hpp"
+#include "ClientSlab.hpp"
+#include "Metrics.hpp"
+#include "Log.hpp"
+#include "StateCodec.hpp"
+#include "ChannelStore.hpp"
+#include "Link.hpp"
 
-#define MAX_CLIENTS 100
-#define BUFFER_SIZE 512
+// descriptors kept free for stdio and logging, and used by every shard
+// (listener, epoll or ring, wake eventfd)
+#define FD_RESERVED 16
+#define FD_PER_SHARD 3
+#define SENDQ_WARN_SIZE (64 * 1024)
+#define COMMAND_SLOTS 64
+// LIST and LSTMEMBERS output is produced in chunks of about LIST_CHUNK_SIZE
+// bytes while less than LIST_HIGH_WATER bytes are queued for the client, and
+// picked up again once the queue has drained below LIST_LOW_WATER.
+#define LIST_CHUNK_SIZE 4096
+#define LIST_HIGH_WATER (16 * 1024)
+#define LIST_LOW_WATER 4096
+// pieces of a reply template queued at once, see sendTemplate
+#define TEMPLATE_PIECES 32
+// flood control tokens are kept in thousandths, see Client::refillTokens
+#define FLOOD_TOKEN_UNIT 1000
+// clients holding this much are the candidates for memory budget evictions
+#define MEMORY_HEAVY_SIZE (64 * 1024)
+// largest consumers listed by STATS and the admin socket
+#define TOP_CONSUMERS 5
+// Hot upgrade, see ServerUpgrade.cpp: SIGUSR2 starts the binary on disk
+// with the socket it inherits named in HANDOVER_ENV. Either side gives up
+// after HANDOVER_TIMEOUT seconds of silence from the other, and
+// descriptors are passed HANDOVER_FD_BATCH per message.
+#define UPGRADE_SIGNAL SIGUSR2
+#define HANDOVER_ENV "IRCSERV_HANDOVER_FD"
+#define HANDOVER_TIMEOUT 10
+#define HANDOVER_FD_BATCH 250
+#define HANDOVER_MAGIC 0x48435249u
+#define HANDOVER_VERSION 3
 
 #define RESET_COLOR "\033[0m"
 #define RED_COLOR "\033[31m"
@@ -28,58 +75,342 @@
 
 class Channel;
 
+// Threading model: every shard runs its own event loop (see Shard.hpp) and
+// owns the sockets and I/O buffers of its clients. The global registries
+// below (clients, nicknames, channels, the links) and every Client/Channel
+// field they lead to are guarded by the state lock, which is one mutex per
+// shard (Shard::state_lock):
+//   - lockShard takes the calling shard's own mutex. It lets the shard read
+//     the registries and change what only it owns: its clients' queues,
+//     flood tokens and timers, its mailboxes and metrics. PRIVMSG, PING,
+//     PONG, LIST, LSTMEMBERS, HELP and channel text run this way, as do the
+//     timer checks and resumed listings, so the shards deliver messages in
+//     parallel without touching a shared cache line.
+//   - lockState takes every shard's mutex in index order, excluding all of
+//     them. Anything that changes the registries needs it: registration,
+//     NICK, channel membership and modes, connecting and disconnecting, the
+//     link protocol, and the threads without a shard (snapshots, upgrades).
+// A shard never holds its own part while asking for the whole lock. The
+// lock is taken per line, never across a batch of input. What remains
+// serialized is therefore the registry-changing commands against all other
+// commands, and shard 0's reading of link input; text arriving over a link
+// is delivered under the whole lock. Output for a client owned by another
+// shard is never queued directly; it is posted to that shard's mailbox and
+// written by the owning thread.
 class Server {
+    // runs the private command paths in isolation (bench/microbench.cpp)
+    friend class MicroBench;
+
     private:
-        int server_fd;
         std::string password;
-        std::map<int, Client*> clients;
-        std::vector<struct pollfd> poll_fds;
+        ServerConfig config;
+        std::vector<Shard*> shards;
+        ClientSlab clients;
+        HashMap<Client*> nicknames;
         std::map<std::string, Channel*> channels;
+        int admin_fd;
+
+        // hot upgrade: the binary to start, and the shards parked while
+        // their clients are handed over (pause_requested is polled by the
+        // event loops without the lock)
+        std::string exe_path;
+        pthread_t upgrade_thread;
+        pthread_mutex_t pause_lock;
+        pthread_cond_t pause_cond;
+        int pause_requested;
+        size_t parked;
+        // what this process took over from its predecessor, if anything
+        size_t handover_clients;
+        size_t handover_channels;
+        uint64_t handover_ns;
+        // channel persistence (ServerStore.cpp) and what start-up restored
+        ChannelStore store;
+        size_t restored_channels;
+        size_t restored_records;
+        uint64_t restore_ns;
+        // server links (ServerLink.cpp): every link, dialled or accepted,
+        // the link leading to each server of the network and the clients
+        // of the other servers, all guarded by the state lock. The sockets
+        // belong to shard 0; links_dirty tells it that output is pending.
+        // Shards holding only their own part of the state lock may queue
+        // lines side by side, so link_lock guards every Link::pending.
+        std::vector<Link*> links;
+        std::map<std::string, Link*> servers;
+        HashMap<RemoteUser*> remote_users;
+        int link_listen_fd;
+        uint32_t next_link_id;
+        int links_dirty;
+        pthread_mutex_t link_lock;
+        TimerNode link_timer;
+        // posted to a client that lost its nickname to another server's
+        SharedBuffer *collision_notice;
+
+        typedef void (Server::*CommandFunc)(Client*, const Params&);
+        typedef void (Server::*ChannelCommandFunc)(Channel*, Client*, const Params&);
+        typedef void (Server::*LinkCommandFunc)(Link*, const Message&);
+
+        // how far PASS/NICK/USER registration must have progressed
+        enum Registration {
+            REG_NONE,
+            REG_PASS,
+            REG_NICK,
+            REG_DONE
+        };
+
+        enum CommandScope {
+            SCOPE_ANY,
+            SCOPE_CHANNEL
+        };
+
+        // how much of the state lock a command needs, see lockShard
+        enum CommandLocking {
+            LOCK_SHARD,
+            LOCK_ALL
+        };
 
-        typedef void (Server::*CommandFunc)(Client*, const std::vector<std::string>&);
-        typedef void (Server::*ChannelCommandFunc)(Channel*, Client*, const std::vector<std::string>&);
-        typedef void (Server::*commonFunc)(Client*, const std::vector<std::string>&);
+        struct CommandSpec {
+            const char          *name;
+            size_t              length;
+            CommandFunc         handler;
+            ChannelCommandFunc  channelHandler;
+            Registration        required;
+            CommandScope        scope;
+            CommandLocking      locking;
+            int                 cost;       // flood control tokens per line
+        };
 
-        std::map<std::string, CommandFunc> command_map;
-        std::map<std::string, ChannelCommandFunc> channel_command_map;
-        std::map<std::string, commonFunc> common_command_map;
+        struct LinkCommand {
+            const char          *name;
+            LinkCommandFunc     handler;
+            size_t              params;     // at least this many
+        };
+
+        static const CommandSpec command_table[];
+        static const LinkCommand link_table[];
+        static unsigned char command_slots[COMMAND_SLOTS];
+        // entries in command_table; metrics also track lines sent to the
+        // active channel (index command_count) and unknown commands (+1)
+        static size_t command_count;
+        // tokens charged per metrics slot, see initFloodControl
+        std::vector<int32_t> command_costs;
 
         // server functions
         void initServer(const std::string& port_str);
-        void acceptNewClient();
-        void removeClient(Client *client, const std::vector<std::string>& params);
-        void handleClientMessage(int fd);
+        size_t raiseFdLimit();
+        static size_t clientSlotBytes();
+        int openListener(int port);
+        void initShard(Shard &shard);
+        void adoptListener(Shard &shard, int fd);
+        static void *shardMain(void *arg);
+        void runShard(Shard &shard);
+        void runShardEpoll(Shard &shard);
+        void acceptNewClient(Shard &shard);
+        Client *addClient(Shard &shard, int client_fd);
+        Client *localClient(Shard &shard, int fd);
+        void removeClient(Client *client);
+        void handleClientMessage(Shard &shard, int fd);
+        bool processInput(Client *client, int &budget);
+        void throttleClient(Shard &shard, Client *client);
+        void readBacklog(Shard &shard, Client *client);
+        bool checkRecvq(Shard &shard, Client *client);
+        void closeWithError(Client *client, const char *reason);
+        void account(Shard &shard, Client *client);
+        void evictClient(Shard &shard, Client *client, Metrics::Counter counter, const char *reason);
+        void enforceMemoryBudget(Shard &shard);
+        uint64_t clientMemory() const;
+        void topConsumers(std::vector<Client*> &top);
+        void resumeInput(Shard &shard);
+        void initFloodControl();
+        static uint32_t floodClock();
+        static uint32_t timeoutTicks(int seconds);
+        void armTimer(Shard &shard, Client *client);
+        void runTimers(Shard &shard);
+        void checkTimeouts(Shard &shard, Client *client);
+        void handleClientWritable(Shard &shard, int fd);
+        void drainMailboxes(Shard &shard);
+        void finishBatch(Shard &shard);
+        void lockShard();
+        void unlockShard();
+        void lockState();
+        void unlockState();
+        void flushClient(Shard &shard, Client *client);
+        void afterQueue(Client *client, size_t queued);
+        void post(Client *client, SharedBuffer *buffer);
+        void scheduleRemoval(Client *client);
+        void reapClosingClients(Shard &shard);
+        void continueListing(Client *client);
+        bool appendChannels(ListCursor &cursor, std::string &out);
+        void listingDrained(Shard &shard, Client *client);
+        void resumeListings(Shard &shard);
+
+        // metrics and the admin socket
+        void initAdminSocket();
+        void watchAdminSocket();
+        void serveAdmin();
+        void collectMetrics(Metrics &total);
+        std::string renderMetrics();
+        void renderTopConsumers(std::ostringstream &out);
+        static const char *slotName(size_t slot);
+
+        // hot upgrade (ServerUpgrade.cpp)
+        static void *upgradeMain(void *arg);
+        void runUpgrades();
+        void upgrade();
+        pid_t spawnSuccessor(int socket);
+        static void closeInherited(int socket, int limit);
+        void pauseShards();
+        void resumeShards();
+        void parkShard(Shard &shard);
+        void collectDeliveries();
+        size_t encodeState(StateWriter &state, std::vector<int> &fds);
+        bool sendHandover(int socket, size_t &handed);
+        bool receiveHandover(int socket);
+        bool restoreState(StateReader &state, const std::vector<int> &fds);
+        Client *restoreClient(StateReader &state, int fd);
+
+        // channel persistence (ServerStore.cpp)
+        void loadChannels();
+        static uint64_t encodeSnapshot(void *context, StateWriter &state);
+        void encodeChannels(StateWriter &state);
+        bool decodeChannels(StateReader &state);
+        static void replayRecord(void *context, StateReader &record);
+        void applyRecord(StateReader &record);
+
+        // server links (ServerLink.cpp)
+        void initLinks(const std::string &port_str);
+        void freeLinks();
+        void openLinkListener();
+        void watchLinkListener();
+        void dialLinks(Shard &shard);
+        void acceptLinks(Shard &shard);
+        void startLink(Shard &shard, Link *link);
+        bool serveLink(Shard &shard, int fd, uint32_t events);
+        Link *findLink(uint32_t id) const;
+        void watchLink(Shard &shard, Link *link);
+        void linkWritable(Shard &shard, Link *link);
+        void readLink(Shard &shard, Link *link);
+        void writeLink(Shard &shard, Link *link);
+        void flushLinks(Shard &shard);
+        void dropLink(Link *link, const std::string &reason);
+        void closeLink(Shard &shard, Link *link);
+        void reapLinks();
+        void expireLink(TimerNode *timer);
+        void squitServer(const std::string &name);
+        void runLinkLine(Link *link, const Message &message);
+        void sendLine(Link *link, const Slice &line);
+        void sendLine(Link *link, const std::string &line);
+        void burstLink(Link *link);
+        bool claimNickname(const std::string &nickname, const std::string &server);
+        void dropCollided(Client *client);
+        RemoteUser *remoteUser(const Slice &nickname, const Slice &server, Link *link);
+        void removeRemoteUser(RemoteUser *user);
+        void relayChannelText(Channel *channel, const std::string &line, Link *from);
+        void renderLinks(std::ostringstream &out);
+        void linkSERVER(Link *link, const Message &message);
+        void linkERROR(Link *link, const Message &message);
+        void linkSID(Link *link, const Message &message);
+        void linkSQUIT(Link *link, const Message &message);
+        void linkNICK(Link *link, const Message &message);
+        void linkRENAME(Link *link, const Message &message);
+        void linkQUIT(Link *link, const Message &message);
+        void linkCHANNEL(Link *link, const Message &message);
+        void linkJOIN(Link *link, const Message &message);
+        void linkPART(Link *link, const Message &message);
+        void linkKICK(Link *link, const Message &message);
+        void linkOP(Link *link, const Message &message);
+        void linkBAN(Link *link, const Message &message);
+        void linkUNBAN(Link *link, const Message &message);
+        void linkDELETE(Link *link, const Message &message);
+        void linkPRIVMSG(Link *link, const Message &message);
+        void linkCMSG(Link *link, const Message &message);
+
+        // io_uring backend (ServerRing.cpp)
+        bool initRing(Shard &shard);
+        void runShardRing(Shard &shard);
+#ifndef NO_IO_URING
+        void armAccept(Shard &shard);
+        void armAdmin(Shard &shard);
+        void armRecv(Shard &shard, Client *client);
+        void armWake(Shard &shard);
+        void armRetryTimer(Shard &shard);
+        void armWheelTimer(Shard &shard);
+        void armLinkAccept(Shard &shard);
+        void armLinkInput(Shard &shard, Link *link);
+        void armLinkOutput(Shard &shard, Link *link);
+        void cancelLinkPolls(Shard &shard, Link *link);
+        void handleRingLink(Shard &shard, uint32_t id, const struct io_uring_cqe &cqe);
+        void handleCompletion(Shard &shard, const struct io_uring_cqe &cqe);
+        void handleRingAccept(Shard &shard, const struct io_uring_cqe &cqe);
+        void handleRingRecv(Shard &shard, int fd, const struct io_uring_cqe &cqe);
+        void handleRingSend(Shard &shard, int fd, const struct io_uring_cqe &cqe);
+        void submitSend(Shard &shard, Client *client);
+        void pauseRecv(Shard &shard, Client *client);
+        bool resumeRecv(Shard &shard, Client *client);
+        Client *ringClient(Shard &shard, int fd);
+        void endRingOp(Shard &shard, Client *client);
+        void cancelRingOp(Shard &shard, uint64_t target);
+        void quiesceRing(Shard &shard);
+        void rearmRing(Shard &shard);
+#endif
         void setNonBlocking(int fd);
-        void parseCommand(Client* client, const std::string& message);
-        void registerCommands();
+        uint32_t readEvents() const;
+        void parseCommand(Client* client, const Message& message);
+        void parseCommand(Client* client, const Message& message, const CommandSpec *spec);
+        size_t dispatchCommand(Client* client, const Message& message, const CommandSpec *spec);
+        static void registerCommands();
+        static const CommandSpec *findCommand(const Slice& name);
+        static Registration registrationOf(const Client *client);
+        static Shard *currentShard();
     
         // channel commands
-        void leaveChannel(Channel *channel, Client* client, const std::vector<std::string>& params);
-        void deleteChannel(Channel *channel, Client* client, const std::vector<std::string>& params);
-        void kickMemberFromChannel(Channel *channel, Client* client, const std::vector<std::string>& params);
-        void listChannelMembers(Channel *channel, Client *client, const std::vector<std::string>& params);
-        void addOpToChannel(Channel *channel, Client* client, const std::vector<std::string>& params);
+        void leaveChannel(Channel *channel, Client* client, const Params& params);
+        void deleteChannel(Channel *channel, Client* client, const Params& params);
+        void kickMemberFromChannel(Channel *channel, Client* client, const Params& params);
+        void listChannelMembers(Channel *channel, Client *client, const Params& params);
+        void addOpToChannel(Channel *channel, Client* client, const Params& params);
+        void banFromChannel(Channel *channel, Client* client, const Params& params);
+        void unbanFromChannel(Channel *channel, Client* client, const Params& params);
 
         // server commands
-        void handlePASS(Client*, const std::vector<std::string>& params);
-        void handleNICK(Client* client, const std::vector<std::string>& params);
-        void handleUSER(Client* client, const std::vector<std::string>& params);
-        void handlePING(Client* client, const std::vector<std::string>& params);
-        void handlePRIVMSG(Client* client, const std::vector<std::string>& params);
-        void createChannel(Client *client, const std::vector<std::string>& params);
-        void joinChannel(Client *client, const std::vector<std::string>& params);
-        void listChannels(Client *client, const std::vector<std::string>& params);
-        void handleHelp(Client *client, const std::vector<std::string>& params);
+        void handlePASS(Client* client, const Params& params);
+        void handleNICK(Client* client, const Params& params);
+        void handleUSER(Client* client, const Params& params);
+        void handlePING(Client* client, const Params& params);
+        void handlePONG(Client* client, const Params& params);
+        void handlePRIVMSG(Client* client, const Params& params);
+        void createChannel(Client *client, const Params& params);
+        void joinChannel(Client *client, const Params& params);
+        void listChannels(Client *client, const Params& params);
+        void handleHelp(Client *client, const Params& params);
+        void handleQUIT(Client *client, const Params& params);
+        void handleOPER(Client *client, const Params& params);
+        void handleSTATS(Client *client, const Params& params);
 
         // utils
         void sendWelcomeMessage(Client *client);
-        const std::string Prefix(Client *client) const;
+        const std::string &Prefix(Client *client) const;
 
     public:
         static bool isNumber(const std::string& input);
-        Server(const std::string& port_str, const std::string& password);
+        static void blockUpgradeSignal();
+        Server(const std::string& port_str, const std::string& password, const ServerConfig& config);
+        Server(const std::string& password, const ServerConfig& config);
         ~Server();
         void run();
         void sendMessage(int fd, const std::string& message);
+        void sendError(Client *client, const char *message);
+        void sendPieces(Client *client, const Slice *pieces, size_t count);
+        void sendReply(Client *client, const char *text);
+        void sendReply(Client *client, const char *text, const Slice &argument);
+        void sendReply(Client *client, const char *text, const std::string &argument);
+        void replyError(Client *client, const char *text);
+        void sendTemplate(Client *client, const char *text);
+        void sendBuffer(Client *client, SharedBuffer *buffer);
         void removeChannel(Channel* channel);
+        void journalChannel(ChannelRecord type, const std::string &channel, const std::string &target = std::string(),
+                            uint64_t expires = 0, const std::string &password = std::string());
+        Client *getClient(const ClientHandle &handle) const;
+        Client *findClientByNickname(const std::string& nickname);
+        Client *findClientByNickname(const Slice& nickname);
+        void relayLine(const std::string &line, Link *from = NULL);
 };
\ No newline at end of file
@@ -0,0 +1,1099 @@
+#include "Server.hpp"
+#include <arpa/inet.h>
+
+// Server links. Several servers linked up in a tree share one network: one
+// namespace of nicknames and one set of channels. Each server passes what
+// it learns over a link on to its other links, so every server knows every
+// client and channel, and only relays a message towards the servers that
+// have a recipient. A PRIVMSG goes down the one link leading to its
+// target and channel text down each link leading to at least one member,
+// however many members are behind it: a message crosses a link once.
+//
+// The protocol is one command per line, words separated by spaces; the
+// last word of PRIVMSG and CMSG runs to the end of the line:
+//
+//   SERVER <name> <password>           first line of the dialling side,
+//                                      answered in kind once checked
+//   SID <name>                         a server behind the sender
+//   SQUIT <name>                       a server and its clients are gone
+//   NICK <nick> <server>               a client of <server> took a nickname
+//   RENAME <old> <new> <server>
+//   QUIT <nick> <server>
+//   CHANNEL <name> <password> <server> <server> created the channel
+//   JOIN <channel> <nick> <server>
+//   PART <channel> <nick> <server>
+//   KICK <channel> <nick>              removed and banned by nickname
+//   OP <channel> <nick>                routed to the server of <nick>
+//   BAN <channel> <mask> <expires>
+//   UNBAN <channel> <mask>
+//   DELETE <channel> <nick>
+//   PRIVMSG <nick> <nick!user@host> <text>
+//   CMSG <channel> <nick> <text>
+//   ERROR <reason>                     the sender closes the link
+//
+// Once SERVER is exchanged each side sends a burst of what it knows that
+// is not behind the other: servers, nicknames, then channels with their
+// members and bans. Ops stay with the server of the op, which is where its
+// commands are checked.
+//
+// Two servers may hand out one nickname before they hear of each other.
+// The client of the server whose name sorts first keeps it; the other is
+// disconnected by its own server with "Nickname collision". Records of a
+// client name its server, so the loser's QUIT never removes the winner.
+// Two CHANNELs of one name are settled alike: the password of the server
+// whose name sorts first stands.
+
+const Server::LinkCommand Server::link_table[] = {
+    { "PRIVMSG", &Server::linkPRIVMSG, 3 },
+    { "CMSG", &Server::linkCMSG, 3 },
+    { "JOIN", &Server::linkJOIN, 3 },
+    { "PART", &Server::linkPART, 3 },
+    { "NICK", &Server::linkNICK, 2 },
+    { "RENAME", &Server::linkRENAME, 3 },
+    { "QUIT", &Server::linkQUIT, 2 },
+    { "CHANNEL", &Server::linkCHANNEL, 3 },
+    { "KICK", &Server::linkKICK, 2 },
+    { "OP", &Server::linkOP, 2 },
+    { "BAN", &Server::linkBAN, 3 },
+    { "UNBAN", &Server::linkUNBAN, 2 },
+    { "DELETE", &Server::linkDELETE, 2 },
+    { "SID", &Server::linkSID, 1 },
+    { "SQUIT", &Server::linkSQUIT, 1 },
+    { "SERVER", &Server::linkSERVER, 2 },
+    { "ERROR", &Server::linkERROR, 0 },
+    { NULL, NULL, 0 }
+};
+
+// NICK lines for every client connected here.
+struct NicknameBurst {
+    std::string         &out;
+    const std::string   &server;
+    size_t              lines;
+
+    NicknameBurst(std::string &out, const std::string &server): out(out), server(server), lines(0) {}
+    void operator()(const std::string &nickname, Client *const &client) {
+        (void)client;
+        out += "NICK " + nickname + " " + server + "\r\n";
+        ++lines;
+    }
+};
+
+// NICK lines for the clients of other servers, but those behind `except`.
+struct RemoteBurst {
+    std::string &out;
+    Link        *except;
+    size_t      lines;
+
+    RemoteBurst(std::string &out, Link *except): out(out), except(except), lines(0) {}
+    void operator()(const std::string &nickname, RemoteUser *const &user) {
+        if (user->link == except)
+            return;
+        out += "NICK " + nickname + " " + user->server + "\r\n";
+        ++lines;
+    }
+};
+
+struct AllUsers {
+    std::vector<RemoteUser*>    users;
+
+    void operator()(const std::string &nickname, RemoteUser *const &user) {
+        (void)nickname;
+        users.push_back(user);
+    }
+};
+
+struct ServerUsers {
+    const std::string           &server;
+    std::vector<RemoteUser*>    users;
+
+    ServerUsers(const std::string &server): server(server) {}
+    void operator()(const std::string &nickname, RemoteUser *const &user) {
+        (void)nickname;
+        if (user->server == server)
+            users.push_back(user);
+    }
+};
+
+static std::string linkLabel(const Link *link)
+{
+    if (!link->name.empty())
+        return link->name;
+    if (!link->target.empty())
+        return link->target;
+    std::ostringstream label;
+    label << "FD " << link->fd;
+    return label.str();
+}
+
+// Runs once a handover, if any, is done: a link listener handed over is
+// kept. Dialled links are first tried on shard 0's first tick.
+void Server::initLinks(const std::string &port_str)
+{
+    if (config.serverName.empty())
+        config.serverName = "ircserv." + port_str;
+    if (!config.linkPort && config.links.empty())
+        return;
+    if (config.linkPassword.empty())
+    {
+        LOG_ERROR(RED_COLOR << "Server links need --link-password" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < config.links.size(); ++i)
+    {
+        const std::string &target = config.links[i];
+        size_t colon = target.rfind(':');
+        std::string port = target.substr(colon + 1);
+        Link *link = new Link(next_link_id++, -1);
+        link->target = target;
+        link->address.sin_family = AF_INET;
+        link->address.sin_port = htons(std::atoi(port.c_str()));
+        links.push_back(link);
+        if (port.empty() || !isNumber(port) || std::atoi(port.c_str()) > PORT_LIMIT
+            || inet_pton(AF_INET, target.substr(0, colon).c_str(), &link->address.sin_addr) != 1)
+        {
+            LOG_ERROR(RED_COLOR << "Invalid link address: " << target << RESET_COLOR);
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    if (config.linkPort && link_listen_fd == -1)
+        openLinkListener();
+    if (!config.links.empty())
+        shards[0]->timers.arm(&link_timer, shards[0]->timer_now);
+    std::ostringstream accepting;
+    if (config.linkPort)
+        accepting << ", accepting links on port " << config.linkPort;
+    LOG_INFO(GREEN_COLOR << "Linking as " << config.serverName << ", dialling " << config.links.size() << " links"
+             << accepting.str() << RESET_COLOR);
+}
+
+void Server::freeLinks()
+{
+    for (size_t i = 0; i < links.size(); ++i)
+    {
+        if (links[i]->fd != -1)
+            close(links[i]->fd);
+        delete links[i];
+    }
+    AllUsers all;
+    remote_users.visit(all);
+    for (size_t i = 0; i < all.users.size(); ++i)
+        delete all.users[i];
+    if (link_listen_fd != -1)
+        close(link_listen_fd);
+}
+
+void Server::openLinkListener()
+{
+    link_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int opt = 1;
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(config.linkPort);
+    if (link_listen_fd == -1 || setsockopt(link_listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1
+        || bind(link_listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1
+        || listen(link_listen_fd, SOMAXCONN) == -1)
+    {
+        LOG_ERROR(RED_COLOR << "Link listener setup failed: " << strerror(errno) << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+    watchLinkListener();
+}
+
+// Shard 0 accepts links; its io_uring loop arms the poll itself.
+void Server::watchLinkListener()
+{
+    Shard &shard = *shards[0];
+    if (shard.usesRing())
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = link_listen_fd;
+    if (epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, link_listen_fd, &event) == -1)
+    {
+        LOG_ERROR(RED_COLOR << "Epoll registration failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+// Dials every configured link that is down. Runs on shard 0 from the timer
+// wheel with the whole state lock held; a link that fails is tried again after
+// LINK_RETRY_MS, see dropLink.
+void Server::dialLinks(Shard &shard)
+{
+    for (size_t i = 0; i < links.size(); ++i)
+    {
+        Link *link = links[i];
+        if (link->target.empty() || link->fd != -1)
+            continue;
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd != -1 && connect(fd, (struct sockaddr *)&link->address, sizeof(link->address)) == -1
+            && errno != EINPROGRESS)
+        {
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1)
+        {
+            LOG_WARN(RED_COLOR << "Link to " << link->target << " failed: " << strerror(errno) << RESET_COLOR);
+            shard.timers.arm(&link_timer, shard.timer_now + LINK_RETRY_MS / TIMER_TICK_MS);
+            continue;
+        }
+        link->id = next_link_id++;
+        link->fd = fd;
+        link->connecting = true;
+        startLink(shard, link);
+    }
+}
+
+void Server::acceptLinks(Shard &shard)
+{
+    while (true)
+    {
+        int fd = accept4(link_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_ERROR(RED_COLOR << "Link accept failed: " << strerror(errno) << RESET_COLOR);
+            break;
+        }
+        lockState();
+        size_t unregistered = 0;
+        for (size_t i = 0; i < links.size(); ++i)
+            if (links[i]->target.empty() && links[i]->fd != -1 && !links[i]->established)
+                ++unregistered;
+        if (unregistered >= LINK_MAX_UNREGISTERED)
+        {
+            unlockState();
+            std::string line = "ERROR :Too many unregistered links\r\n";
+            send(fd, line.data(), line.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(fd);
+            continue;
+        }
+        Link *link = new Link(next_link_id++, fd);
+        links.push_back(link);
+        LOG_INFO(GREEN_COLOR << "Link accepted: FD " << fd << RESET_COLOR);
+        startLink(shard, link);
+        unlockState();
+    }
+}
+
+// The dialling side introduces itself first, once connected; the accepting
+// side answers only a peer that knew the password, see linkSERVER. The
+// peer has LINK_REGISTRATION_TIMEOUT seconds, connecting included, to send
+// its SERVER. Must be called with the whole state lock held.
+void Server::startLink(Shard &shard, Link *link)
+{
+    int on = 1;
+    setsockopt(link->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (!link->target.empty())
+        sendLine(link, "SERVER " + config.serverName + " " + config.linkPassword);
+    watchLink(shard, link);
+    shard.timers.arm(&link->timer, shard.timer_now + timeoutTicks(LINK_REGISTRATION_TIMEOUT));
+}
+
+// A link whose registration deadline passed. Runs on shard 0 from the
+// timer wheel with the whole state lock held.
+void Server::expireLink(TimerNode *timer)
+{
+    for (size_t i = 0; i < links.size(); ++i)
+    {
+        Link *link = links[i];
+        if (&link->timer != timer || link->fd == -1 || link->established)
+            continue;
+        if (link->connecting)
+            LOG_WARN(RED_COLOR << "Link to " << link->target << " failed: connect timed out" << RESET_COLOR);
+        dropLink(link, "Registration timeout");
+        return;
+    }
+}
+
+// The link on `fd`, if shard 0 has one there: its events are served and
+// true returned.
+bool Server::serveLink(Shard &shard, int fd, uint32_t events)
+{
+    if (fd == link_listen_fd)
+    {
+        acceptLinks(shard);
+        return true;
+    }
+    Link *link = NULL;
+    for (size_t i = 0; i < links.size() && !link; ++i)
+        if (links[i]->fd == fd)
+            link = links[i];
+    if (!link)
+        return false;
+    if ((events & EPOLLOUT) || (link->connecting && (events & (EPOLLERR | EPOLLHUP))))
+        linkWritable(shard, link);
+    if (link->fd == fd && !link->connecting && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        readLink(shard, link);
+    return true;
+}
+
+Link *Server::findLink(uint32_t id) const
+{
+    for (size_t i = 0; i < links.size(); ++i)
+        if (links[i]->id == id)
+            return links[i];
+    return NULL;
+}
+
+// Registers the socket with shard 0 for what the link waits for: room to
+// finish connecting, then input, and room for output while the socket is
+// full. Called whenever one of these changes.
+void Server::watchLink(Shard &shard, Link *link)
+{
+#ifndef NO_IO_URING
+    if (shard.usesRing())
+    {
+        if (link->connecting || link->waitingOut)
+            armLinkOutput(shard, link);
+        if (!link->connecting && !link->pollArmed)
+            armLinkInput(shard, link);
+        return;
+    }
+#endif
+    struct epoll_event event;
+    event.events = EPOLLOUT;
+    if (!link->connecting)
+        event.events = link->waitingOut ? (EPOLLIN | EPOLLRDHUP | EPOLLOUT) : (EPOLLIN | EPOLLRDHUP);
+    event.data.fd = link->fd;
+    if (epoll_ctl(shard.epoll_fd, link->pollArmed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, link->fd, &event) == -1)
+        LOG_ERROR(RED_COLOR << "Epoll registration failed: link FD " << link->fd << RESET_COLOR);
+    link->pollArmed = true;
+}
+
+// The connect finished, or output that did not fit may go on.
+void Server::linkWritable(Shard &shard, Link *link)
+{
+    if (link->connecting)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1)
+            error = errno;
+        lockState();
+        if (error)
+        {
+            LOG_WARN(RED_COLOR << "Link to " << link->target << " failed: " << strerror(error) << RESET_COLOR);
+            dropLink(link, "");
+        }
+        else
+        {
+            LOG_INFO(GREEN_COLOR << "Link to " << link->target << " connected" << RESET_COLOR);
+            link->connecting = false;
+            watchLink(shard, link);
+            // the SERVER line waits in `pending`
+            __atomic_store_n(&links_dirty, 1, __ATOMIC_RELEASE);
+        }
+        unlockState();
+        return;
+    }
+    link->waitingOut = false;
+    writeLink(shard, link);
+    if (link->fd != -1 && !link->waitingOut)
+        watchLink(shard, link);
+}
+
+// Runs the lines of every chunk as it is read, so besides one chunk only
+// a partial line is kept. A peer whose line outgrows LINK_MAX_LINE, or
+// LINK_MAX_UNREGISTERED_LINE before it sent SERVER, is dropped.
+void Server::readLink(Shard &shard, Link *link)
+{
+    char buffer[LINK_READ_SIZE];
+    while (link->fd != -1)
+    {
+        ssize_t received = recv(link->fd, buffer, sizeof(buffer), 0);
+        if (received == -1 && errno == EINTR)
+            continue;
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (received > 0)
+        {
+            metricAdd(link->bytesIn, received);
+            if (config.metrics)
+                shard.metrics.count(Metrics::LINK_BYTES_IN, received);
+        }
+
+        lockState();
+        if (received <= 0)
+            dropLink(link, "");
+        else
+        {
+            link->input.append(buffer, received);
+            size_t start = 0;
+            size_t end;
+            while (link->fd != -1 && (end = link->input.find('\n', start)) != std::string::npos)
+            {
+                Message message;
+                if (parseMessage(Slice(link->input.data() + start, end - start), message))
+                    runLinkLine(link, message);
+                start = end + 1;
+            }
+            if (link->fd != -1)
+            {
+                link->input.erase(0, start);
+                size_t limit = link->established ? LINK_MAX_LINE : LINK_MAX_UNREGISTERED_LINE;
+                if (link->input.size() > limit)
+                    dropLink(link, "Line too long");
+            }
+        }
+        unlockState();
+    }
+}
+
+// Writes as much output as the socket takes and waits for room for the
+// rest. Shard 0 only; `output` is not shared.
+void Server::writeLink(Shard &shard, Link *link)
+{
+    size_t written = 0;
+    while (written < link->output.size())
+    {
+        ssize_t sent = send(link->fd, link->output.data() + written, link->output.size() - written,
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent > 0)
+        {
+            written += sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            link->waitingOut = true;
+            watchLink(shard, link);
+            break;
+        }
+        lockState();
+        dropLink(link, "");
+        unlockState();
+        return;
+    }
+    link->output.erase(0, written);
+    metricAdd(link->bytesOut, written);
+    __atomic_store_n(&link->queued, link->output.size(), __ATOMIC_RELAXED);
+    if (config.metrics)
+        shard.metrics.count(Metrics::LINK_BYTES_OUT, written);
+}
+
+// Runs at the end of every batch of shard 0: moves the lines the shards
+// queued into the links' output and writes it out, dropping a link that
+// lets LINK_MAX_SENDQ bytes pile up. A link dropped on the way queues
+// lines for the others, hence the loop. Only shard 0 changes `links`, so
+// it reads the list without the state lock, and takes the whole lock only
+// to drop or free a link.
+void Server::flushLinks(Shard &shard)
+{
+    while (__atomic_exchange_n(&links_dirty, 0, __ATOMIC_ACQ_REL))
+    {
+        bool changed = false;
+        pthread_mutex_lock(&link_lock);
+        for (size_t i = 0; i < links.size(); ++i)
+        {
+            Link *link = links[i];
+            if (link->fd == -1 && link->target.empty())
+                changed = true;
+            if (link->pending.empty() || link->connecting)
+                continue;
+            if (link->output.empty())
+                link->output.swap(link->pending);
+            else
+                link->output.append(link->pending);
+            link->pending.clear();
+            if (link->output.size() > LINK_MAX_SENDQ)
+                changed = true;
+        }
+        pthread_mutex_unlock(&link_lock);
+        if (changed)
+        {
+            lockState();
+            for (size_t i = 0; i < links.size(); ++i)
+                if (links[i]->fd != -1 && links[i]->output.size() > LINK_MAX_SENDQ)
+                    dropLink(links[i], "SendQ exceeded");
+            reapLinks();
+            unlockState();
+        }
+
+        for (size_t i = 0; i < links.size(); ++i)
+            if (links[i]->fd != -1 && !links[i]->waitingOut && !links[i]->output.empty())
+                writeLink(shard, links[i]);
+    }
+}
+
+// Frees the accepted links that were dropped; dialled ones are kept to be
+// dialled again. Must be called with the whole state lock held.
+void Server::reapLinks()
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < links.size(); ++i)
+    {
+        if (links[i]->fd == -1 && links[i]->target.empty())
+            delete links[i];
+        else
+            links[kept++] = links[i];
+    }
+    links.resize(kept);
+}
+
+// Takes back everything learnt over the link, telling the other links, and
+// closes it with a last "ERROR :<reason>" line unless `reason` is empty.
+// A dialled link is dialled again after LINK_RETRY_MS, an accepted one is
+// freed once the batch is done. Runs on shard 0 with the whole state lock
+// held.
+void Server::dropLink(Link *link, const std::string &reason)
+{
+    if (link->fd == -1)
+        return;
+    Shard &shard = *shards[0];
+    if (!reason.empty() && link->output.empty())
+    {
+        std::string line = "ERROR :" + reason + "\r\n";
+        send(link->fd, line.data(), line.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    // a failed connect was logged as such
+    if (!link->connecting)
+        LOG_WARN(RED_COLOR << "Link " << linkLabel(link) << " closed" << (reason.empty() ? "" : ": ") << reason
+                 << RESET_COLOR);
+
+    std::vector<std::string> behind;
+    for (std::map<std::string, Link *>::iterator it = servers.begin(); it != servers.end(); ++it)
+        if (it->second == link)
+            behind.push_back(it->first);
+    for (size_t i = 0; i < behind.size(); ++i)
+    {
+        relayLine("SQUIT " + behind[i], link);
+        squitServer(behind[i]);
+    }
+
+    closeLink(shard, link);
+    if (!link->target.empty() && !link_timer.armed())
+        shard.timers.arm(&link_timer, shard.timer_now + LINK_RETRY_MS / TIMER_TICK_MS);
+    // an accepted link is freed by flushLinks
+    __atomic_store_n(&links_dirty, 1, __ATOMIC_RELEASE);
+}
+
+void Server::closeLink(Shard &shard, Link *link)
+{
+#ifndef NO_IO_URING
+    // polls are ended by their id; one completing later finds the link down
+    if (shard.usesRing())
+        cancelLinkPolls(shard, link);
+    else
+#endif
+    if (link->pollArmed)
+        epoll_ctl(shard.epoll_fd, EPOLL_CTL_DEL, link->fd, NULL);
+    close(link->fd);
+    shard.timers.cancel(&link->timer);
+    link->fd = -1;
+    link->name.clear();
+    link->connecting = false;
+    link->established = false;
+    link->pollArmed = false;
+    link->waitingOut = false;
+    link->input.clear();
+    link->pending.clear();
+    link->output.clear();
+    __atomic_store_n(&link->queued, 0, __ATOMIC_RELAXED);
+}
+
+// Forgets a server and its clients, who leave their channels.
+void Server::squitServer(const std::string &name)
+{
+    servers.erase(name);
+    ServerUsers gone(name);
+    remote_users.visit(gone);
+    for (size_t i = 0; i < gone.users.size(); ++i)
+        removeRemoteUser(gone.users[i]);
+}
+
+// A peer that has not registered is dropped on its first line that is not
+// a well-formed SERVER or ERROR; only registered peers get a log line for
+// what they send wrong.
+void Server::runLinkLine(Link *link, const Message &message)
+{
+    metricAdd(link->linesIn, 1);
+    if (config.metrics)
+        shards[0]->metrics.count(Metrics::LINK_LINES_IN);
+    for (const LinkCommand *command = link_table; command->name; ++command)
+    {
+        if (message.command != command->name)
+            continue;
+        bool allowed = command->handler == &Server::linkSERVER || command->handler == &Server::linkERROR;
+        if (!link->established && (!allowed || message.params.size() < command->params))
+            dropLink(link, "Not registered");
+        else if (message.params.size() < command->params)
+            LOG_WARN(RED_COLOR << "Link " << linkLabel(link) << ": malformed " << command->name << RESET_COLOR);
+        else
+            (this->*command->handler)(link, message);
+        return;
+    }
+    if (!link->established)
+        dropLink(link, "Not registered");
+    else
+        LOG_WARN(RED_COLOR << "Link " << linkLabel(link) << ": unknown command " << message.command.str()
+                 << RESET_COLOR);
+}
+
+// Queues one line for the link. Must be called with the state lock held,
+// on any shard: shard 0 picks the line up at the end of its batch.
+void Server::sendLine(Link *link, const Slice &line)
+{
+    if (link->fd == -1)
+        return;
+    pthread_mutex_lock(&link_lock);
+    link->pending.append(line.data(), line.size());
+    link->pending.append("\r\n", 2);
+    pthread_mutex_unlock(&link_lock);
+    metricAdd(link->linesOut, 1);
+    if (config.metrics)
+        currentShard()->metrics.count(Metrics::LINK_LINES_OUT);
+    if (!__atomic_load_n(&links_dirty, __ATOMIC_RELAXED))
+        __atomic_store_n(&links_dirty, 1, __ATOMIC_RELEASE);
+    if (currentShard()->index != 0)
+        currentShard()->wake_pending[0] = 1;
+}
+
+void Server::sendLine(Link *link, const std::string &line)
+{
+    sendLine(link, Slice(line.data(), line.size()));
+}
+
+// Sends the line to every linked server but the one it came from. Must be
+// called with the state lock held.
+void Server::relayLine(const std::string &line, Link *from)
+{
+    for (size_t i = 0; i < links.size(); ++i)
+        if (links[i] != from && links[i]->established)
+            sendLine(links[i], line);
+}
+
+// Channel text goes once down each link leading to members.
+void Server::relayChannelText(Channel *channel, const std::string &line, Link *from)
+{
+    const std::map<Link *, size_t> &leading = channel->getLinks();
+    for (std::map<Link *, size_t>::const_iterator it = leading.begin(); it != leading.end(); ++it)
+        if (it->first != from)
+            sendLine(it->first, line);
+}
+
+// Everything this server knows that is not behind `link`, in an order the
+// other side can apply as it reads: servers, nicknames, channels.
+void Server::burstLink(Link *link)
+{
+    std::string burst;
+    size_t lines = 0;
+    for (std::map<std::string, Link *>::iterator it = servers.begin(); it != servers.end(); ++it)
+    {
+        if (it->second == link)
+            continue;
+        burst += "SID " + it->first + "\r\n";
+        ++lines;
+    }
+    NicknameBurst local(burst, config.serverName);
+    nicknames.visit(local);
+    RemoteBurst remote(burst, link);
+    remote_users.visit(remote);
+    lines += local.lines + remote.lines;
+
+    time_t now = time(NULL);
+    std::vector<std::pair<std::string, time_t> > bans;
+    for (std::map<std::string, Channel *>::iterator it = channels.begin(); it != channels.end(); ++it)
+    {
+        Channel *channel = it->second;
+        const std::string &name = channel->getName();
+        const std::string &origin = channel->getOrigin().empty() ? config.serverName : channel->getOrigin();
+        burst += "CHANNEL " + name + " " + channel->getPassword() + " " + origin + "\r\n";
+        ++lines;
+        const std::set<ClientHandle> &members = channel->getMembers();
+        for (std::set<ClientHandle>::const_iterator member = members.begin(); member != members.end(); ++member)
+        {
+            Client *client = getClient(*member);
+            if (!client)
+                continue;
+            burst += "JOIN " + name + " " + client->getNickname() + " " + config.serverName + "\r\n";
+            ++lines;
+        }
+        const std::map<std::string, RemoteUser *> &others = channel->getRemoteMembers();
+        for (std::map<std::string, RemoteUser *>::const_iterator member = others.begin(); member != others.end();
+             ++member)
+        {
+            if (member->second->link == link)
+                continue;
+            burst += "JOIN " + name + " " + member->first + " " + member->second->server + "\r\n";
+            ++lines;
+        }
+        bans.clear();
+        channel->getBans().entries(bans);
+        for (size_t i = 0; i < bans.size(); ++i)
+        {
+            if (bans[i].second != 0 && bans[i].second <= now)
+                continue;
+            std::ostringstream line;
+            line << "BAN " << name << " " << bans[i].first << " " << bans[i].second << "\r\n";
+            burst += line.str();
+            ++lines;
+        }
+    }
+    link->pending += burst;
+    metricAdd(link->linesOut, lines);
+    if (config.metrics)
+        shards[0]->metrics.count(Metrics::LINK_LINES_OUT, lines);
+    __atomic_store_n(&links_dirty, 1, __ATOMIC_RELEASE);
+    LOG_INFO(GREEN_COLOR << "Link to " << link->name << " established, " << lines << " lines of burst"
+             << RESET_COLOR);
+}
+
+// Settles a nickname that a client of `server` takes against the one
+// holding it here, if any. Returns true when the nickname is free for it
+// now.
+bool Server::claimNickname(const std::string &nickname, const std::string &server)
+{
+    Client *local = findClientByNickname(nickname);
+    if (local)
+    {
+        if (config.serverName <= server)
+            return false;
+        nicknames.erase(nickname);
+        dropCollided(local);
+        return true;
+    }
+    RemoteUser **holder = remote_users.find(nickname);
+    if (!holder)
+        return true;
+    if ((*holder)->server <= server)
+        return false;
+    removeRemoteUser(*holder);
+    return true;
+}
+
+// The client lost its nickname to one of another server. Its nickname is
+// no longer registered here; the client is dropped by its own shard.
+void Server::dropCollided(Client *client)
+{
+    if (client->isClosing())
+        return;
+    LOG_WARN(RED_COLOR << "Nickname collision: " << client->getNickname() << " on FD " << client->getFd()
+             << RESET_COLOR);
+    if (client->getShard() == currentShard()->index)
+        closeWithError(client, "Nickname collision");
+    else
+        post(client, collision_notice);
+}
+
+// The client `nickname` of `server`, if it is known behind `link`.
+RemoteUser *Server::remoteUser(const Slice &nickname, const Slice &server, Link *link)
+{
+    RemoteUser **user = remote_users.find(nickname.data(), nickname.size());
+    if (!user || (*user)->server != server || (*user)->link != link)
+        return NULL;
+    return *user;
+}
+
+void Server::removeRemoteUser(RemoteUser *user)
+{
+    std::set<Channel *> joined = user->channels;
+    for (std::set<Channel *>::iterator it = joined.begin(); it != joined.end(); ++it)
+    {
+        (*it)->removeRemoteMember(user);
+        (*it)->broadcastText(user->nickname + ": " + user->nickname + " has left the channel " + (*it)->getName()
+                             + "\r\n", NULL);
+    }
+    remote_users.erase(user->nickname);
+    delete user;
+}
+
+// One "link" line per link for STATS. Must be called with the state lock
+// held.
+void Server::renderLinks(std::ostringstream &out)
+{
+    for (size_t i = 0; i < links.size(); ++i)
+    {
+        Link *link = links[i];
+        const char *state = "down";
+        if (link->established)
+            state = "established";
+        else if (link->connecting)
+            state = "connecting";
+        else if (link->fd != -1)
+            state = "handshake";
+        out << "link " << linkLabel(link) << " " << state << " lines in " << metricRead(link->linesIn)
+            << " out " << metricRead(link->linesOut) << " bytes in " << metricRead(link->bytesIn)
+            << " out " << metricRead(link->bytesOut) << " sendq "
+            << __atomic_load_n(&link->queued, __ATOMIC_RELAXED) + link->pending.size() << "\r\n";
+    }
+    out << "network servers " << servers.size() + 1 << " remote users " << remote_users.size() << "\r\n";
+}
+
+void Server::linkSERVER(Link *link, const Message &message)
+{
+    const Params &params = message.params;
+    if (link->established)
+        return;
+    std::string name = params[0].str();
+    if (params.rest(1) != config.linkPassword)
+    {
+        LOG_WARN(RED_COLOR << "Link " << linkLabel(link) << ": bad password from " << name << RESET_COLOR);
+        dropLink(link, "Bad link password");
+        return;
+    }
+    if (name == config.serverName || servers.find(name) != servers.end())
+    {
+        dropLink(link, "Server " + name + " already linked");
+        return;
+    }
+    if (link->target.empty())
+        sendLine(link, "SERVER " + config.serverName + " " + config.linkPassword);
+    link->name = name;
+    link->established = true;
+    shards[0]->timers.cancel(&link->timer);
+    servers[name] = link;
+    relayLine("SID " + name, link);
+    burstLink(link);
+}
+
+void Server::linkERROR(Link *link, const Message &message)
+{
+    std::string reason = message.params.empty() ? std::string() : message.params.rest(0).str();
+    LOG_WARN(RED_COLOR << "Link " << linkLabel(link) << " says " << reason << RESET_COLOR);
+    dropLink(link, "");
+}
+
+void Server::linkSID(Link *link, const Message &message)
+{
+    std::string name = message.params[0].str();
+    if (name == config.serverName || servers.find(name) != servers.end())
+    {
+        dropLink(link, "Server " + name + " already linked");
+        return;
+    }
+    servers[name] = link;
+    relayLine(message.line.str(), link);
+}
+
+void Server::linkSQUIT(Link *link, const Message &message)
+{
+    std::map<std::string, Link *>::iterator it = servers.find(message.params[0].str());
+    if (it == servers.end() || it->second != link)
+        return;
+    squitServer(it->first);
+    relayLine(message.line.str(), link);
+}
+
+void Server::linkNICK(Link *link, const Message &message)
+{
+    std::string nickname = message.params[0].str();
+    std::string server = message.params[1].str();
+    std::map<std::string, Link *>::iterator behind = servers.find(server);
+    if (behind == servers.end() || behind->second != link || !claimNickname(nickname, server))
+        return;
+    RemoteUser *user = new RemoteUser();
+    user->nickname = nickname;
+    user->server = server;
+    user->link = link;
+    remote_users.insert(nickname, user);
+    relayLine(message.line.str(), link);
+}
+
+// A rename that loses a collision ends the client as far as this side of
+// the network is concerned.
+void Server::linkRENAME(Link *link, const Message &message)
+{
+    const Params &params = message.params;
+    RemoteUser *user = remoteUser(params[0], params[2], link);
+    std::string nickname = params[1].str();
+    if (!user || user->nickname == nickname)
+        return;
+    std::string old_nickname = user->nickname;
+    if (!claimNickname(nickname, user->server))
+    {
+        relayLine("QUIT " + old_nickname + " " + user->server, link);
+        removeRemoteUser(user);
+        return;
+    }
+    remote_users.erase(old_nickname);
+    user->nickname = nickname;
+    remote_users.insert(nickname, user);
+    for (std::set<Channel *>::iterator it = user->channels.begin(); it != user->channels.end(); ++it)
+        (*it)->renameRemoteMember(user, old_nickname);
+    relayLine(message.line.str(), link);
+}
+
+void Server::linkQUIT(Link *link, const Message &message)
+{
+    RemoteUser *user = remoteUser(message.params[0], message.params[1], link);
+    if (!user)
+        return;
+    removeRemoteUser(user);
+    relayLine(message.line.str(), link);
+}
+
+void Server::linkCHANNEL(Link *link, const Message &message)
+{
+    const Params &params = message.params;
+    std::string name = params[0].str();
+    std::string password = params[1].str();
+    std::string origin = params[2].str();
+    std::map<std::string, Channel *>::iterator it = channels.find(name);
+    if (it == channels.end())
+    {
+        Channel *channel = new Channel(name, this);
+        channel->setPassword(password);
+        channel->setOrigin(origin);
+        channels[name] = channel;
+        journalChannel(RECORD_CREATE, name, "", 0, password);
+    }
+    else
+    {
+        Channel *channel = it->second;
+        const std::string &ours = channel->getOrigin().empty() ? config.serverName : channel->getOrigin();
+        if (ours <= origin)
+            return;
+        channel->setOrigin(origin);
+        if (channel->getPassword() != password)
+        {
+            channel->setPassword(password);
+            journalChannel(RECORD_PASSWORD, name, "", 0, password);
+        }
+    }
+    relayLine(message.line.str(), link);
+}
+
+void Server::linkJOIN(Link *link, const Message &message)
+{
+    std::map<std::string, Channel *>::iterator it = channels.find(message.params[0].str());
+    RemoteUser *user = remoteUser(message.params[1], message.params[2], link);
+    if (it == channels.end() || !user || user->channels.count(it->second))
+        return;
+    Channel *channel = it->second;
+    channel->addRemoteMember(user);
+    channel->broadcastText(user->nickname + ": " + user->nickname + " has joined the channel\r\n", NULL);
+    relayLine(message.line.str(), link);
+}
+
+void Server::linkPART(Link *link, const Message &message)
+{
+    std::map<std::string, Channel *>::iterator it = channels.find(message.params[0].str());
+    RemoteUser *user = remoteUser(message.params[1], message.params[2], link);
+    if (it == channels.end() || !user || !user->channels.count(it->second))
+        return;
+    Channel *channel = it->second;
+    channel->removeRemoteMember(user);
+    channel->broadcastText(user->nickname + ": " + user->nickname + " has left the channel " + channel->getName()
+                           + "\r\n", NULL);
+    relayLine(message.line.str(), link);
+}
+
+void Server::linkKICK(Link *link, const Message &message)
+{
+    std::map<std::string, Channel *>::iterator it = channels.find(message.params[0].str());
+    if (it == channels.end())
+        return;
+    Channel *channel = it->second;
+    std::string nickname = message.params[1].str();
+    Client *target = findClientByNickname(nickname);
+    RemoteUser *remote = channel->findRemoteMember(nickname);
+    if (target && channel->isMember(target))
+    {
+        sendMessage(target->getFd(), "You have been kicked from the channel\r\n");
+        channel->removeMember(target);
+    }
+    else if (remote)
+        channel->removeRemoteMember(remote);
+    channel->ban(nickname, 0);
+    journalChannel(RECORD_BAN, channel->getName(), nickname);
+    relayLine(message.line.str(), link);
+}
+
+// Goes down the one link leading to the new op, whose server keeps ops.
+void Server::linkOP(Link *link, const Message &message)
+{
+    std::map<std::string, Channel *>::iterator it = channels.find(message.params[0].str());
+    if (it == channels.end())
+        return;
+    Channel *channel = it->second;
+    std::string nickname = message.params[1].str();
+    Client *target = findClientByNickname(nickname);
+    RemoteUser *remote = channel->findRemoteMember(nickname);
+    if (target && channel->isMember(target))
+    {
+        channel->addOp(target);
+        journalChannel(RECORD_ADDOP, channel->getName(), nickname);
+    }
+    else if (remote && remote->link != link)
+        sendLine(remote->link, message.line);
+}
+
+void Server::linkBAN(Link *link, const Message &message)
+{
+    std::map<std::string, Channel *>::iterator it = channels.find(message.params[0].str());
+    if (it == channels.end())
+        return;
+    std::string mask = message.params[1].str();
+    time_t expires = static_cast<time_t>(std::strtoll(message.params[2].str().c_str(), NULL, 10));
+    it->second->ban(mask, expires);
+    journalChannel(RECORD_BAN, it->first, mask, expires);
+    relayLine(message.line.str(), link);
+}
+
+void Server::linkUNBAN(Link *link, const Message &message)
+{
+    std::map<std::string, Channel *>::iterator it = channels.find(message.params[0].str());
+    std::string mask = message.params[1].str();
+    if (it == channels.end() || !it->second->unban(mask))
+        return;
+    journalChannel(RECORD_UNBAN, it->first, mask);
+    relayLine(message.line.str(), link);
+}
+
+void Server::linkDELETE(Link *link, const Message &message)
+{
+    std::map<std::string, Channel *>::iterator it = channels.find(message.params[0].str());
+    if (it == channels.end())
+        return;
+    it->second->dissolve(message.params[1].str(), NULL);
+    relayLine(message.line.str(), link);
+}
+
+// Delivered as if the sender were connected here, or passed on towards
+// the target.
+void Server::linkPRIVMSG(Link *link, const Message &message)
+{
+    const Params &params = message.params;
+    Client *target = findClientByNickname(params[0]);
+    if (target)
+    {
+        Slice mask = params[1];
+        const char *bang = static_cast<const char *>(std::memchr(mask.data(), '!', mask.size()));
+        Slice sender(mask.data(), bang ? bang - mask.data() : mask.size());
+        const std::string &nickname = target->getNickname();
+        Slice pieces[] = {
+            Slice(":", 1),
+            mask,
+            Slice(" :", 2),
+            sender,
+            Slice(" PRIVMSG ", 9),
+            Slice(nickname.data(), nickname.size()),
+            Slice(" ", 1),
+            params.rest(2),
+            Slice("\r\n", 2)
+        };
+        sendPieces(target, pieces, sizeof(pieces) / sizeof(*pieces));
+        return;
+    }
+    RemoteUser **user = remote_users.find(params[0].data(), params[0].size());
+    if (user && (*user)->link != link)
+        sendLine((*user)->link, message.line);
+}
+
+void Server::linkCMSG(Link *link, const Message &message)
+{
+    std::map<std::string, Channel *>::iterator it = channels.find(message.params[0].str());
+    if (it == channels.end())
+        return;
+    Channel *channel = it->second;
+    relayChannelText(channel, message.line.str(), link);
+    channel->broadcastText(message.params[1].str() + ": " + message.params.rest(2).str() + "\r\n", NULL);
+}
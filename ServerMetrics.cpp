@@ -0,0 +1,235 @@
+#include "Server.hpp"
+
+// Name of a metrics slot, see dispatchCommand.
+const char *Server::slotName(size_t slot)
+{
+    if (slot < command_count)
+        return command_table[slot].name;
+    return slot == command_count ? "channel_message" : "unknown";
+}
+
+// Sparse cumulative buckets: only the bounds where the count grows are
+// written, followed by +Inf, _sum and _count.
+static void renderHistogram(std::ostringstream &out, const char *name, const std::string &labels, const Histogram &histogram)
+{
+    std::string open = labels.empty() ? "{" : "{" + labels + ",";
+    uint64_t seen = 0;
+    for (size_t i = 0; i + 1 < HISTOGRAM_BUCKETS; ++i)
+    {
+        uint64_t count = histogram.bucket(i);
+        if (count == 0)
+            continue;
+        seen += count;
+        out << name << "_bucket" << open << "le=\"" << Histogram::bucketLimit(i) << "\"} " << seen << "\n";
+    }
+    seen += histogram.bucket(HISTOGRAM_BUCKETS - 1);
+    out << name << "_bucket" << open << "le=\"+Inf\"} " << seen << "\n";
+    std::string plain = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << plain << " " << histogram.sum() << "\n";
+    out << name << "_count" << plain << " " << seen << "\n";
+}
+
+// Label values may not hold raw quotes, backslashes or newlines.
+static std::string labelValue(const std::string &value)
+{
+    std::string escaped;
+    for (size_t i = 0; i < value.size(); ++i)
+    {
+        if (value[i] == '"' || value[i] == '\\')
+            escaped += '\\';
+        if (value[i] == '\n')
+            escaped += "\\n";
+        else
+            escaped += value[i];
+    }
+    return escaped;
+}
+
+// The largest consumers by kind of memory, one series per client.
+void Server::renderTopConsumers(std::ostringstream &out)
+{
+    static const char *kinds[] = { "input", "output", "shared" };
+
+    lockState();
+    std::vector<Client*> top;
+    topConsumers(top);
+    out << "# TYPE ircserv_top_client_memory_bytes gauge\n";
+    for (size_t i = 0; i < top.size(); ++i)
+    {
+        ClientMemory memory = top[i]->getAccounted();
+        size_t bytes[] = { memory.input, memory.output, memory.shared };
+        for (size_t kind = 0; kind < 3; ++kind)
+            out << "ircserv_top_client_memory_bytes{fd=\"" << top[i]->getFd() << "\",nick=\""
+                << labelValue(top[i]->getNickname()) << "\",kind=\"" << kinds[kind] << "\"} "
+                << bytes[kind] << "\n";
+    }
+    unlockState();
+}
+
+// Listens on config.adminSocket. Shard 0 serves it next to its clients.
+void Server::initAdminSocket()
+{
+    struct sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (config.adminSocket.size() >= sizeof(address.sun_path))
+    {
+        LOG_ERROR(RED_COLOR << "Admin socket path is too long" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+    std::strcpy(address.sun_path, config.adminSocket.c_str());
+
+    admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    // a stale socket file left by an earlier run would make bind() fail
+    unlink(config.adminSocket.c_str());
+    if (admin_fd == -1 || bind(admin_fd, (struct sockaddr *)&address, sizeof(address)) == -1
+        || listen(admin_fd, SOMAXCONN) == -1)
+    {
+        LOG_ERROR(RED_COLOR << "Admin socket setup failed: " << strerror(errno) << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+
+    watchAdminSocket();
+}
+
+// Shard 0 serves the admin socket; its io_uring loop arms the poll itself.
+void Server::watchAdminSocket()
+{
+    Shard &shard = *shards[0];
+    if (shard.usesRing())
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = admin_fd;
+    if (epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, admin_fd, &event) == -1)
+    {
+        LOG_ERROR(RED_COLOR << "Epoll registration failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+// Every connection to the admin socket receives one dump in the text
+// exposition format and is closed, e.g. `socat - UNIX-CONNECT:<path>`. The
+// dump fits the socket buffer of a local connection, so it is written
+// without blocking the event loop.
+void Server::serveAdmin()
+{
+    while (true)
+    {
+        int fd = accept4(admin_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_ERROR(RED_COLOR << "Admin accept failed: " << strerror(errno) << RESET_COLOR);
+            return;
+        }
+        std::string dump = renderMetrics();
+        ssize_t sent = send(fd, dump.data(), dump.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent != static_cast<ssize_t>(dump.size()))
+            LOG_WARN(RED_COLOR << "Admin socket: metrics dump truncated" << RESET_COLOR);
+        close(fd);
+    }
+}
+
+// Sums the shards' metrics. Each shard only ever writes its own, so this
+// needs no lock and may run on any thread.
+void Server::collectMetrics(Metrics &total)
+{
+    total.init(command_count + 2);
+    for (size_t i = 0; i < shards.size(); ++i)
+        total.merge(shards[i]->metrics);
+}
+
+std::string Server::renderMetrics()
+{
+    std::ostringstream out;
+    if (!config.metrics)
+    {
+        out << "# metrics are disabled (--no-metrics)\n";
+        return out.str();
+    }
+
+    Metrics total;
+    collectMetrics(total);
+
+    for (int i = 0; i < Metrics::COUNTER_COUNT; ++i)
+    {
+        Metrics::Counter counter = static_cast<Metrics::Counter>(i);
+        out << "# TYPE ircserv_" << Metrics::counterName(counter) << "_total counter\n";
+        out << "ircserv_" << Metrics::counterName(counter) << "_total " << total.counter(counter) << "\n";
+    }
+    out << "# TYPE ircserv_connections_open gauge\n";
+    out << "ircserv_connections_open "
+        << total.counter(Metrics::CONNECTIONS_ACCEPTED) - total.counter(Metrics::CONNECTIONS_CLOSED) << "\n";
+    out << "# TYPE ircserv_client_memory_bytes gauge\n";
+    out << "ircserv_client_memory_bytes " << clientMemory() << "\n";
+    out << "# TYPE ircserv_memory_budget_bytes gauge\n";
+    out << "ircserv_memory_budget_bytes " << config.memoryBudget << "\n";
+    renderTopConsumers(out);
+    if (handover_ns)
+    {
+        out << "# TYPE ircserv_handover_clients gauge\n";
+        out << "ircserv_handover_clients " << handover_clients << "\n";
+        out << "# TYPE ircserv_handover_seconds gauge\n";
+        out << "ircserv_handover_seconds " << handover_ns / 1e9 << "\n";
+    }
+    if (!links.empty() || link_listen_fd != -1)
+    {
+        lockState();
+        size_t established = 0;
+        for (size_t i = 0; i < links.size(); ++i)
+            established += links[i]->established;
+        out << "# TYPE ircserv_links gauge\n";
+        out << "ircserv_links " << established << "\n";
+        out << "# TYPE ircserv_remote_users gauge\n";
+        out << "ircserv_remote_users " << remote_users.size() << "\n";
+        unlockState();
+    }
+    if (store.isOpen())
+    {
+        StoreStats persisted = store.stats();
+        out << "# TYPE ircserv_journal_records_total counter\n";
+        out << "ircserv_journal_records_total " << persisted.records << "\n";
+        out << "# TYPE ircserv_journal_bytes_total counter\n";
+        out << "ircserv_journal_bytes_total " << persisted.journalBytes << "\n";
+        out << "# TYPE ircserv_snapshots_total counter\n";
+        out << "ircserv_snapshots_total " << persisted.snapshots << "\n";
+        out << "# TYPE ircserv_snapshot_bytes gauge\n";
+        out << "ircserv_snapshot_bytes " << persisted.snapshotBytes << "\n";
+        out << "# TYPE ircserv_snapshot_seconds gauge\n";
+        out << "ircserv_snapshot_seconds " << persisted.snapshotNs / 1e9 << "\n";
+        out << "# TYPE ircserv_store_errors_total counter\n";
+        out << "ircserv_store_errors_total " << persisted.errors << "\n";
+        out << "# TYPE ircserv_restored_channels gauge\n";
+        out << "ircserv_restored_channels " << restored_channels << "\n";
+        out << "# TYPE ircserv_restore_seconds gauge\n";
+        out << "ircserv_restore_seconds " << restore_ns / 1e9 << "\n";
+    }
+    out << "# TYPE ircserv_log_lines_dropped_total counter\n";
+    out << "ircserv_log_lines_dropped_total " << Logger::dropped() << "\n";
+
+    out << "# TYPE ircserv_command_calls_total counter\n";
+    for (size_t i = 0; i < total.commandCount(); ++i)
+        if (total.command(i).calls)
+            out << "ircserv_command_calls_total{command=\"" << slotName(i) << "\"} "
+                << total.command(i).calls << "\n";
+    out << "# TYPE ircserv_command_errors_total counter\n";
+    for (size_t i = 0; i < total.commandCount(); ++i)
+        if (total.command(i).calls)
+            out << "ircserv_command_errors_total{command=\"" << slotName(i) << "\"} "
+                << total.command(i).errors << "\n";
+    out << "# TYPE ircserv_command_duration_nanoseconds histogram\n";
+    for (size_t i = 0; i < total.commandCount(); ++i)
+        if (total.command(i).calls)
+            renderHistogram(out, "ircserv_command_duration_nanoseconds",
+                            std::string("command=\"") + slotName(i) + "\"",
+                            total.command(i).latency);
+
+    out << "# TYPE ircserv_loop_iteration_nanoseconds histogram\n";
+    renderHistogram(out, "ircserv_loop_iteration_nanoseconds", "", total.loopTime());
+    out << "# TYPE ircserv_send_queue_bytes histogram\n";
+    renderHistogram(out, "ircserv_send_queue_bytes", "", total.sendQueue());
+    return out.str();
+}
@@ -0,0 +1,596 @@
+#include "Server.hpp"
+
+#ifndef NO_IO_URING
+
+#include <poll.h>
+
+// user_data layout: operation in the high 32 bits, descriptor in the low 32.
+// Server links carry their id instead, see Link.hpp.
+enum RingOp {
+    RING_ACCEPT = 1,
+    RING_RECV,
+    RING_SEND,
+    RING_WAKE,
+    RING_TIMEOUT,
+    RING_ADMIN,
+    RING_CANCEL,
+    RING_WHEEL,     // the low 32 bits carry the wheel tick
+    RING_LINK_ACCEPT,
+    RING_LINK,
+    RING_LINK_OUT
+};
+
+static uint64_t ringData(RingOp op, int fd)
+{
+    return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(fd);
+}
+
+bool Server::initRing(Shard &shard)
+{
+    IoUring *ring = new IoUring();
+    if (ring->init(URING_ENTRIES))
+    {
+        shard.ring = ring;
+        return true;
+    }
+    delete ring;
+    if (shard.index == 0)
+        LOG_WARN(RED_COLOR << "io_uring is not available, falling back to epoll" << RESET_COLOR);
+    return false;
+}
+
+// Completion-driven loop: multishot accept and receive stay armed, sends are
+// prepared as clients produce output, and everything is handed to the kernel
+// in one io_uring_enter() per iteration.
+void Server::runShardRing(Shard &shard)
+{
+    if (shard.listen_fd != -1)
+        armAccept(shard);
+    armWake(shard);
+    if (shard.index == 0 && admin_fd != -1)
+        armAdmin(shard);
+    if (shard.index == 0 && link_listen_fd != -1)
+        armLinkAccept(shard);
+
+    while (true)
+    {
+        // clients waiting for flood control tokens are polled with the timer
+        bool waiting = !shard.closing_fds.empty() || shard.hasOverflow() || shard.throttle_wait > 0;
+        if (waiting && !shard.timer_armed)
+            armRetryTimer(shard);
+        armWheelTimer(shard);
+
+        // pending listings and throttled clients that may run are resumed
+        // without waiting for a completion
+        bool idle = shard.resume_fds.empty() && shard.throttle_wait != 0;
+        if (shard.ring->submitAndWait(idle ? 1 : 0) < 0)
+        {
+            LOG_ERROR(RED_COLOR << "io_uring error: " << strerror(errno) << RESET_COLOR);
+            std::exit(EXIT_FAILURE);
+        }
+
+        ++shard.tick;
+        shard.timer_now = TimerWheel::clock();
+        uint64_t started = config.metrics ? Metrics::now() : 0;
+        struct io_uring_cqe *cqe;
+        while ((cqe = shard.ring->peekCqe()) != NULL)
+        {
+            struct io_uring_cqe completion = *cqe;
+            shard.ring->seenCqe();
+            handleCompletion(shard, completion);
+        }
+
+        runTimers(shard);
+        resumeInput(shard);
+        resumeListings(shard);
+        enforceMemoryBudget(shard);
+        reapClosingClients(shard);
+        finishBatch(shard);
+        if (config.metrics)
+            shard.metrics.loopDone(Metrics::now() - started);
+        if (__atomic_load_n(&pause_requested, __ATOMIC_ACQUIRE))
+            parkShard(shard);
+    }
+}
+
+void Server::armAccept(Shard &shard)
+{
+    struct io_uring_sqe *sqe = shard.ring->getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = shard.listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = ringData(RING_ACCEPT, shard.listen_fd);
+    shard.accept_armed = true;
+}
+
+void Server::armRecv(Shard &shard, Client *client)
+{
+    struct io_uring_sqe *sqe = shard.ring->getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->getFd();
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = ringData(RING_RECV, client->getFd());
+    client->setRingOps(client->getRingOps() + 1);
+}
+
+void Server::armWake(Shard &shard)
+{
+    struct io_uring_sqe *sqe = shard.ring->getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shard.wake_fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = ringData(RING_WAKE, shard.wake_fd);
+}
+
+void Server::armAdmin(Shard &shard)
+{
+    struct io_uring_sqe *sqe = shard.ring->getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = admin_fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = ringData(RING_ADMIN, admin_fd);
+}
+
+// Link polls are left alone by quiesceRing: links are not handed over, and
+// a poll consumes nothing the successor would miss.
+void Server::armLinkAccept(Shard &shard)
+{
+    struct io_uring_sqe *sqe = shard.ring->getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = link_listen_fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = ringData(RING_LINK_ACCEPT, link_listen_fd);
+}
+
+void Server::armLinkInput(Shard &shard, Link *link)
+{
+    struct io_uring_sqe *sqe = shard.ring->getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = link->fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = ringData(RING_LINK, link->id);
+    link->pollArmed = true;
+}
+
+void Server::armLinkOutput(Shard &shard, Link *link)
+{
+    struct io_uring_sqe *sqe = shard.ring->getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = link->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = ringData(RING_LINK_OUT, link->id);
+}
+
+void Server::cancelLinkPolls(Shard &shard, Link *link)
+{
+    if (link->pollArmed)
+        cancelRingOp(shard, ringData(RING_LINK, link->id));
+    if (link->connecting || link->waitingOut)
+        cancelRingOp(shard, ringData(RING_LINK_OUT, link->id));
+}
+
+void Server::armRetryTimer(Shard &shard)
+{
+    struct io_uring_sqe *sqe = shard.ring->getSqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uintptr_t>(&shard.retry_timeout);
+    sqe->len = 1;
+    sqe->user_data = ringData(RING_TIMEOUT, 0);
+    shard.timer_armed = true;
+}
+
+// Keeps one timeout pending for the timer wheel's next tick. A deadline
+// earlier than the pending one replaces it.
+void Server::armWheelTimer(Shard &shard)
+{
+    uint32_t tick;
+    if (!shard.timers.nextTick(tick))
+        return;
+    if (shard.wheel_armed && static_cast<int32_t>(tick - shard.wheel_tick) >= 0)
+        return;
+    struct io_uring_sqe *sqe;
+    if (shard.wheel_armed)
+    {
+        sqe = shard.ring->getSqe();
+        sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = ringData(RING_WHEEL, shard.wheel_tick);
+        sqe->user_data = ringData(RING_CANCEL, 0);
+    }
+    int wait = TimerWheel::msUntil(tick);
+    shard.wheel_timeout.tv_sec = wait / 1000;
+    shard.wheel_timeout.tv_nsec = (wait % 1000) * 1000000LL;
+    sqe = shard.ring->getSqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uintptr_t>(&shard.wheel_timeout);
+    sqe->len = 1;
+    sqe->user_data = ringData(RING_WHEEL, tick);
+    shard.wheel_armed = true;
+    shard.wheel_tick = tick;
+}
+
+void Server::handleCompletion(Shard &shard, const struct io_uring_cqe &cqe)
+{
+    RingOp op = static_cast<RingOp>(cqe.user_data >> 32);
+    int fd = static_cast<int>(cqe.user_data & 0xffffffffu);
+
+    switch (op)
+    {
+        case RING_ACCEPT:
+            handleRingAccept(shard, cqe);
+            break;
+        case RING_RECV:
+            handleRingRecv(shard, fd, cqe);
+            break;
+        case RING_SEND:
+            handleRingSend(shard, fd, cqe);
+            break;
+        case RING_WAKE:
+            drainMailboxes(shard);
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+                armWake(shard);
+            break;
+        case RING_TIMEOUT:
+            shard.timer_armed = false;
+            break;
+        case RING_ADMIN:
+            serveAdmin();
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+                armAdmin(shard);
+            break;
+        case RING_CANCEL:
+            break;
+        case RING_WHEEL:
+            // a replaced timeout completes as cancelled, with its own tick
+            if (static_cast<uint32_t>(fd) == shard.wheel_tick)
+                shard.wheel_armed = false;
+            break;
+        case RING_LINK_ACCEPT:
+            acceptLinks(shard);
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+                armLinkAccept(shard);
+            break;
+        case RING_LINK:
+        case RING_LINK_OUT:
+            handleRingLink(shard, static_cast<uint32_t>(fd), cqe);
+            break;
+    }
+}
+
+// A poll of a link fired. Links are found by id, which is new for every
+// connection, so a completion of a link dropped since finds none.
+void Server::handleRingLink(Shard &shard, uint32_t id, const struct io_uring_cqe &cqe)
+{
+    Link *link = findLink(id);
+    if (!link || link->fd == -1)
+        return;
+    if (static_cast<RingOp>(cqe.user_data >> 32) == RING_LINK_OUT)
+    {
+        linkWritable(shard, link);
+        return;
+    }
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+        link->pollArmed = false;
+    // reading may end with the link freed
+    readLink(shard, link);
+    link = findLink(id);
+    if (link && link->fd != -1 && !link->pollArmed)
+        armLinkInput(shard, link);
+}
+
+void Server::handleRingAccept(Shard &shard, const struct io_uring_cqe &cqe)
+{
+    if (cqe.res >= 0)
+    {
+        Client *client = addClient(shard, cqe.res);
+        if (client && !shard.quiescing)
+            armRecv(shard, client);
+    }
+    else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECANCELED)
+        LOG_ERROR(RED_COLOR << "Accept failed" << RESET_COLOR);
+
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+    {
+        shard.accept_armed = false;
+        if (!shard.quiescing)
+            armAccept(shard);
+    }
+}
+
+// Copies the provided buffer into the client's line buffer, in pieces when
+// a partial line leaves less room than the buffer holds, and returns the
+// buffer to the kernel.
+void Server::handleRingRecv(Shard &shard, int fd, const struct io_uring_cqe &cqe)
+{
+    Client *client = ringClient(shard, fd);
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    bool live = client && localClient(shard, fd) == client && !client->isClosing();
+
+    if (cqe.flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned short id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (live && cqe.res > 0)
+        {
+            const char *data = shard.ring->buffer(id);
+            size_t left = cqe.res;
+            if (config.metrics)
+                shard.metrics.count(Metrics::BYTES_IN, cqe.res);
+            LineBuffer &input = client->getInputBuffer();
+            int &budget = client->lineBudget(shard.tick, config.lineBudget);
+            while (left > 0 && !client->isClosing() && !client->isThrottled())
+            {
+                size_t chunk = std::min(left, input.writable());
+                std::memcpy(input.writePtr(), data, chunk);
+                input.commit(chunk);
+                if (!processInput(client, budget))
+                    throttleClient(shard, client);
+                data += chunk;
+                left -= chunk;
+            }
+            // the rest waits for the client's next turn, see resumeInput
+            if (left > 0 && client->isThrottled() && !client->isClosing())
+            {
+                client->appendBacklog(data, left);
+                if (checkRecvq(shard, client) && more)
+                    pauseRecv(shard, client);
+            }
+            input.release();
+            account(shard, client);
+        }
+        shard.ring->recycleBuffer(id);
+    }
+
+    if (!client)
+        return;
+    if (!more)
+        endRingOp(shard, client);
+    if (live && cqe.res <= 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+    {
+        removeClient(client);
+        live = false;
+    }
+    // A terminated multishot receive (e.g. out of buffers) is re-armed,
+    // unless pauseRecv ended it: then resumeRecv does.
+    if (live && !more && !client->isClosing())
+    {
+        InputBacklog *backlog = client->getBacklog();
+        if (backlog && backlog->recvCancelled)
+            backlog->recvStopped = true;
+        else if (!shard.quiescing)
+            armRecv(shard, client);
+    }
+}
+
+// The ring cannot leave input in the socket the way readBacklog does, so
+// the receive of a client whose backlog reached max-recvq is cancelled
+// instead; the kernel then holds the rest back.
+void Server::pauseRecv(Shard &shard, Client *client)
+{
+    InputBacklog *backlog = client->getBacklog();
+    if (backlog->recvCancelled || client->getBacklogSize() < static_cast<size_t>(config.maxRecvq))
+        return;
+    struct io_uring_sqe *sqe = shard.ring->getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = ringData(RING_RECV, client->getFd());
+    sqe->user_data = ringData(RING_CANCEL, client->getFd());
+    backlog->recvCancelled = true;
+}
+
+// Re-arms a receive cancelled by pauseRecv once half of the backlog has
+// been run. Returns false while the cancelled receive has not ended yet,
+// as the client must stay throttled until then.
+bool Server::resumeRecv(Shard &shard, Client *client)
+{
+    InputBacklog *backlog = client->getBacklog();
+    if (!backlog->recvCancelled)
+        return true;
+    if (!backlog->recvStopped)
+        return false;
+    if (client->getBacklogSize() * 2 >= static_cast<size_t>(config.maxRecvq))
+        return true;
+    backlog->recvCancelled = false;
+    backlog->recvStopped = false;
+    armRecv(shard, client);
+    return true;
+}
+
+void Server::handleRingSend(Shard &shard, int fd, const struct io_uring_cqe &cqe)
+{
+    std::map<int, SendOp *>::iterator op = shard.sends.find(fd);
+    if (op != shard.sends.end())
+    {
+        shard.free_sends.push_back(op->second);
+        shard.sends.erase(op);
+    }
+
+    Client *client = ringClient(shard, fd);
+    if (!client)
+        return;
+    bool live = localClient(shard, fd) == client && !client->isClosing();
+
+    if (cqe.res > 0)
+    {
+        client->consumeSent(cqe.res);
+        if (config.metrics)
+            shard.metrics.count(Metrics::BYTES_OUT, cqe.res);
+    }
+    endRingOp(shard, client);
+
+    if (!live)
+        return;
+    account(shard, client);
+    // a send cancelled for a handover leaves the client as it is
+    if (cqe.res < 0 && !shard.quiescing)
+        scheduleRemoval(client);
+    else if (client->hasPendingOutput())
+        submitSend(shard, client);
+    if (cqe.res >= 0)
+        listingDrained(shard, client);
+}
+
+// Prepares a SENDMSG for the head of the client's queue. Only one send is in
+// flight per client, which keeps the byte stream ordered.
+void Server::submitSend(Shard &shard, Client *client)
+{
+    int fd = client->getFd();
+    if (!client->hasPendingOutput() || shard.sends.count(fd) || shard.quiescing)
+        return;
+
+    SendOp *op;
+    if (shard.free_sends.empty())
+        op = new SendOp();
+    else
+    {
+        op = shard.free_sends.back();
+        shard.free_sends.pop_back();
+    }
+    if (config.metrics)
+    {
+        shard.metrics.sendQueued(client->getSendQueueSize());
+        shard.metrics.count(Metrics::SEND_CALLS);
+    }
+    std::memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = op->iov;
+    op->msg.msg_iovlen = client->buildIov(op->iov, SENDQ_IOV_MAX);
+    shard.sends[fd] = op;
+
+    // the rest of the queue follows once this send completes, see
+    // Client::flushSendQueue for MSG_MORE
+    int flags = MSG_NOSIGNAL;
+    if (op->msg.msg_iovlen < client->getPendingChunks())
+        flags |= MSG_MORE;
+
+    struct io_uring_sqe *sqe = shard.ring->getSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(&op->msg);
+    sqe->msg_flags = flags;
+    sqe->user_data = ringData(RING_SEND, fd);
+    client->setRingOps(client->getRingOps() + 1);
+}
+
+Client *Server::ringClient(Shard &shard, int fd)
+{
+    Client *client = localClient(shard, fd);
+    if (client)
+        return client;
+    std::map<int, Client *>::iterator it = shard.detached.find(fd);
+    if (it != shard.detached.end())
+        return it->second;
+    return NULL;
+}
+
+// Closes a removed client once the kernel no longer references it.
+void Server::endRingOp(Shard &shard, Client *client)
+{
+    client->setRingOps(client->getRingOps() - 1);
+    if (client->getRingOps() > 0)
+        return;
+    std::map<int, Client *>::iterator it = shard.detached.find(client->getFd());
+    if (it == shard.detached.end() || it->second != client)
+        return;
+    shard.detached.erase(it);
+    int fd = client->getFd();
+    clients.destroy(client);
+    close(fd);
+}
+
+void Server::cancelRingOp(Shard &shard, uint64_t target)
+{
+    struct io_uring_sqe *sqe = shard.ring->getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = ringData(RING_CANCEL, 0);
+}
+
+// Ends every accept, receive and send of the shard before a handover, so
+// the kernel neither consumes input nor writes output the serialized state
+// does not account for. Completions arriving meanwhile are handled as
+// usual, only nothing is re-armed or submitted.
+void Server::quiesceRing(Shard &shard)
+{
+    shard.quiescing = true;
+    if (shard.accept_armed)
+        cancelRingOp(shard, ringData(RING_ACCEPT, shard.listen_fd));
+    std::vector<int> busy;
+    for (size_t fd = 0; fd < clients.capacity(); ++fd)
+    {
+        Client *client = localClient(shard, fd);
+        if (!client || client->getRingOps() == 0)
+            continue;
+        cancelRingOp(shard, ringData(RING_RECV, fd));
+        cancelRingOp(shard, ringData(RING_SEND, fd));
+        busy.push_back(fd);
+    }
+
+    while (shard.accept_armed || !busy.empty())
+    {
+        if (shard.ring->submitAndWait(1) < 0 && errno != EINTR)
+        {
+            LOG_ERROR(RED_COLOR << "io_uring error: " << strerror(errno) << RESET_COLOR);
+            std::exit(EXIT_FAILURE);
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = shard.ring->peekCqe()) != NULL)
+        {
+            struct io_uring_cqe completion = *cqe;
+            shard.ring->seenCqe();
+            handleCompletion(shard, completion);
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < busy.size(); ++i)
+        {
+            Client *client = localClient(shard, busy[i]);
+            if (client && client->getRingOps() > 0)
+                busy[kept++] = busy[i];
+        }
+        busy.resize(kept);
+    }
+    reapClosingClients(shard);
+    finishBatch(shard);
+}
+
+// Resumes the operations quiesceRing ended, when a handover failed.
+void Server::rearmRing(Shard &shard)
+{
+    shard.quiescing = false;
+    if (shard.listen_fd != -1 && !shard.accept_armed)
+        armAccept(shard);
+    for (size_t fd = 0; fd < clients.capacity(); ++fd)
+    {
+        Client *client = localClient(shard, fd);
+        if (!client || client->isClosing())
+            continue;
+        InputBacklog *backlog = client->getBacklog();
+        if (client->getRingOps() == 0 && !(backlog && backlog->recvCancelled))
+            armRecv(shard, client);
+        submitSend(shard, client);
+    }
+}
+
+#else
+
+bool Server::initRing(Shard &shard)
+{
+    if (shard.index == 0)
+        LOG_WARN(RED_COLOR << "Built without io_uring support, using epoll" << RESET_COLOR);
+    return false;
+}
+
+void Server::runShardRing(Shard &shard)
+{
+    runShardEpoll(shard);
+}
+
+#endif
@@ -0,0 +1,185 @@
+#include "Server.hpp"
+
+// Channel persistence (--state-dir), see ChannelStore.hpp. What is kept of
+// a channel is what outlives its members: name, password, bans, and its
+// ops by nickname. A restored op is made op again on joining with the same
+// nickname; members themselves are not kept, their connections are gone.
+//
+// Snapshot body:
+//   u32 channels
+//   per channel: str name, str password, u32 ops [str nickname],
+//                u32 bans [str mask, u64 expiry]
+//
+// Every change is journaled by what it does, whichever command caused it:
+// KICK, for one, is a DEOP of its target if it was op and a BAN of its
+// nickname.
+
+void Server::journalChannel(ChannelRecord type, const std::string &channel, const std::string &target,
+                            uint64_t expires, const std::string &password)
+{
+    if (store.isOpen())
+        store.append(type, channel, target, expires, password);
+}
+
+// Runs on the store's writer thread. Holding the lock keeps the encoding
+// and the record number it names in step with each other.
+uint64_t Server::encodeSnapshot(void *context, StateWriter &state)
+{
+    Server *server = static_cast<Server *>(context);
+    server->lockState();
+    server->encodeChannels(state);
+    uint64_t sequence = server->store.sequence();
+    server->unlockState();
+    return sequence;
+}
+
+// Expired bans are left out.
+void Server::encodeChannels(StateWriter &state)
+{
+    time_t now = time(NULL);
+    std::vector<std::string> ops;
+    std::vector<std::pair<std::string, time_t> > bans;
+    state.u32(channels.size());
+    for (std::map<std::string, Channel *>::iterator it = channels.begin(); it != channels.end(); ++it)
+    {
+        Channel *channel = it->second;
+        state.str(channel->getName());
+        state.str(channel->getPassword());
+        ops.clear();
+        channel->opNicknames(ops);
+        state.u32(ops.size());
+        for (size_t i = 0; i < ops.size(); ++i)
+            state.str(ops[i]);
+        bans.clear();
+        channel->getBans().entries(bans);
+        size_t live = 0;
+        for (size_t i = 0; i < bans.size(); ++i)
+            if (bans[i].second == 0 || bans[i].second > now)
+                bans[live++] = bans[i];
+        state.u32(live);
+        for (size_t i = 0; i < live; ++i)
+        {
+            state.str(bans[i].first);
+            state.u64(static_cast<uint64_t>(bans[i].second));
+        }
+    }
+}
+
+// Channels are encoded in name order, so each one goes in at the end of
+// the map without a search.
+bool Server::decodeChannels(StateReader &state)
+{
+    uint32_t count = state.u32();
+    for (size_t i = 0; i < count && !state.failed(); ++i)
+    {
+        std::string name = state.str();
+        Channel *channel = new Channel(name, this);
+        channel->setPassword(state.str());
+        uint32_t ops = state.u32();
+        for (size_t op = 0; op < ops && !state.failed(); ++op)
+            channel->restoreOp(state.str());
+        uint32_t bans = state.u32();
+        for (size_t ban = 0; ban < bans && !state.failed(); ++ban)
+        {
+            std::string mask = state.str();
+            channel->ban(mask, static_cast<time_t>(state.u64()));
+        }
+        size_t before = channels.size();
+        channels.insert(channels.end(), std::make_pair(name, channel));
+        if (channels.size() == before)
+            delete channel;
+    }
+    return !state.failed() && state.remaining() == 0;
+}
+
+void Server::replayRecord(void *context, StateReader &record)
+{
+    static_cast<Server *>(context)->applyRecord(record);
+}
+
+// Records are applied to the channels as they were kept, so one naming a
+// channel that does not exist is skipped.
+void Server::applyRecord(StateReader &record)
+{
+    uint8_t type = record.u8();
+    std::string name = record.str();
+    std::string target = record.str();
+    time_t expires = static_cast<time_t>(record.u64());
+    std::string password = record.str();
+    if (record.failed())
+        return;
+
+    std::map<std::string, Channel *>::iterator it = channels.find(name);
+    if (type == RECORD_CREATE)
+    {
+        if (it != channels.end())
+            return;
+        Channel *channel = new Channel(name, this);
+        channel->setPassword(password);
+        // channels created by another server have no op here
+        if (!target.empty())
+            channel->restoreOp(target);
+        channels[name] = channel;
+        return;
+    }
+    if (it == channels.end())
+        return;
+    Channel *channel = it->second;
+    switch (type)
+    {
+        case RECORD_DELETE:
+            channels.erase(it);
+            delete channel;
+            break;
+        case RECORD_ADDOP:
+            channel->restoreOp(target);
+            break;
+        case RECORD_DEOP:
+            channel->forgetOp(target);
+            break;
+        case RECORD_BAN:
+            channel->ban(target, expires);
+            break;
+        case RECORD_UNBAN:
+            channel->unban(target);
+            break;
+        case RECORD_PASSWORD:
+            channel->setPassword(password);
+            break;
+    }
+}
+
+// Start-up without a predecessor: the snapshot, then the journal records
+// written after it. A snapshot that cannot be read stops the server rather
+// than let it overwrite the channels with an empty set.
+void Server::loadChannels()
+{
+    uint64_t started = Metrics::now();
+    const char *body;
+    size_t size;
+    uint64_t sequence;
+    if (!store.mapSnapshot(body, size, sequence))
+    {
+        LOG_ERROR(RED_COLOR << "Channel store: " << config.stateDir << "/" SNAPSHOT_FILE
+                  << " is unreadable or corrupt" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+    if (body)
+    {
+        StateReader state(body, size);
+        if (!decodeChannels(state))
+        {
+            LOG_ERROR(RED_COLOR << "Channel store: " << config.stateDir << "/" SNAPSHOT_FILE
+                      << " is truncated or corrupt" << RESET_COLOR);
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    store.releaseSnapshot();
+    size_t snapshot_channels = channels.size();
+    restored_records = store.replay(sequence, &Server::replayRecord, this);
+    restored_channels = channels.size();
+    restore_ns = Metrics::now() - started;
+    LOG_INFO(GREEN_COLOR << "Restored " << restored_channels << " channels (" << snapshot_channels
+             << " from the snapshot, " << restored_records << " journal records) in "
+             << restore_ns / 1000 << " us" << RESET_COLOR);
+}
@@ -0,0 +1,775 @@
+#include "Server.hpp"
+
+// Hot upgrade. On UPGRADE_SIGNAL the upgrade thread starts the binary found
+// on disk with the same arguments and a socket shared with it:
+//
+//   successor -> 'R'     once it is set up and waits for the state
+//   (every shard of this process parks between two loop iterations)
+//   header               magic, version, descriptor count, state size
+//   descriptors          the listeners, the admin socket, the link listener
+//                        and every client, HANDOVER_FD_BATCH per
+//                        SCM_RIGHTS message
+//   state                clients and channels, see encodeState
+//   successor -> 'A'     once it took everything over
+//
+// This process then exits without touching the sockets, which the
+// successor holds as well. If anything fails before the 'A', the successor
+// is killed and the shards carry on as if nothing happened.
+//
+// Server links are not handed over: they close with this process, and the
+// successor dials its links again while the other servers redial theirs.
+// Until then the network sees this server split off and rejoin.
+
+#define HANDOVER_READY 'R'
+#define HANDOVER_DONE 'A'
+
+// ListCursor kinds as encoded, 0 when no listing is in progress
+#define LISTING_NONE 0
+#define LISTING_CHANNELS 1
+#define LISTING_MEMBERS 2
+
+#define NO_INDEX 0xffffffffu
+
+// Client flags as encoded.
+#define STATE_AUTHENTICATED 0x01
+#define STATE_OPERATOR 0x02
+#define STATE_PING_SENT 0x04
+
+extern char **environ;
+
+static bool writeAll(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+static bool readAll(int fd, char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t received = read(fd, data, length);
+        if (received == -1 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return false;
+        data += received;
+        length -= received;
+    }
+    return true;
+}
+
+// Each batch rides on a single byte, so the receiver reading one byte at a
+// time never merges two batches' descriptors.
+static bool sendFds(int socket, const int *fds, size_t count)
+{
+    char byte = 0;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control[0];
+    msg.msg_controllen = control.size();
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    while (true)
+    {
+        ssize_t sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        return sent == 1;
+    }
+}
+
+// Appends the descriptors of one batch to `fds`.
+static bool receiveFds(int socket, std::vector<int> &fds)
+{
+    char byte;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    std::vector<char> control(CMSG_SPACE(HANDOVER_FD_BATCH * sizeof(int)));
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control[0];
+    msg.msg_controllen = control.size();
+    ssize_t received;
+    do
+        received = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+    while (received == -1 && errno == EINTR);
+    if (received != 1 || (msg.msg_flags & MSG_CTRUNC))
+        return false;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        size_t first = fds.size();
+        fds.resize(first + count);
+        std::memcpy(&fds[first], CMSG_DATA(cmsg), count * sizeof(int));
+    }
+    return true;
+}
+
+// Called before any thread starts, so that only the upgrade thread ever
+// receives the signal.
+void Server::blockUpgradeSignal()
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, UPGRADE_SIGNAL);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+void *Server::upgradeMain(void *arg)
+{
+    static_cast<Server *>(arg)->runUpgrades();
+    return NULL;
+}
+
+void Server::runUpgrades()
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, UPGRADE_SIGNAL);
+    while (true)
+    {
+        int signal;
+        if (sigwait(&signals, &signal) == 0)
+            upgrade();
+    }
+}
+
+void Server::upgrade()
+{
+    if (exe_path.empty())
+    {
+        LOG_ERROR(RED_COLOR << "Upgrade: the server binary could not be located" << RESET_COLOR);
+        return;
+    }
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        LOG_ERROR(RED_COLOR << "Upgrade: socketpair failed: " << strerror(errno) << RESET_COLOR);
+        return;
+    }
+    pid_t pid = spawnSuccessor(pair[1]);
+    close(pair[1]);
+    if (pid == -1)
+    {
+        LOG_ERROR(RED_COLOR << "Upgrade: fork failed: " << strerror(errno) << RESET_COLOR);
+        close(pair[0]);
+        return;
+    }
+    struct timeval timeout;
+    timeout.tv_sec = HANDOVER_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(pair[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(pair[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    LOG_INFO(GREEN_COLOR << "Upgrade: started " << exe_path << " as PID " << pid << RESET_COLOR);
+
+    // The shards only stop once the successor is ready, which keeps its
+    // start-up out of the pause.
+    char reply;
+    bool paused = false;
+    bool done = false;
+    size_t handed = 0;
+    uint64_t started = 0;
+    if (readAll(pair[0], &reply, 1) && reply == HANDOVER_READY)
+    {
+        started = Metrics::now();
+        pauseShards();
+        paused = true;
+        // the successor appends to the same journal
+        store.stop();
+        done = sendHandover(pair[0], handed) && readAll(pair[0], &reply, 1) && reply == HANDOVER_DONE;
+    }
+    if (done)
+    {
+        LOG_INFO(GREEN_COLOR << "Upgrade: handed " << handed << " clients over to PID " << pid << " in "
+                 << (Metrics::now() - started) / 1000 << " us" << RESET_COLOR);
+        Logger::stop();
+        _exit(EXIT_SUCCESS);
+    }
+
+    // the successor must be gone before the shards touch the sockets again
+    LOG_ERROR(RED_COLOR << "Upgrade: handover to PID " << pid << " failed, carrying on" << RESET_COLOR);
+    close(pair[0]);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    if (paused)
+    {
+        store.start(&Server::encodeSnapshot, this, config.snapshotInterval);
+        resumeShards();
+    }
+}
+
+// Starts the binary at exe_path, which a deployment has replaced by now,
+// with this process's arguments. The child inherits stdio and `socket`
+// only; everything is prepared before fork(), as a child forked from a
+// threaded process may do little more than exec.
+pid_t Server::spawnSuccessor(int socket)
+{
+    std::string cmdline;
+    int cmdline_fd = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+    if (cmdline_fd != -1)
+    {
+        char chunk[4096];
+        ssize_t length;
+        while ((length = read(cmdline_fd, chunk, sizeof(chunk))) > 0)
+            cmdline.append(chunk, length);
+        close(cmdline_fd);
+    }
+    std::vector<char *> argv;
+    for (size_t start = 0; start < cmdline.size(); start = cmdline.find('\0', start) + 1)
+        argv.push_back(&cmdline[start]);
+    argv.push_back(NULL);
+
+    std::ostringstream inherited;
+    inherited << HANDOVER_ENV << "=" << socket;
+    std::string variable = inherited.str();
+    std::vector<char *> envp;
+    for (char **entry = environ; *entry; ++entry)
+        if (std::strncmp(*entry, HANDOVER_ENV "=", sizeof(HANDOVER_ENV)) != 0)
+            envp.push_back(*entry);
+    envp.push_back(&variable[0]);
+    envp.push_back(NULL);
+    int limit = static_cast<int>(clients.capacity());
+
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+    closeInherited(socket, limit);
+    fcntl(socket, F_SETFD, 0);
+    execve(exe_path.c_str(), &argv[0], &envp[0]);
+    _exit(127);
+}
+
+// Closes every descriptor of a freshly forked child above stdio but
+// `socket`. close_range does it in two calls; kernels before 5.9 lack it,
+// and then each descriptor below `limit` is closed one by one. Runs between
+// fork() and exec, so it only makes system calls.
+void Server::closeInherited(int socket, int limit)
+{
+#ifdef SYS_close_range
+    if ((socket == 3 || syscall(SYS_close_range, 3, socket - 1, 0) == 0)
+        && syscall(SYS_close_range, socket + 1, ~0U, 0) == 0)
+        return;
+#endif
+    for (int fd = 3; fd < limit; ++fd)
+        if (fd != socket)
+            close(fd);
+}
+
+// Asks every shard to park and waits until all of them did.
+void Server::pauseShards()
+{
+    pthread_mutex_lock(&pause_lock);
+    __atomic_store_n(&pause_requested, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pause_lock);
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        uint64_t one = 1;
+        if (write(shards[i]->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            LOG_ERROR(RED_COLOR << "Shard wakeup failed: " << strerror(errno) << RESET_COLOR);
+    }
+    pthread_mutex_lock(&pause_lock);
+    while (parked < shards.size())
+        pthread_cond_wait(&pause_cond, &pause_lock);
+    pthread_mutex_unlock(&pause_lock);
+}
+
+void Server::resumeShards()
+{
+    pthread_mutex_lock(&pause_lock);
+    __atomic_store_n(&pause_requested, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pause_cond);
+    pthread_mutex_unlock(&pause_lock);
+}
+
+// Stops the shard between two loop iterations until the handover is over.
+// A shard that wakes up again writes out what was queued for its clients
+// in the meantime, see collectDeliveries.
+void Server::parkShard(Shard &shard)
+{
+#ifndef NO_IO_URING
+    if (shard.usesRing())
+        quiesceRing(shard);
+#endif
+    pthread_mutex_lock(&pause_lock);
+    ++parked;
+    pthread_cond_broadcast(&pause_cond);
+    while (pause_requested)
+        pthread_cond_wait(&pause_cond, &pause_lock);
+    --parked;
+    pthread_mutex_unlock(&pause_lock);
+#ifndef NO_IO_URING
+    if (shard.usesRing())
+        rearmRing(shard);
+#endif
+    finishBatch(shard);
+}
+
+// Queues what shards posted to each other and the recipients' owners did
+// not pick up yet, so it is part of the send queues handed over. Runs while
+// every shard is parked.
+void Server::collectDeliveries()
+{
+    std::vector<Delivery> deliveries;
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        Delivery delivery;
+        for (size_t source = 0; source < shards[i]->inbox.size(); ++source)
+            while (shards[i]->inbox[source]->pop(delivery))
+                deliveries.push_back(delivery);
+        for (size_t target = 0; target < shards[i]->overflow.size(); ++target)
+        {
+            std::deque<Delivery> &pending = shards[i]->overflow[target];
+            deliveries.insert(deliveries.end(), pending.begin(), pending.end());
+            pending.clear();
+        }
+    }
+    for (size_t i = 0; i < deliveries.size(); ++i)
+    {
+        Client *client = clients.get(deliveries[i].client);
+        if (client && !client->isClosing())
+        {
+            client->queueBuffer(deliveries[i].buffer);
+            if (!client->isDirty())
+            {
+                client->setIsDirty(true);
+                shards[client->getShard()]->dirty_fds.push_back(client->getFd());
+            }
+        }
+        deliveries[i].buffer->release();
+    }
+}
+
+// Lists the descriptors to pass in `fds` and encodes what the successor
+// needs to rebuild around them. Clients are referred to by their position
+// among the handed over clients, as descriptors change on the way:
+//
+//   u32 listeners, u8 admin socket, u8 link listener, u32 clients, then per client
+//     u32 shard, str nick user host server real, u8 flags,
+//     u32 tokens, tokens_at, seen_at, active_at,
+//     str input (line buffer and backlog), str output (unsent),
+//     u8 listing [str channel, u32 member], str active channel
+//   u32 channels, then per channel
+//     str name, password, u32 members [u32 client], u32 ops [u32 client],
+//     u32 bans [str mask, u64 expires], u32 saved ops [str nickname]
+//   u64 last channel store record
+//
+// Clients already closing are left behind and dropped with this process.
+// Returns the number of clients handed over.
+size_t Server::encodeState(StateWriter &state, std::vector<int> &fds)
+{
+    for (size_t i = 0; i < shards.size(); ++i)
+        if (shards[i]->listen_fd != -1)
+            fds.push_back(shards[i]->listen_fd);
+    state.u32(fds.size());
+    state.u8(admin_fd != -1);
+    if (admin_fd != -1)
+        fds.push_back(admin_fd);
+    state.u8(link_listen_fd != -1);
+    if (link_listen_fd != -1)
+        fds.push_back(link_listen_fd);
+
+    std::vector<Client *> handed;
+    std::vector<uint32_t> index(clients.capacity(), NO_INDEX);
+    for (size_t fd = 0; fd < clients.capacity(); ++fd)
+    {
+        Client *client = clients.find(fd);
+        if (!client || client->isClosing())
+            continue;
+        index[fd] = handed.size();
+        handed.push_back(client);
+        fds.push_back(fd);
+    }
+
+    state.u32(handed.size());
+    for (size_t i = 0; i < handed.size(); ++i)
+    {
+        Client *client = handed[i];
+        state.u32(client->getShard());
+        state.str(client->getNickname());
+        state.str(client->getUsername());
+        state.str(client->getHostname());
+        state.str(client->getServername());
+        state.str(client->getRealname());
+        state.u8((client->getIsAuthenticated() ? STATE_AUTHENTICATED : 0)
+                 | (client->getIsOperator() ? STATE_OPERATOR : 0)
+                 | (client->isPingSent() ? STATE_PING_SENT : 0));
+        state.u32(static_cast<uint32_t>(client->getTokens()));
+        state.u32(client->getTokensAt());
+        state.u32(client->getSeenAt());
+        state.u32(client->getActiveAt());
+
+        LineBuffer &buffer = client->getInputBuffer();
+        std::string input(buffer.size() ? buffer.data() : "", buffer.size());
+        InputBacklog *backlog = client->getBacklog();
+        if (backlog)
+            input.append(backlog->data, backlog->head, std::string::npos);
+        state.str(input);
+        std::string output;
+        client->appendUnsent(output);
+        state.str(output);
+
+        ListCursor *cursor = client->getListing();
+        if (!cursor)
+            state.u8(LISTING_NONE);
+        else
+        {
+            state.u8(cursor->kind == ListCursor::LIST_CHANNELS ? LISTING_CHANNELS : LISTING_MEMBERS);
+            state.str(cursor->channel);
+            Client *member = clients.get(cursor->member);
+            state.u32(member ? index[member->getFd()] : NO_INDEX);
+        }
+        Channel *active = client->getActiveChannel();
+        state.str(active ? active->getName() : std::string());
+    }
+
+    state.u32(channels.size());
+    for (std::map<std::string, Channel *>::iterator it = channels.begin(); it != channels.end(); ++it)
+    {
+        Channel *channel = it->second;
+        state.str(channel->getName());
+        state.str(channel->getPassword());
+        std::vector<uint32_t> members;
+        std::vector<uint32_t> ops;
+        const std::set<ClientHandle> &handles = channel->getMembers();
+        for (std::set<ClientHandle>::const_iterator member = handles.begin(); member != handles.end(); ++member)
+        {
+            Client *client = clients.get(*member);
+            if (!client || index[client->getFd()] == NO_INDEX)
+                continue;
+            members.push_back(index[client->getFd()]);
+            if (channel->isOp(client))
+                ops.push_back(index[client->getFd()]);
+        }
+        state.u32(members.size());
+        for (size_t i = 0; i < members.size(); ++i)
+            state.u32(members[i]);
+        state.u32(ops.size());
+        for (size_t i = 0; i < ops.size(); ++i)
+            state.u32(ops[i]);
+        std::vector<std::pair<std::string, time_t> > bans;
+        channel->getBans().entries(bans);
+        state.u32(bans.size());
+        for (size_t i = 0; i < bans.size(); ++i)
+        {
+            state.str(bans[i].first);
+            state.u64(static_cast<uint64_t>(bans[i].second));
+        }
+        const std::set<std::string> &saved = channel->getSavedOps();
+        state.u32(saved.size());
+        for (std::set<std::string>::const_iterator op = saved.begin(); op != saved.end(); ++op)
+            state.str(*op);
+    }
+    state.u64(store.sequence());
+    return handed.size();
+}
+
+// Runs on the upgrade thread with every shard parked. `handed` is set to
+// the number of clients passed on.
+bool Server::sendHandover(int socket, size_t &handed)
+{
+    StateWriter state;
+    std::vector<int> fds;
+    lockState();
+    collectDeliveries();
+    handed = encodeState(state, fds);
+    unlockState();
+
+    StateWriter header;
+    header.u32(HANDOVER_MAGIC);
+    header.u32(HANDOVER_VERSION);
+    header.u32(fds.size());
+    header.u64(state.data().size());
+    if (!writeAll(socket, header.data().data(), header.data().size()))
+        return false;
+    for (size_t sent = 0; sent < fds.size(); sent += HANDOVER_FD_BATCH)
+        if (!sendFds(socket, &fds[sent], std::min(fds.size() - sent, static_cast<size_t>(HANDOVER_FD_BATCH))))
+            return false;
+    if (!writeAll(socket, state.data().data(), state.data().size()))
+        return false;
+    return true;
+}
+
+// The successor's side, called from initServer once the shards are set up
+// and before any thread runs.
+bool Server::receiveHandover(int socket)
+{
+    struct timeval timeout;
+    timeout.tv_sec = HANDOVER_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char reply = HANDOVER_READY;
+    if (!writeAll(socket, &reply, 1))
+        return false;
+    uint64_t started = Metrics::now();
+
+    char raw[4 + 4 + 4 + 8];
+    if (!readAll(socket, raw, sizeof(raw)))
+        return false;
+    StateReader header(raw, sizeof(raw));
+    uint32_t magic = header.u32();
+    uint32_t version = header.u32();
+    uint32_t count = header.u32();
+    uint64_t size = header.u64();
+    if (magic != HANDOVER_MAGIC || version != HANDOVER_VERSION)
+    {
+        LOG_ERROR(RED_COLOR << "Handover: unknown state format " << version << RESET_COLOR);
+        return false;
+    }
+
+    std::vector<int> fds;
+    fds.reserve(count);
+    while (fds.size() < count)
+        if (!receiveFds(socket, fds))
+            return false;
+    std::string data(size, '\0');
+    if (size && !readAll(socket, &data[0], size))
+        return false;
+
+    StateReader state(data.data(), data.size());
+    if (fds.size() != count || !restoreState(state, fds))
+        return false;
+    reply = HANDOVER_DONE;
+    if (!writeAll(socket, &reply, 1))
+        return false;
+    close(socket);
+
+    handover_ns = Metrics::now() - started;
+    LOG_INFO(GREEN_COLOR << "Took over " << handover_clients << " clients and " << handover_channels
+             << " channels in " << handover_ns / 1000 << " us" << RESET_COLOR);
+    return true;
+}
+
+// Rebuilds clients and channels around the descriptors received, in the
+// layout of encodeState. Shard i takes over listener i; with fewer shards
+// than before the remaining listeners are closed, with more the new shards
+// serve the clients they are given but accept none.
+bool Server::restoreState(StateReader &state, const std::vector<int> &fds)
+{
+    uint32_t listeners = state.u32();
+    bool admin = state.u8();
+    bool linking = state.u8();
+    uint32_t count = state.u32();
+    if (state.failed() || static_cast<uint64_t>(listeners) + admin + linking + count != fds.size())
+        return false;
+
+    for (size_t i = 0; i < listeners; ++i)
+    {
+        if (i < shards.size())
+            adoptListener(*shards[i], fds[i]);
+        else
+            close(fds[i]);
+    }
+    if (listeners < shards.size())
+        LOG_WARN(RED_COLOR << "Handover: " << shards.size() - listeners << " shards have no listener" << RESET_COLOR);
+    if (admin && !config.adminSocket.empty())
+    {
+        admin_fd = fds[listeners];
+        watchAdminSocket();
+    }
+    else if (admin)
+        close(fds[listeners]);
+    if (linking && config.linkPort)
+    {
+        link_listen_fd = fds[listeners + admin];
+        watchLinkListener();
+    }
+    else if (linking)
+        close(fds[listeners + admin]);
+
+    // channels and listings refer to clients restored later on
+    std::vector<Client *> restored(count, NULL);
+    std::vector<std::string> active(count);
+    std::vector<uint8_t> listing(count);
+    std::vector<std::string> listed(count);
+    std::vector<uint32_t> after(count);
+    for (size_t i = 0; i < count && !state.failed(); ++i)
+    {
+        restored[i] = restoreClient(state, fds[listeners + admin + linking + i]);
+        listing[i] = state.u8();
+        if (listing[i] != LISTING_NONE)
+        {
+            listed[i] = state.str();
+            after[i] = state.u32();
+        }
+        active[i] = state.str();
+    }
+
+    uint32_t channel_count = state.u32();
+    for (size_t i = 0; i < channel_count && !state.failed(); ++i)
+    {
+        std::string name = state.str();
+        Channel *channel = new Channel(name, this);
+        channel->setPassword(state.str());
+        uint32_t members = state.u32();
+        for (size_t m = 0; m < members && !state.failed(); ++m)
+        {
+            uint32_t member = state.u32();
+            if (member < count && restored[member])
+                channel->addMember(restored[member]);
+        }
+        uint32_t ops = state.u32();
+        for (size_t m = 0; m < ops && !state.failed(); ++m)
+        {
+            uint32_t op = state.u32();
+            if (op < count && restored[op])
+                channel->addOp(restored[op]);
+        }
+        uint32_t bans = state.u32();
+        for (size_t b = 0; b < bans && !state.failed(); ++b)
+        {
+            std::string mask = state.str();
+            channel->ban(mask, static_cast<time_t>(state.u64()));
+        }
+        uint32_t saved = state.u32();
+        for (size_t m = 0; m < saved && !state.failed(); ++m)
+            channel->restoreOp(state.str());
+        if (!channels.insert(std::make_pair(name, channel)).second)
+            delete channel;
+    }
+    store.setSequence(state.u64());
+    if (state.failed() || state.remaining() != 0)
+    {
+        LOG_ERROR(RED_COLOR << "Handover: the state is truncated or corrupt" << RESET_COLOR);
+        return false;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        Client *client = restored[i];
+        if (!client)
+            continue;
+        std::map<std::string, Channel *>::iterator it = channels.find(active[i]);
+        if (it != channels.end() && it->second->isMember(client))
+            client->setActiveChannel(it->second);
+        // A member list continues after the same member, but members are
+        // ordered by descriptor, which changed: some may be repeated or
+        // skipped.
+        if (listing[i] != LISTING_NONE)
+        {
+            ListCursor *cursor = client->startListing(listing[i] == LISTING_CHANNELS ? ListCursor::LIST_CHANNELS
+                                                                                     : ListCursor::LIST_MEMBERS, listed[i]);
+            if (after[i] < count && restored[after[i]])
+                cursor->member = restored[after[i]]->getHandle();
+            listingDrained(*shards[client->getShard()], client);
+        }
+        ++handover_clients;
+    }
+    handover_channels = channels.size();
+    for (size_t i = 0; i < shards.size(); ++i)
+        finishBatch(*shards[i]);
+    return true;
+}
+
+// Rebuilds one client around its new descriptor, up to its listing. Its
+// input runs as a backlog on the first loop iteration and its output is
+// flushed right away. Returns NULL, with the record read all the same,
+// when the descriptor does not fit the client slab.
+Client *Server::restoreClient(StateReader &state, int fd)
+{
+    uint32_t shard_index = state.u32();
+    std::string nickname = state.str();
+    std::string username = state.str();
+    std::string hostname = state.str();
+    std::string servername = state.str();
+    std::string realname = state.str();
+    uint8_t flags = state.u8();
+    int32_t tokens = static_cast<int32_t>(state.u32());
+    uint32_t tokens_at = state.u32();
+    uint32_t seen_at = state.u32();
+    uint32_t active_at = state.u32();
+    std::string input = state.str();
+    std::string output = state.str();
+    if (state.failed())
+    {
+        close(fd);
+        return NULL;
+    }
+    // the event loops need it non-blocking, however the predecessor
+    // accepted it
+    setNonBlocking(fd);
+
+    Shard &shard = *shards[shard_index % shards.size()];
+    Client *client = clients.create(fd, shard.index);
+    if (!client)
+    {
+        LOG_ERROR(RED_COLOR << "FD " << fd << " is beyond the client slab" << RESET_COLOR);
+        close(fd);
+        return NULL;
+    }
+    client->setNickname(nickname);
+    client->setUsername(username);
+    client->setHostname(hostname);
+    client->setServername(servername);
+    client->setRealname(realname);
+    client->setIsAuthenticated(flags & STATE_AUTHENTICATED);
+    client->setIsOperator(flags & STATE_OPERATOR);
+    if (!nickname.empty())
+        nicknames.insert(nickname, client);
+    // a predecessor without flood control never filled the bucket
+    if (config.floodRate)
+    {
+        if (tokens_at)
+            client->resetTokens(tokens, tokens_at);
+        else
+            client->resetTokens(config.floodBurst * FLOOD_TOKEN_UNIT, floodClock());
+    }
+    client->touch(seen_at);
+    client->setActiveAt(active_at);
+    client->setPingSent(flags & STATE_PING_SENT);
+
+    if (config.registrationTimeout && registrationOf(client) != REG_DONE)
+        shard.timers.arm(&client->getTimer(), shard.timer_now + timeoutTicks(config.registrationTimeout));
+    else if (client->isPingSent() && config.pingTimeout)
+        shard.timers.arm(&client->getTimer(), shard.timer_now + timeoutTicks(config.pingTimeout));
+    else
+        armTimer(shard, client);
+
+#ifndef NO_IO_URING
+    if (shard.usesRing())
+        armRecv(shard, client);
+#endif
+    if (!shard.usesRing() && !client->watch(shard.epoll_fd, readEvents()))
+    {
+        LOG_ERROR(RED_COLOR << "Epoll registration failed: FD " << fd << RESET_COLOR);
+        scheduleRemoval(client);
+    }
+    if (!input.empty())
+    {
+        throttleClient(shard, client);
+        client->appendBacklog(input.data(), input.size());
+        shard.throttle_wait = 0;
+    }
+    if (!output.empty())
+    {
+        client->queueMessage(output);
+        client->setIsDirty(true);
+        shard.dirty_fds.push_back(fd);
+    }
+    account(shard, client);
+    return client;
+}
@@ -0,0 +1,65 @@
+#include "Shard.hpp"
+#include <unistd.h>
+
+Shard::Shard(int index, int count, Server *server)
+    : index(index), listen_fd(-1), epoll_fd(-1), wake_fd(-1), thread(), server(server),
+      events(EPOLL_MAX_EVENTS), throttle_wait(-1), tick(1), timer_now(TimerWheel::clock()), client_memory(0), heavy_memory(0), inbox(count), overflow(count), wake_pending(count, 0), command_failed(false)
+#ifndef NO_IO_URING
+      , ring(NULL), timer_armed(false), wheel_armed(false), wheel_tick(0), accept_armed(false), quiescing(false)
+#endif
+{
+#ifndef NO_IO_URING
+    retry_timeout.tv_sec = 0;
+    retry_timeout.tv_nsec = 1000000;
+    wheel_timeout.tv_sec = 0;
+    wheel_timeout.tv_nsec = 0;
+#endif
+    for (int i = 0; i < count; ++i)
+        inbox[i] = new Mailbox();
+    pthread_mutex_init(&state_lock, NULL);
+}
+
+Shard::~Shard()
+{
+    for (size_t i = 0; i < inbox.size(); ++i)
+    {
+        Delivery delivery;
+        while (inbox[i]->pop(delivery))
+            delivery.buffer->release();
+        delete inbox[i];
+    }
+    for (size_t i = 0; i < overflow.size(); ++i)
+        for (std::deque<Delivery>::iterator it = overflow[i].begin(); it != overflow[i].end(); ++it)
+            it->buffer->release();
+#ifndef NO_IO_URING
+    for (std::map<int, SendOp*>::iterator it = sends.begin(); it != sends.end(); ++it)
+        delete it->second;
+    for (size_t i = 0; i < free_sends.size(); ++i)
+        delete free_sends[i];
+    delete ring;
+#endif
+    if (listen_fd != -1)
+        close(listen_fd);
+    if (epoll_fd != -1)
+        close(epoll_fd);
+    if (wake_fd != -1)
+        close(wake_fd);
+    pthread_mutex_destroy(&state_lock);
+}
+
+bool Shard::hasOverflow() const
+{
+    for (size_t i = 0; i < overflow.size(); ++i)
+        if (!overflow[i].empty())
+            return true;
+    return false;
+}
+
+bool Shard::usesRing() const
+{
+#ifndef NO_IO_URING
+    return ring != NULL;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "Client.hpp"
+#include "Mailbox.hpp"
+#include "IoUring.hpp"
+#include "Metrics.hpp"
+#include "TimerWheel.hpp"
+
+#define EPOLL_MAX_EVENTS 256
+
+class Server;
+
+// Storage for one in-flight IORING_OP_SENDMSG; it must outlive the request.
+struct SendOp {
+    struct msghdr   msg;
+    struct iovec    iov[SENDQ_IOV_MAX];
+};
+
+// One event-loop thread. A shard owns its listening socket (bound with
+// SO_REUSEPORT when there are several), its epoll instance and the I/O state
+// of the clients it accepted: their input buffers, send queues and epoll
+// registrations are only ever touched by this thread.
+struct Shard {
+    int                                 index;
+    int                                 listen_fd;
+    int                                 epoll_fd;
+    int                                 wake_fd;
+    pthread_t                           thread;
+    Server                              *server;
+    std::vector<struct epoll_event>     events;
+    std::vector<int>                    closing_fds;
+    std::vector<int>                    dirty_fds;
+    std::vector<int>                    resume_fds;
+    // clients with input held back, see Server::resumeInput
+    std::vector<ClientHandle>           throttled;
+    // milliseconds until one of them may run again, -1 when none waits
+    int                                 throttle_wait;
+    // event-loop iterations so far, each gives every client a line budget
+    uint32_t                            tick;
+    // the clients' deadlines, see Server::runTimers, and the wheel tick
+    // read when the loop last woke up
+    TimerWheel                          timers;
+    uint32_t                            timer_now;
+    std::vector<TimerNode*>             expired;
+    // bytes held by the shard's clients, read by any thread (see
+    // Server::account), the clients that grew past MEMORY_HEAVY_SIZE and
+    // the bytes those hold
+    uint64_t                            client_memory;
+    std::vector<ClientHandle>           heavy;
+    uint64_t                            heavy_memory;
+    std::vector<Mailbox*>               inbox;
+    std::vector<std::deque<Delivery> >  overflow;
+    std::vector<char>                   wake_pending;
+    Metrics                             metrics;
+    // set by Server::sendError while a command runs on this shard
+    bool                                command_failed;
+    // joins a message bound for another shard, see Server::sendPieces
+    std::string                         scratch;
+    // this shard's part of the state lock, see Server::lockShard
+    pthread_mutex_t                     state_lock;
+#ifndef NO_IO_URING
+    IoUring                             *ring;
+    std::map<int, SendOp*>              sends;
+    std::vector<SendOp*>                free_sends;
+    std::map<int, Client*>              detached;
+    struct __kernel_timespec            retry_timeout;
+    bool                                timer_armed;
+    // the IORING_OP_TIMEOUT waking the loop for the wheel's next tick
+    struct __kernel_timespec            wheel_timeout;
+    bool                                wheel_armed;
+    uint32_t                            wheel_tick;
+    // the multishot accept is pending; while quiescing for a handover no
+    // operation is re-armed or submitted, see Server::quiesceRing
+    bool                                accept_armed;
+    bool                                quiescing;
+#endif
+
+    Shard(int index, int count, Server *server);
+    ~Shard();
+
+    bool hasOverflow() const;
+    bool usesRing() const;
+
+    private:
+        Shard(const Shard &);
+        Shard &operator=(const Shard &);
+};
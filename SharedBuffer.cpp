@@ -0,0 +1,67 @@
+#include "SharedBuffer.hpp"
+
+// A buffer goes back to the pool of the thread that drops the last
+// reference, which need not be the one that created it.
+static __thread SharedBuffer *pool = NULL;
+static __thread size_t pooled = 0;
+
+SharedBuffer::SharedBuffer(): _refs(1), _next(NULL) {}
+
+SharedBuffer::~SharedBuffer() {}
+
+SharedBuffer *SharedBuffer::create(const std::string &data) {
+    return create(data.data(), data.size());
+}
+
+SharedBuffer *SharedBuffer::create(const char *data, size_t length) {
+    SharedBuffer *buffer = pool;
+    if (buffer) {
+        pool = buffer->_next;
+        --pooled;
+        buffer->_refs = 1;
+        buffer->_next = NULL;
+    } else {
+        buffer = new SharedBuffer();
+    }
+    buffer->_data.assign(data, length);
+    return buffer;
+}
+
+// Broadcasts cross event-loop threads, so the count is updated atomically.
+void SharedBuffer::retain() {
+    __atomic_add_fetch(&_refs, 1, __ATOMIC_RELAXED);
+}
+
+void SharedBuffer::release() {
+    if (__atomic_sub_fetch(&_refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    if (pooled < SHARED_BUFFER_POOL_SIZE && _data.capacity() <= SHARED_BUFFER_POOL_BYTES) {
+        _data.clear();
+        _next = pool;
+        pool = this;
+        ++pooled;
+    } else {
+        delete this;
+    }
+}
+
+bool SharedBuffer::isUnique() const {
+    return __atomic_load_n(&_refs, __ATOMIC_ACQUIRE) == 1;
+}
+
+const char *SharedBuffer::data() const {
+    return _data.data();
+}
+
+size_t SharedBuffer::size() const {
+    return _data.size();
+}
+
+// Only valid while the caller holds the sole reference.
+void SharedBuffer::append(const std::string &data) {
+    _data += data;
+}
+
+void SharedBuffer::append(const char *data, size_t length) {
+    _data.append(data, length);
+}
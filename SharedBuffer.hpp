@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <stddef.h>
+
+// Released buffers up to this capacity are kept on a per-thread free list
+// and reused, so queueing a reply allocates nothing once it is warm.
+#define SHARED_BUFFER_POOL_SIZE 128
+#define SHARED_BUFFER_POOL_BYTES 2048
+
+// Immutable, reference-counted payload. A broadcast is encoded once into a
+// SharedBuffer and every recipient's send queue holds a reference to it
+// instead of its own copy.
+class SharedBuffer {
+    private:
+        std::string     _data;
+        int             _refs;
+        SharedBuffer    *_next;     // free list link
+
+        SharedBuffer();
+        ~SharedBuffer();
+        SharedBuffer(const SharedBuffer &);
+        SharedBuffer &operator=(const SharedBuffer &);
+
+    public:
+        static SharedBuffer *create(const std::string &data);
+        static SharedBuffer *create(const char *data, size_t length);
+
+        void retain();
+        void release();
+        bool isUnique() const;
+
+        const char *data() const;
+        size_t size() const;
+        void append(const std::string &data);
+        void append(const char *data, size_t length);
+};
@@ -0,0 +1,78 @@
+#include "StateCodec.hpp"
+#include <cstring>
+
+void StateWriter::u8(uint8_t value) {
+    _data += static_cast<char>(value);
+}
+
+void StateWriter::u32(uint32_t value) {
+    _data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void StateWriter::u64(uint64_t value) {
+    _data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+// Strings are prefixed with their length.
+void StateWriter::str(const std::string &value) {
+    str(value.data(), value.size());
+}
+
+void StateWriter::str(const char *data, size_t length) {
+    u32(static_cast<uint32_t>(length));
+    _data.append(data, length);
+}
+
+const std::string &StateWriter::data() const {
+    return _data;
+}
+
+StateReader::StateReader(const char *data, size_t size): _data(data), _size(size), _pos(0), _failed(false) {}
+
+bool StateReader::take(void *out, size_t length) {
+    if (_failed || _size - _pos < length) {
+        _failed = true;
+        std::memset(out, 0, length);
+        return false;
+    }
+    std::memcpy(out, _data + _pos, length);
+    _pos += length;
+    return true;
+}
+
+uint8_t StateReader::u8() {
+    uint8_t value;
+    take(&value, sizeof(value));
+    return value;
+}
+
+uint32_t StateReader::u32() {
+    uint32_t value;
+    take(&value, sizeof(value));
+    return value;
+}
+
+uint64_t StateReader::u64() {
+    uint64_t value;
+    take(&value, sizeof(value));
+    return value;
+}
+
+std::string StateReader::str() {
+    uint32_t length = u32();
+    if (_failed || _size - _pos < length) {
+        _failed = true;
+        return std::string();
+    }
+    std::string value(_data + _pos, length);
+    _pos += length;
+    return value;
+}
+
+bool StateReader::failed() const {
+    return _failed;
+}
+
+size_t StateReader::remaining() const {
+    return _size - _pos;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+// Flat binary encoding of server state: fields are written one after the
+// other and read back in the same order. Integers are kept in host byte
+// order, as the encoding only moves between processes on one machine.
+class StateWriter {
+    private:
+        std::string _data;
+
+    public:
+        void u8(uint8_t value);
+        void u32(uint32_t value);
+        void u64(uint64_t value);
+        void str(const std::string &value);
+        void str(const char *data, size_t length);
+
+        const std::string &data() const;
+};
+
+// Reads what a StateWriter wrote. A read past the end returns zeroes and
+// empty strings and marks the reader failed, so a truncated record is
+// caught once at the end instead of after every field.
+class StateReader {
+    private:
+        const char  *_data;
+        size_t      _size;
+        size_t      _pos;
+        bool        _failed;
+
+        bool take(void *out, size_t length);
+
+    public:
+        StateReader(const char *data, size_t size);
+
+        uint8_t u8();
+        uint32_t u32();
+        uint64_t u64();
+        std::string str();
+
+        bool failed() const;
+        size_t remaining() const;
+};
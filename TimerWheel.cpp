@@ -0,0 +1,163 @@
+#include "TimerWheel.hpp"
+#include <ctime>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+// deadlines beyond the wheel's span are parked at its far end
+#define TIMER_WHEEL_SPAN (1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+TimerWheel::TimerWheel(): _current(clock()), _count(0) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        _occupied[level] = 0;
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot) {
+            _slots[level][slot].prev = &_slots[level][slot];
+            _slots[level][slot].next = &_slots[level][slot];
+        }
+    }
+}
+
+// Files the node by how far its deadline is from the current tick.
+void TimerWheel::link(TimerNode *node) {
+    if (static_cast<int32_t>(node->expires - _current) < 0)
+        node->expires = _current;
+    uint32_t delta = node->expires - _current;
+    uint32_t expires = delta < TIMER_WHEEL_SPAN ? node->expires : _current + TIMER_WHEEL_SPAN - 1;
+
+    int level = 0;
+    while (level + 1 < TIMER_WHEEL_LEVELS && delta >= (1u << (TIMER_WHEEL_BITS * (level + 1))))
+        ++level;
+    unsigned slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+    TimerNode &head = _slots[level][slot];
+    node->prev = head.prev;
+    node->next = &head;
+    head.prev->next = node;
+    head.prev = node;
+    _occupied[level] |= 1ULL << slot;
+}
+
+// A node whose neighbours are one and the same was the last one of its
+// slot; that neighbour is the slot's head.
+void TimerWheel::unlink(TimerNode *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    if (node->prev == node->next) {
+        size_t index = node->prev - &_slots[0][0];
+        _occupied[index / TIMER_WHEEL_SLOTS] &= ~(1ULL << (index % TIMER_WHEEL_SLOTS));
+    }
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+// Refiles the timers of the level's current slot, which now fall into the
+// levels below.
+void TimerWheel::cascade(int level) {
+    unsigned slot = (_current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    if (!(_occupied[level] & (1ULL << slot)))
+        return;
+    TimerNode &head = _slots[level][slot];
+    TimerNode *node = head.next;
+    head.prev = &head;
+    head.next = &head;
+    _occupied[level] &= ~(1ULL << slot);
+    while (node != &head) {
+        TimerNode *next = node->next;
+        link(node);
+        node = next;
+    }
+}
+
+void TimerWheel::arm(TimerNode *node, uint32_t expires) {
+    if (node->armed())
+        unlink(node);
+    else
+        ++_count;
+    node->expires = expires;
+    link(node);
+}
+
+void TimerWheel::cancel(TimerNode *node) {
+    if (!node->armed())
+        return;
+    unlink(node);
+    --_count;
+}
+
+// Jumps straight from one tick with work to the next, so a long sleep costs
+// nothing for the ticks in between.
+void TimerWheel::advance(uint32_t now, std::vector<TimerNode*> &expired) {
+    uint32_t tick;
+    while (nextTick(tick) && static_cast<int32_t>(now - tick) >= 0) {
+        _current = tick;
+        unsigned index = _current & TIMER_WHEEL_MASK;
+        if (index == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+                cascade(level);
+                if ((_current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK)
+                    break;
+            }
+        }
+        TimerNode &head = _slots[0][index];
+        while (head.next != &head) {
+            TimerNode *node = head.next;
+            unlink(node);
+            --_count;
+            expired.push_back(node);
+        }
+        ++_current;
+    }
+    if (static_cast<int32_t>(now + 1 - _current) > 0)
+        _current = now + 1;
+}
+
+// In the first level, the slot `k` places after the current one expires
+// at tick _current + k. Above it, a slot cascades when the digits below its
+// own roll over to zero; the current digit's slot only does so right now
+// if those digits already are zero, otherwise a whole turn later.
+bool TimerWheel::nextTick(uint32_t &tick) const {
+    if (_count == 0)
+        return false;
+    bool found = false;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        uint64_t bits = _occupied[level];
+        if (!bits)
+            continue;
+        unsigned shift = TIMER_WHEEL_BITS * level;
+        unsigned digit = (_current >> shift) & TIMER_WHEEL_MASK;
+        uint64_t rotated = digit ? (bits >> digit) | (bits << (TIMER_WHEEL_SLOTS - digit)) : bits;
+        uint32_t candidate;
+        if (level == 0)
+            candidate = _current + __builtin_ctzll(rotated);
+        else {
+            if (_current & ((1u << shift) - 1))
+                rotated &= ~1ULL;
+            unsigned offset = rotated ? __builtin_ctzll(rotated) : TIMER_WHEEL_SLOTS;
+            candidate = ((_current >> shift) + offset) << shift;
+        }
+        if (!found || static_cast<int32_t>(candidate - tick) < 0)
+            tick = candidate;
+        found = true;
+    }
+    return found;
+}
+
+size_t TimerWheel::size() const {
+    return _count;
+}
+
+static uint64_t monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint32_t TimerWheel::clock() {
+    return static_cast<uint32_t>(monotonicMs() / TIMER_TICK_MS);
+}
+
+int TimerWheel::msUntil(uint32_t tick) {
+    uint64_t ms = monotonicMs();
+    int32_t ticks = tick - static_cast<uint32_t>(ms / TIMER_TICK_MS);
+    if (ticks <= 0)
+        return 0;
+    return ticks * TIMER_TICK_MS - static_cast<int>(ms % TIMER_TICK_MS);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Four levels of 64 slots: level L holds the timers due within 64^(L+1)
+// ticks, so with TIMER_TICK_MS 16 the first level spans a second and the
+// last about three days. Later deadlines wait in the last level.
+#define TIMER_TICK_MS 16
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+// Intrusive list node of one timer. Ticks are 32-bit and compared by their
+// difference, so they may wrap.
+struct TimerNode {
+    TimerNode   *prev;
+    TimerNode   *next;
+    uint32_t    expires;
+    int         owner;      // the client's descriptor
+
+    TimerNode(): prev(NULL), next(NULL), expires(0), owner(-1) {}
+
+    bool armed() const {
+        return next != NULL;
+    }
+};
+
+// Hierarchical timing wheel. Arming and cancelling unlink or link one node;
+// a timer is moved down a level when time reaches its slot (a cascade), and
+// only the slots time passes are ever looked at. A bitmap of occupied slots
+// per level lets nextTick() find the nearest deadline without a scan.
+class TimerWheel {
+    private:
+        uint32_t    _current;       // next tick advance() processes
+        size_t      _count;
+        uint64_t    _occupied[TIMER_WHEEL_LEVELS];
+        TimerNode   _slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+        TimerWheel(const TimerWheel &);
+        TimerWheel &operator=(const TimerWheel &);
+
+        void link(TimerNode *node);
+        void unlink(TimerNode *node);
+        void cascade(int level);
+
+    public:
+        TimerWheel();
+
+        // (Re)arms the timer for `expires`; a tick already passed fires
+        // with the next advance().
+        void arm(TimerNode *node, uint32_t expires);
+        void cancel(TimerNode *node);
+
+        // Moves time up to `now`, unlinking every timer that expired into
+        // `expired`.
+        void advance(uint32_t now, std::vector<TimerNode*> &expired);
+
+        // The tick at which advance() next has work to do: the nearest
+        // expiry in the first level or the next cascade carrying timers.
+        // Returns false when no timer is armed.
+        bool nextTick(uint32_t &tick) const;
+
+        size_t size() const;
+
+        // the current tick of CLOCK_MONOTONIC
+        static uint32_t clock();
+        // milliseconds until `tick` begins, 0 once it has
+        static int msUntil(uint32_t tick);
+};
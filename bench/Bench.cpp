@@ -0,0 +1,215 @@
+#include "Bench.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+unsigned long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void raiseFdLimit()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+long readRss(int pid)
+{
+    std::ostringstream path;
+    path << "/proc/" << pid << "/status";
+    std::ifstream status(path.str().c_str());
+    std::string key;
+    while (status >> key)
+    {
+        if (key == "VmRSS:")
+        {
+            long kb;
+            status >> kb;
+            return kb * 1024;
+        }
+        status.ignore(4096, '\n');
+    }
+    return 0;
+}
+
+long readCpuTicks(int pid)
+{
+    std::ostringstream path;
+    path << "/proc/" << pid << "/stat";
+    std::ifstream stat(path.str().c_str());
+    std::string line;
+    if (!std::getline(stat, line))
+        return -1;
+    // the command name may contain spaces; fields resume after its ')'
+    std::istringstream fields(line.substr(line.rfind(')') + 2));
+    std::string field;
+    long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; ++i)
+    {
+        if (i == 14)
+            utime = std::atol(field.c_str());
+        else if (i == 15)
+            stime = std::atol(field.c_str());
+    }
+    return utime + stime;
+}
+
+long long readTcpOutSegs()
+{
+    std::ifstream snmp("/proc/net/snmp");
+    std::string names, values;
+    // "Tcp:" appears twice: a header line with the field names, then the values
+    while (std::getline(snmp, names))
+    {
+        if (names.compare(0, 4, "Tcp:") != 0 || !std::getline(snmp, values))
+            continue;
+        std::istringstream name(names), value(values);
+        std::string n, v;
+        while (name >> n && value >> v)
+            if (n == "OutSegs")
+                return std::atoll(v.c_str());
+    }
+    return -1;
+}
+
+long long readServerCounter(const std::string &socketPath, const std::string &name)
+{
+    struct sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+        return -1;
+    std::strcpy(address.sun_path, socketPath.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    std::string dump;
+    char buffer[65536];
+    ssize_t got;
+    while ((got = read(fd, buffer, sizeof(buffer))) > 0)
+        dump.append(buffer, got);
+    close(fd);
+
+    std::istringstream lines(dump);
+    std::string line;
+    std::string wanted = name + " ";
+    while (std::getline(lines, line))
+        if (line.compare(0, wanted.size(), wanted) == 0)
+            return std::atoll(line.c_str() + wanted.size());
+    return -1;
+}
+
+static int openConnection(int port, int index)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+
+    struct sockaddr_in source;
+    std::memset(&source, 0, sizeof(source));
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + index / CONNECTIONS_PER_SOURCE);
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&source), sizeof(source)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in server;
+    std::memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&server), sizeof(server)) == -1 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connectClients(int port, int count, std::vector<int> &fds)
+{
+    int connect_fd = epoll_create1(EPOLL_CLOEXEC);
+    size_t first = fds.size();
+    int pending = 0;
+    int failed = 0;
+    struct epoll_event events[256];
+    while (static_cast<int>(fds.size() - first) + failed < count || pending > 0)
+    {
+        while (pending < CONNECT_WINDOW && static_cast<int>(fds.size() - first) + failed + pending < count)
+        {
+            int fd = openConnection(port, fds.size() + failed + pending);
+            if (fd == -1)
+            {
+                ++failed;
+                continue;
+            }
+            struct epoll_event ev;
+            ev.events = EPOLLOUT;
+            ev.data.fd = fd;
+            epoll_ctl(connect_fd, EPOLL_CTL_ADD, fd, &ev);
+            ++pending;
+        }
+        int n = epoll_wait(connect_fd, events, 256, 1000);
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            --pending;
+            epoll_ctl(connect_fd, EPOLL_CTL_DEL, fd, NULL);
+            if (error)
+            {
+                close(fd);
+                ++failed;
+                continue;
+            }
+            fds.push_back(fd);
+        }
+        if (n == 0 && pending > 0)
+        {
+            failed += pending;
+            break;
+        }
+    }
+    close(connect_fd);
+    return failed;
+}
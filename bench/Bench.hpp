@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Helpers shared by the load generators in this directory.
+
+#define CONNECTIONS_PER_SOURCE 4000
+#define CONNECT_WINDOW 512
+
+// Wall-clock seconds.
+double now();
+
+// Monotonic nanoseconds, comparable across the clients of one process.
+unsigned long long nowNs();
+
+void raiseFdLimit();
+
+// VmRSS of a process in bytes, 0 when it can't be read.
+long readRss(int pid);
+
+// utime + stime of a process in clock ticks, -1 when it can't be read.
+long readCpuTicks(int pid);
+
+// Segments sent by the host's TCP stack so far (OutSegs in /proc/net/snmp),
+// -1 when it can't be read. On loopback this counts both directions.
+long long readTcpOutSegs();
+
+// One counter from the server's --admin-socket dump, -1 when unavailable.
+long long readServerCounter(const std::string &socketPath, const std::string &name);
+
+// Opens `count` non-blocking loopback connections to `port` and appends the
+// established ones to `fds`. Returns how many failed.
+//
+// One source address reaches a listener through at most ~28k ephemeral
+// ports, and connect() slows down as that range fills up, so connections are
+// spread over 127.0.0.1, 127.0.0.2, ... (all of 127/8 is loopback on Linux).
+// At most CONNECT_WINDOW handshakes are in flight so the listen backlog is
+// never overrun and no SYN has to be retransmitted.
+int connectClients(int port, int count, std::vector<int> &fds);
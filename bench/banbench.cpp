@@ -0,0 +1,152 @@
+// JOIN-time ban check cost as the ban list grows. For each list size the
+// same bans are loaded into
+//   - vector: the old std::vector<std::string> of nicknames with std::find
+//   - banlist: BanList without the Bloom filter
+//   - banlist+bloom: BanList with the Bloom filter
+// and the average time per check is reported for joiners that are not
+// banned (miss) and joiners hit by an exact ban (hit).
+//
+// 80% of the bans are plain nicknames (what KICK adds), 10% masks with a
+// literal host, 10% masks with a literal nick. Eight fully wildcarded masks
+// are present at every size: those are scanned on every check.
+//
+//   ./banbench [iterations]
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include "../BanList.hpp"
+
+#define QUERY_COUNT 1024
+
+static double nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static std::string numbered(const char *prefix, size_t i)
+{
+    std::ostringstream out;
+    out << prefix << i;
+    return out.str();
+}
+
+struct Joiner {
+    std::string nick;
+    std::string user;
+    std::string host;
+};
+
+static const char *wildcards[] = {
+    "*!*@*.spam.example", "*bot*!*@*", "*!*proxy*@*", "guest?\?\?\?\?!*@*",
+    "*!~*@*.tor.example", "*!*@10.66.*", "troll*!*@*", "*!*@*.badisp.example"
+};
+
+static void loadBans(size_t count, BanList &list, std::vector<std::string> &legacy)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::string nick = numbered("banned", i);
+        if (i % 10 == 8)
+            list.add("*!*@" + numbered("host", i) + ".example.net");
+        else if (i % 10 == 9)
+            list.add(nick + "!*@*.isp.example");
+        else
+            list.add(nick);
+        legacy.push_back(nick);
+    }
+    for (size_t i = 0; i < sizeof(wildcards) / sizeof(*wildcards); ++i)
+        list.add(wildcards[i]);
+}
+
+template <typename Check>
+static double measure(const std::vector<Joiner> &joiners, size_t iterations, Check &check)
+{
+    size_t hits = 0;
+    double start = nowNs();
+    for (size_t i = 0; i < iterations; ++i)
+        hits += check(joiners[i % joiners.size()]);
+    double elapsed = nowNs() - start;
+    if (hits == static_cast<size_t>(-1))
+        std::cerr << hits;
+    return elapsed / iterations;
+}
+
+struct LegacyCheck {
+    const std::vector<std::string> &list;
+    explicit LegacyCheck(const std::vector<std::string> &list): list(list) {}
+    bool operator()(const Joiner &joiner) {
+        return std::find(list.begin(), list.end(), joiner.nick) != list.end();
+    }
+};
+
+struct BanListCheck {
+    BanList &list;
+    time_t now;
+    BanListCheck(BanList &list, time_t now): list(list), now(now) {}
+    bool operator()(const Joiner &joiner) {
+        return list.matches(joiner.nick, joiner.user, joiner.host, now);
+    }
+};
+
+int main(int argc, char **argv)
+{
+    size_t iterations = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 1000000;
+    size_t sizes[] = { 0, 10, 100, 1000, 10000, 100000 };
+    time_t now = time(NULL);
+
+    std::cout << "bans impl miss_ns hit_ns" << std::endl;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s)
+    {
+        size_t count = sizes[s];
+        BanList plain(false);
+        BanList bloom(true);
+        std::vector<std::string> legacy;
+        loadBans(count, plain, legacy);
+        legacy.clear();
+        loadBans(count, bloom, legacy);
+
+        std::vector<Joiner> misses(QUERY_COUNT), hits;
+        for (size_t i = 0; i < QUERY_COUNT; ++i)
+        {
+            misses[i].nick = numbered("user", i);
+            misses[i].user = numbered("ident", i);
+            misses[i].host = numbered("client", i) + ".example.org";
+        }
+        for (size_t i = 0; i < count && hits.size() < QUERY_COUNT; i += 10)
+        {
+            Joiner joiner;
+            joiner.nick = numbered("banned", i);
+            joiner.user = "ident";
+            joiner.host = "client.example.org";
+            hits.push_back(joiner);
+        }
+
+        // the linear scan gets fewer rounds so large lists finish in time
+        size_t legacyIterations = std::max<size_t>(1000, iterations / (1 + count / 100));
+        LegacyCheck legacyCheck(legacy);
+        BanListCheck plainCheck(plain, now);
+        BanListCheck bloomCheck(bloom, now);
+        struct {
+            const char *name;
+            double miss;
+            double hit;
+        } rows[3] = {
+            { "vector", measure(misses, legacyIterations, legacyCheck),
+              hits.empty() ? 0 : measure(hits, legacyIterations, legacyCheck) },
+            { "banlist", measure(misses, iterations, plainCheck),
+              hits.empty() ? 0 : measure(hits, iterations, plainCheck) },
+            { "banlist+bloom", measure(misses, iterations, bloomCheck),
+              hits.empty() ? 0 : measure(hits, iterations, bloomCheck) },
+        };
+        for (int r = 0; r < 3; ++r)
+            std::cout << count << " " << rows[r].name << " " << rows[r].miss << " " << rows[r].hit << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,225 @@
+// Connection-storm benchmark: opens N loopback connections to a running
+// ircserv, optionally registers them, then leaves them idle and reports
+//   - connect rate
+//   - server RSS growth per connection (needs --pid)
+//   - server CPU time spent while every connection sits idle (needs --pid)
+//   - with --upgrade, how long the server takes to hand every connection to
+//     a new process on SIGUSR2, and whether each one still answers a PING
+//     afterwards (needs --pid)
+//
+//   ./connstorm <port> <connections> [--pid=PID] [--password=PW] [--idle=SECONDS] [--upgrade]
+//
+// Connections come from many loopback source addresses (see Bench.hpp).
+// Each process needs RLIMIT_NOFILE above the connection count: 100k
+// connections need `ulimit -Hn` of at least ~100100 for both.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <map>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "Bench.hpp"
+
+#define QUIET_MS 500
+#define UPGRADE_TIMEOUT 30
+
+// Reads and discards whatever the server sends until it stays quiet for
+// QUIET_MS, so replies don't pile up in the server's send queues.
+static void drainUntilQuiet(int epoll_fd)
+{
+    struct epoll_event events[256];
+    char buffer[4096];
+    while (true)
+    {
+        int n = epoll_wait(epoll_fd, events, 256, QUIET_MS);
+        if (n <= 0)
+            return;
+        for (int i = 0; i < n; ++i)
+            while (recv(events[i].data.fd, buffer, sizeof(buffer), 0) > 0)
+                ;
+    }
+}
+
+// True once the process has exited. It stays a zombie until its parent
+// reaps it, which counts as exited.
+static bool processExited(int pid)
+{
+    char path[64];
+    std::snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *file = std::fopen(path, "r");
+    if (!file)
+        return true;
+    char state = 0;
+    int matched = std::fscanf(file, "%*d (%*[^)]) %c", &state);
+    std::fclose(file);
+    return matched != 1 || state == 'Z' || state == 'X';
+}
+
+struct PingResult
+{
+    size_t answered;
+    size_t dropped;
+    double max_latency;
+};
+
+// Sends one PING on every connection and waits up to `timeout` seconds for
+// a reply on each. Any reply counts: unregistered clients get an error,
+// which still shows the connection is served. A connection that is closed
+// before replying counts as dropped.
+static PingResult pingAll(int epoll_fd, const std::vector<int> &fds, double timeout)
+{
+    PingResult result = { 0, 0, 0 };
+    std::map<int, double> pending;
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        pending[fds[i]] = now();
+        if (send(fds[i], "PING storm\r\n", 12, MSG_NOSIGNAL) != 12)
+        {
+            pending.erase(fds[i]);
+            ++result.dropped;
+        }
+    }
+    double deadline = now() + timeout;
+    struct epoll_event events[256];
+    char buffer[4096];
+    while (!pending.empty() && now() < deadline)
+    {
+        int n = epoll_wait(epoll_fd, events, 256, 100);
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            ssize_t bytes;
+            while ((bytes = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+                ;
+            bool closed = bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            std::map<int, double>::iterator it = pending.find(fd);
+            if (it == pending.end())
+                continue;
+            if (closed)
+                ++result.dropped;
+            else
+            {
+                double latency = now() - it->second;
+                if (latency > result.max_latency)
+                    result.max_latency = latency;
+                ++result.answered;
+            }
+            pending.erase(it);
+        }
+    }
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: ./connstorm <port> <connections> [--pid=PID] [--password=PW] [--idle=SECONDS] [--upgrade]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    int port = std::atoi(argv[1]);
+    int count = std::atoi(argv[2]);
+    int pid = 0;
+    int idle = 5;
+    bool upgrade = false;
+    std::string password;
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string option = argv[i];
+        if (option.compare(0, 6, "--pid=") == 0)
+            pid = std::atoi(option.c_str() + 6);
+        else if (option.compare(0, 11, "--password=") == 0)
+            password = option.substr(11);
+        else if (option.compare(0, 7, "--idle=") == 0)
+            idle = std::atoi(option.c_str() + 7);
+        else if (option == "--upgrade")
+            upgrade = true;
+        else
+        {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (upgrade && !pid)
+    {
+        std::cerr << "--upgrade needs --pid" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    raiseFdLimit();
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    long rss_before = pid ? readRss(pid) : 0;
+
+    std::vector<int> fds;
+    fds.reserve(count);
+    double start = now();
+    int failed = connectClients(port, count, fds);
+    double connect_time = now() - start;
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fds[i];
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &ev);
+    }
+
+    if (!password.empty())
+    {
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            std::ostringstream login;
+            login << "PASS " << password << "\r\nNICK storm" << i << "\r\nUSER storm storm storm storm\r\n";
+            std::string line = login.str();
+            send(fds[i], line.data(), line.size(), MSG_NOSIGNAL);
+        }
+    }
+    drainUntilQuiet(epoll_fd);
+
+    long rss_after = pid ? readRss(pid) : 0;
+    long ticks_before = pid ? readCpuTicks(pid) : -1;
+    sleep(idle);
+    long ticks_after = pid ? readCpuTicks(pid) : -1;
+
+    std::cout << "connections " << fds.size() << std::endl;
+    std::cout << "failed " << failed << std::endl;
+    std::cout << "connect_seconds " << connect_time << std::endl;
+    std::cout << "connects_per_second " << static_cast<long>(fds.size() / (connect_time > 0 ? connect_time : 1)) << std::endl;
+    if (pid && !fds.empty())
+    {
+        std::cout << "server_rss_bytes " << rss_after << std::endl;
+        std::cout << "bytes_per_connection " << (rss_after - rss_before) / static_cast<long>(fds.size()) << std::endl;
+        std::cout << "idle_seconds " << idle << std::endl;
+        std::cout << "idle_cpu_ms " << (ticks_after - ticks_before) * 1000 / sysconf(_SC_CLK_TCK) << std::endl;
+    }
+
+    if (upgrade)
+    {
+        double signalled = now();
+        kill(pid, SIGUSR2);
+        while (!processExited(pid) && now() - signalled < UPGRADE_TIMEOUT)
+            usleep(1000);
+        if (!processExited(pid))
+            std::cout << "upgrade_seconds timeout" << std::endl;
+        else
+        {
+            std::cout << "upgrade_seconds " << now() - signalled << std::endl;
+            PingResult ping = pingAll(epoll_fd, fds, 10);
+            std::cout << "upgrade_answered " << ping.answered << std::endl;
+            std::cout << "upgrade_dropped " << ping.dropped << std::endl;
+            std::cout << "upgrade_unanswered " << fds.size() - ping.answered - ping.dropped << std::endl;
+            std::cout << "upgrade_max_ping_seconds " << ping.max_latency << std::endl;
+        }
+    }
+
+    for (size_t i = 0; i < fds.size(); ++i)
+        close(fds[i]);
+    close(epoll_fd);
+    return EXIT_SUCCESS;
+}
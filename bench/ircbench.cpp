@@ -0,0 +1,630 @@
+// End-to-end load generator for ircserv. Opens N loopback clients,
+// registers them with PASS/NICK/USER, groups them into channels with
+// CREATE/JOIN when the workload needs it, then drives one workload for a
+// fixed time:
+//   - privmsg:   client i sends PRIVMSG to client i+1
+//   - broadcast: every client talks in its channel of --channel-size members
+//
+// Each message carries the time it was sent, so the receiving client gets
+// the end-to-end delivery latency. A sender keeps at most --window messages
+// in flight, counting every copy a broadcast produces, so the latency
+// reflects the server and not a backlog growing in the socket buffers.
+// Messages sent during --warmup are delivered but not counted.
+// --flooders=N adds abusive neighbours: clients that pipeline PRIVMSGs to
+// themselves as fast as the server takes them, from the warmup on. They
+// are not measured; their disconnects (e.g. for excess flood) are
+// reported on their own.
+// --remote-port=PORT measures a network of linked servers: every other
+// client connects to the server on PORT instead, so each private message
+// and half of every broadcast crosses the link between the two. With
+// --admin-socket (of the server on <port>) the link traffic is reported
+// too, both directions, per second and per delivered message.
+//
+//   ./ircbench <port> <password> <clients> [--mode=privmsg|broadcast]
+//              [--channel-size=N] [--duration=SECONDS] [--warmup=SECONDS]
+//              [--window=N] [--payload=BYTES] [--pid=PID]
+//              [--admin-socket=PATH] [--flooders=N] [--remote-port=PORT]
+//
+// Output is one "key value" line per figure, so runs can be compared
+// against a baseline with join(1) or a diff. Latencies are in
+// microseconds; the server memory and CPU figures need --pid and the
+// server's sendmsg calls per delivered message need its --admin-socket.
+// tcp_segments_per_message counts every segment the host sent while
+// measuring, client traffic and ACKs included, so it is only meaningful
+// compared between runs on an otherwise idle machine.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "Bench.hpp"
+
+#define MARKER "bench "
+#define SETUP_TIMEOUT 10
+#define DRAIN_MS 500
+#define READ_SIZE 65536
+// a flooder's unsent output is topped up below this many bytes
+#define FLOOD_QUEUE 65536
+#define FLOOD_BATCH 256
+
+struct Options {
+    int         port;
+    std::string password;
+    int         clients;
+    std::string mode;
+    int         channelSize;
+    double      duration;
+    double      warmup;
+    int         window;
+    int         payload;
+    int         pid;
+    std::string adminSocket;
+    int         flooders;
+    int         remotePort;
+};
+
+struct BenchClient {
+    int                 fd;
+    std::string         input;
+    std::string         output;
+    bool                writing;
+    int                 peer;       // privmsg target
+    int                 copies;     // deliveries each message of this client produces
+    unsigned long long  sent;
+    unsigned long long  delivered;
+    bool                ready;
+};
+
+class Bench {
+    private:
+        Options                         _options;
+        std::vector<BenchClient>        _clients;
+        int                             _epoll;
+        std::string                     _padding;
+        // clients from _measured on are flooders
+        size_t                          _measured;
+
+        // setup progress: lines containing _expect seen so far
+        std::string                     _expect;
+        int                             _progress;
+
+        std::vector<int>                _ready;
+        unsigned long long              _measureStart;
+        unsigned long long              _measureEnd;
+        std::vector<unsigned long long> _latencies;
+        unsigned long long              _sent;
+        unsigned long long              _errors;
+        unsigned long long              _disconnects;
+        unsigned long long              _floodLines;
+        unsigned long long              _floodDisconnects;
+
+        void watch(BenchClient &client, bool writing);
+        void queue(int index, const std::string &data);
+        void flush(int index);
+        void readClient(int index);
+        void onLine(int index, const char *line, size_t length);
+        void onDelivery(const char *text, size_t length, unsigned long long received);
+        void refill();
+        void flood();
+        int pump(int timeout_ms);
+        bool waitFor(const char *phase, const std::string &expect, int count);
+
+    public:
+        explicit Bench(const Options &options);
+        ~Bench();
+
+        int run();
+};
+
+Bench::Bench(const Options &options)
+    : _options(options), _epoll(epoll_create1(EPOLL_CLOEXEC)), _padding(options.payload, 'x'), _measured(0),
+      _progress(0), _measureStart(0), _measureEnd(0), _sent(0), _errors(0), _disconnects(0), _floodLines(0),
+      _floodDisconnects(0)
+{
+}
+
+Bench::~Bench()
+{
+    for (size_t i = 0; i < _clients.size(); ++i)
+        if (_clients[i].fd != -1)
+            close(_clients[i].fd);
+    close(_epoll);
+}
+
+void Bench::watch(BenchClient &client, bool writing)
+{
+    struct epoll_event ev;
+    ev.events = writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.u32 = &client - &_clients[0];
+    epoll_ctl(_epoll, EPOLL_CTL_MOD, client.fd, &ev);
+    client.writing = writing;
+}
+
+void Bench::queue(int index, const std::string &data)
+{
+    BenchClient &client = _clients[index];
+    if (client.fd == -1)
+        return;
+    client.output += data;
+    if (!client.writing)
+        flush(index);
+}
+
+void Bench::flush(int index)
+{
+    BenchClient &client = _clients[index];
+    size_t written = 0;
+    while (written < client.output.size())
+    {
+        ssize_t n = send(client.fd, client.output.data() + written, client.output.size() - written, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        written += n;
+    }
+    client.output.erase(0, written);
+    bool pending = !client.output.empty();
+    if (pending != client.writing)
+        watch(client, pending);
+}
+
+void Bench::readClient(int index)
+{
+    BenchClient &client = _clients[index];
+    char buffer[READ_SIZE];
+    while (true)
+    {
+        ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+        if (n > 0)
+        {
+            client.input.append(buffer, n);
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            epoll_ctl(_epoll, EPOLL_CTL_DEL, client.fd, NULL);
+            close(client.fd);
+            client.fd = -1;
+            if (static_cast<size_t>(index) < _measured)
+                ++_disconnects;
+            else
+                ++_floodDisconnects;
+        }
+        break;
+    }
+
+    size_t start = 0;
+    size_t end;
+    while ((end = client.input.find('\n', start)) != std::string::npos)
+    {
+        size_t length = end - start;
+        if (length > 0 && client.input[end - 1] == '\r')
+            --length;
+        onLine(index, client.input.data() + start, length);
+        start = end + 1;
+    }
+    client.input.erase(0, start);
+}
+
+void Bench::onLine(int index, const char *line, size_t length)
+{
+    std::string text(line, length);
+    size_t marker = text.find(MARKER);
+    if (marker != std::string::npos)
+    {
+        onDelivery(line + marker + sizeof(MARKER) - 1, length - marker - sizeof(MARKER) + 1, nowNs());
+        return;
+    }
+    if (text.find("ERROR") != std::string::npos && static_cast<size_t>(index) < _measured)
+        ++_errors;
+    if (!_expect.empty() && text.find(_expect) != std::string::npos)
+        ++_progress;
+}
+
+// `text` is "<sender> <sent_ns> <padding>".
+void Bench::onDelivery(const char *text, size_t length, unsigned long long received)
+{
+    std::string fields(text, length);
+    char *end;
+    unsigned long sender = std::strtoul(fields.c_str(), &end, 10);
+    unsigned long long sentAt = std::strtoull(end, NULL, 10);
+    if (sender >= _clients.size())
+        return;
+
+    if (sentAt >= _measureStart && received < _measureEnd)
+        _latencies.push_back(received - sentAt);
+
+    BenchClient &client = _clients[sender];
+    ++client.delivered;
+    if (!client.ready)
+    {
+        client.ready = true;
+        _ready.push_back(sender);
+    }
+}
+
+// Lets every sender whose earlier messages arrived send up to its window.
+void Bench::refill()
+{
+    std::vector<int> ready;
+    ready.swap(_ready);
+    unsigned long long now = nowNs();
+    bool measuring = now >= _measureStart;
+    for (size_t i = 0; i < ready.size(); ++i)
+    {
+        BenchClient &client = _clients[ready[i]];
+        client.ready = false;
+        if (client.fd == -1 || client.copies == 0 || now >= _measureEnd)
+            continue;
+        unsigned long long limit = static_cast<unsigned long long>(_options.window) * client.copies;
+        std::string batch;
+        while (client.sent * client.copies - client.delivered < limit)
+        {
+            char header[96];
+            if (_options.mode == "privmsg")
+                snprintf(header, sizeof(header), "PRIVMSG u%d " MARKER "%d %llu ", client.peer, ready[i], now);
+            else
+                snprintf(header, sizeof(header), MARKER "%d %llu ", ready[i], now);
+            batch += header;
+            batch += _padding;
+            batch += "\r\n";
+            ++client.sent;
+            if (measuring)
+                ++_sent;
+        }
+        queue(ready[i], batch);
+    }
+}
+
+void Bench::flood()
+{
+    for (size_t i = _measured; i < _clients.size(); ++i)
+    {
+        BenchClient &client = _clients[i];
+        if (client.fd == -1 || client.output.size() >= FLOOD_QUEUE)
+            continue;
+        char line[64];
+        snprintf(line, sizeof(line), "PRIVMSG u%d :flood\r\n", static_cast<int>(i));
+        std::string batch;
+        for (int n = 0; n < FLOOD_BATCH; ++n)
+            batch += line;
+        queue(i, batch);
+        _floodLines += FLOOD_BATCH;
+    }
+}
+
+int Bench::pump(int timeout_ms)
+{
+    struct epoll_event events[256];
+    int n = epoll_wait(_epoll, events, 256, timeout_ms);
+    for (int i = 0; i < n; ++i)
+    {
+        int index = events[i].data.u32;
+        if (_clients[index].fd == -1)
+            continue;
+        if (events[i].events & EPOLLOUT)
+            flush(index);
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            readClient(index);
+    }
+    return n;
+}
+
+// Waits until `count` lines containing `expect` arrived, giving up after
+// SETUP_TIMEOUT seconds without progress.
+bool Bench::waitFor(const char *phase, const std::string &expect, int count)
+{
+    _expect = expect;
+    _progress = 0;
+    int last = 0;
+    double deadline = now() + SETUP_TIMEOUT;
+    while (_progress < count)
+    {
+        pump(100);
+        if (_progress != last)
+        {
+            last = _progress;
+            deadline = now() + SETUP_TIMEOUT;
+        }
+        else if (now() > deadline)
+        {
+            std::cerr << phase << " stalled: " << _progress << " of " << count << " replies" << std::endl;
+            return false;
+        }
+    }
+    _expect.clear();
+    return true;
+}
+
+// Traffic over the server's links in both directions: `what` is "bytes" or
+// "lines". -1 when the admin socket does not answer.
+static long long linkCounter(const std::string &socketPath, const char *what)
+{
+    long long in = readServerCounter(socketPath, std::string("ircserv_link_") + what + "_in_total");
+    long long out = readServerCounter(socketPath, std::string("ircserv_link_") + what + "_out_total");
+    return in == -1 || out == -1 ? -1 : in + out;
+}
+
+int Bench::run()
+{
+    const Options &o = _options;
+    long rss_before = o.pid ? readRss(o.pid) : 0;
+
+    std::vector<int> fds;
+    fds.reserve(o.clients);
+    double start = now();
+    int total = o.clients + o.flooders;
+    int failed;
+    if (o.remotePort)
+    {
+        // even clients on <port>, odd ones on the remote server
+        std::vector<int> local, remote;
+        failed = connectClients(o.port, (total + 1) / 2, local);
+        failed += connectClients(o.remotePort, total / 2, remote);
+        for (size_t i = 0; i < std::max(local.size(), remote.size()); ++i)
+        {
+            if (i < local.size())
+                fds.push_back(local[i]);
+            if (i < remote.size())
+                fds.push_back(remote[i]);
+        }
+    }
+    else
+        failed = connectClients(o.port, total, fds);
+    double connect_time = now() - start;
+
+    _clients.resize(fds.size());
+    _measured = fds.size() > static_cast<size_t>(o.flooders) ? fds.size() - o.flooders : 0;
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        BenchClient &client = _clients[i];
+        client.fd = fds[i];
+        client.writing = false;
+        client.peer = _measured ? (i + 1) % _measured : 0;
+        client.copies = i < _measured && _measured > 1 ? 1 : 0;
+        client.sent = 0;
+        client.delivered = 0;
+        client.ready = false;
+
+        // small messages must not wait for Nagle to send them
+        int one = 1;
+        setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, client.fd, &ev);
+    }
+    int count = _clients.size();
+
+    start = now();
+    for (int i = 0; i < count; ++i)
+    {
+        char login[128];
+        snprintf(login, sizeof(login), "PASS %s\r\nNICK u%d\r\nUSER u u u u\r\n", o.password.c_str(), i);
+        queue(i, login);
+    }
+    if (!waitFor("registration", " 001 ", count))
+        return EXIT_FAILURE;
+    double register_time = now() - start;
+
+    int measured = _measured;
+    if (o.mode == "broadcast")
+    {
+        // client i joins channel i / channel_size, whose first member creates it
+        int groups = (measured + o.channelSize - 1) / o.channelSize;
+        for (int g = 0; g < groups; ++g)
+        {
+            char create[64];
+            snprintf(create, sizeof(create), "CREATE #bench%d key\r\n", g);
+            queue(g * o.channelSize, create);
+        }
+        if (!waitFor("channel creation", "Channel created successfully", groups))
+            return EXIT_FAILURE;
+        // the channels must have reached the remote server before its clients join
+        if (o.remotePort)
+            while (pump(DRAIN_MS) > 0)
+                ;
+        for (int i = 0; i < measured; ++i)
+        {
+            int first = i / o.channelSize * o.channelSize;
+            _clients[i].copies = std::min(first + o.channelSize, measured) - first - 1;
+            if (i == first)
+                continue;
+            char join[64];
+            snprintf(join, sizeof(join), "JOIN #bench%d key\r\n", i / o.channelSize);
+            queue(i, join);
+        }
+        if (!waitFor("channel join", "You have joined the channel", measured - groups))
+            return EXIT_FAILURE;
+    }
+    // let join notices and other setup chatter settle
+    while (pump(DRAIN_MS) > 0)
+        ;
+    long rss_after = o.pid ? readRss(o.pid) : 0;
+
+    unsigned long long begin = nowNs();
+    _measureStart = begin + static_cast<unsigned long long>(o.warmup * 1e9);
+    _measureEnd = _measureStart + static_cast<unsigned long long>(o.duration * 1e9);
+    for (int i = 0; i < count; ++i)
+    {
+        _clients[i].ready = true;
+        _ready.push_back(i);
+    }
+    long ticks_start = -1;
+    long long segs_start = -1, calls_start = -1;
+    long long link_bytes_start = -1, link_lines_start = -1;
+    bool started = false;
+    unsigned long long t;
+    while ((t = nowNs()) < _measureEnd)
+    {
+        if (!started && t >= _measureStart)
+        {
+            started = true;
+            if (o.pid)
+                ticks_start = readCpuTicks(o.pid);
+            segs_start = readTcpOutSegs();
+            if (!o.adminSocket.empty())
+                calls_start = readServerCounter(o.adminSocket, "ircserv_send_calls_total");
+            if (o.remotePort && !o.adminSocket.empty())
+            {
+                link_bytes_start = linkCounter(o.adminSocket, "bytes");
+                link_lines_start = linkCounter(o.adminSocket, "lines");
+            }
+        }
+        refill();
+        flood();
+        pump(_ready.empty() ? 1 : 0);
+    }
+    long ticks_end = o.pid ? readCpuTicks(o.pid) : -1;
+    long long segs_end = readTcpOutSegs();
+    long long calls_end = o.adminSocket.empty() ? -1 : readServerCounter(o.adminSocket, "ircserv_send_calls_total");
+    long long link_bytes_end = link_bytes_start == -1 ? -1 : linkCounter(o.adminSocket, "bytes");
+    long long link_lines_end = link_lines_start == -1 ? -1 : linkCounter(o.adminSocket, "lines");
+    // deliveries still in flight are drained but no longer counted
+    while (pump(DRAIN_MS) > 0)
+        ;
+
+    std::sort(_latencies.begin(), _latencies.end());
+    size_t samples = _latencies.size();
+    double percentiles[] = { 0.50, 0.99, 0.999 };
+    const char *names[] = { "latency_p50_us", "latency_p99_us", "latency_p999_us" };
+
+    std::cout << "mode " << o.mode << std::endl;
+    if (o.remotePort)
+        std::cout << "remote_port " << o.remotePort << std::endl;
+    std::cout << "clients " << measured << std::endl;
+    if (o.flooders)
+        std::cout << "flooders " << count - measured << std::endl;
+    std::cout << "connect_failed " << failed << std::endl;
+    std::cout << "connect_seconds " << connect_time << std::endl;
+    std::cout << "connects_per_second " << static_cast<long>(count / (connect_time > 0 ? connect_time : 1)) << std::endl;
+    std::cout << "registrations_per_second " << static_cast<long>(count / (register_time > 0 ? register_time : 1)) << std::endl;
+    if (o.mode == "broadcast")
+        std::cout << "channel_size " << o.channelSize << std::endl;
+    std::cout << "window " << o.window << std::endl;
+    std::cout << "payload_bytes " << o.payload << std::endl;
+    std::cout << "duration_seconds " << o.duration << std::endl;
+    std::cout << "sent_per_second " << static_cast<long>(_sent / o.duration) << std::endl;
+    std::cout << "messages_per_second " << static_cast<long>(samples / o.duration) << std::endl;
+    for (int p = 0; p < 3; ++p)
+    {
+        double value = samples ? _latencies[std::min(samples - 1, static_cast<size_t>(percentiles[p] * samples))] / 1e3 : 0;
+        std::cout << names[p] << " " << value << std::endl;
+    }
+    std::cout << "latency_max_us " << (samples ? _latencies[samples - 1] / 1e3 : 0) << std::endl;
+    if (samples && segs_start != -1 && segs_end != -1)
+        std::cout << "tcp_segments_per_message " << static_cast<double>(segs_end - segs_start) / samples << std::endl;
+    if (samples && calls_start != -1 && calls_end != -1)
+        std::cout << "server_send_calls_per_message " << static_cast<double>(calls_end - calls_start) / samples << std::endl;
+    if (link_bytes_start != -1 && link_bytes_end != -1)
+    {
+        std::cout << "link_bytes_per_second " << static_cast<long>((link_bytes_end - link_bytes_start) / o.duration)
+                  << std::endl;
+        if (samples)
+            std::cout << "link_bytes_per_message " << static_cast<double>(link_bytes_end - link_bytes_start) / samples
+                      << std::endl;
+    }
+    if (samples && link_lines_start != -1 && link_lines_end != -1)
+        std::cout << "link_lines_per_message " << static_cast<double>(link_lines_end - link_lines_start) / samples
+                  << std::endl;
+    std::cout << "errors " << _errors << std::endl;
+    std::cout << "disconnects " << _disconnects << std::endl;
+    if (o.flooders)
+    {
+        std::cout << "flood_lines_per_second " << static_cast<long>(_floodLines / (o.warmup + o.duration)) << std::endl;
+        std::cout << "flooder_disconnects " << _floodDisconnects << std::endl;
+    }
+    if (o.pid && count > 0)
+    {
+        std::cout << "server_rss_bytes " << rss_after << std::endl;
+        std::cout << "bytes_per_connection " << (rss_after - rss_before) / count << std::endl;
+        if (ticks_start != -1)
+            std::cout << "server_cpu_percent "
+                      << (ticks_end - ticks_start) * 100.0 / sysconf(_SC_CLK_TCK) / o.duration << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
+
+static bool parseOption(const std::string &option, Options &o)
+{
+    size_t eq = option.find('=');
+    if (eq == std::string::npos)
+        return false;
+    std::string key = option.substr(0, eq);
+    const char *value = option.c_str() + eq + 1;
+    if (key == "--mode")
+        o.mode = value;
+    else if (key == "--channel-size")
+        o.channelSize = std::atoi(value);
+    else if (key == "--duration")
+        o.duration = std::atof(value);
+    else if (key == "--warmup")
+        o.warmup = std::atof(value);
+    else if (key == "--window")
+        o.window = std::atoi(value);
+    else if (key == "--payload")
+        o.payload = std::atoi(value);
+    else if (key == "--pid")
+        o.pid = std::atoi(value);
+    else if (key == "--admin-socket")
+        o.adminSocket = value;
+    else if (key == "--flooders")
+        o.flooders = std::atoi(value);
+    else if (key == "--remote-port")
+        o.remotePort = std::atoi(value);
+    else
+        return false;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        std::cerr << "Usage: ./ircbench <port> <password> <clients> [--mode=privmsg|broadcast] [--channel-size=N]"
+                  << " [--duration=SECONDS] [--warmup=SECONDS] [--window=N] [--payload=BYTES] [--pid=PID]"
+                  << " [--admin-socket=PATH] [--flooders=N] [--remote-port=PORT]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    Options o;
+    o.port = std::atoi(argv[1]);
+    o.password = argv[2];
+    o.clients = std::atoi(argv[3]);
+    o.mode = "privmsg";
+    o.channelSize = 10;
+    o.duration = 5;
+    o.warmup = 1;
+    o.window = 1;
+    o.payload = 32;
+    o.pid = 0;
+    o.flooders = 0;
+    o.remotePort = 0;
+    for (int i = 4; i < argc; ++i)
+    {
+        if (!parseOption(argv[i], o))
+        {
+            std::cerr << "Unknown option: " << argv[i] << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if ((o.mode != "privmsg" && o.mode != "broadcast") || o.clients < 2 || o.channelSize < 2
+        || o.duration <= 0 || o.warmup < 0 || o.window < 1 || o.payload < 0 || o.flooders < 0
+        || o.remotePort < 0)
+    {
+        std::cerr << "Invalid options" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    raiseFdLimit();
+    Bench bench(o);
+    return bench.run();
+}
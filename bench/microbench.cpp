@@ -0,0 +1,371 @@
+// In-process microbenchmarks for the command hot paths. A socketless Server
+// (see its two-argument constructor) holds synthetic clients that registered
+// and joined channels through the normal commands. Each path is then run in
+// a loop and its output is thrown away between batches, outside the timing:
+//   - parseMessage               splitting a line into command and params
+//   - Prefix                     rendering ":nick!user@host "
+//   - parseCommand PING          dispatch plus a one-line reply
+//   - handlePRIVMSG              lookup and delivery, params already parsed
+//   - parseCommand PRIVMSG       the whole path of a private message
+//   - broadcastMessage/N         one channel message to N members
+//   - TimerWheel/arm             moving one of TIMER_COUNT armed timers
+//   - TimerWheel/tick            one tick of keepalive deadlines spread
+//                                over two minutes, expired ones re-armed
+//   - snapshot/write/N           channel persistence: N channels encoded
+//                                and written to a snapshot, per channel
+//   - snapshot/restore/N         the snapshot mapped and decoded as at
+//                                start-up, per channel
+//
+// Allocations are counted by replacing the global operator new, so every
+// std::string, SharedBuffer and container growth shows up.
+//
+//   ./microbench [iterations]
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <new>
+#include <cstdlib>
+#include <ctime>
+#include "../Server.hpp"
+
+#define BATCH 64
+// synthetic clients get descriptors well above any the process has open
+#define FIRST_FD 1024
+#define CLIENT_COUNT 1000
+#define TIMER_COUNT 100000
+// two minutes of timer wheel ticks, the default PING interval
+#define TIMER_SPREAD (120 * 1000 / TIMER_TICK_MS)
+#define SNAPSHOT_CHANNELS 300000
+#define SNAPSHOT_BAN_EVERY 10
+
+static unsigned long long allocations = 0;
+
+void *operator new(std::size_t size) throw(std::bad_alloc)
+{
+    ++allocations;
+    void *p = std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](std::size_t size) throw(std::bad_alloc)
+{
+    return operator new(size);
+}
+
+// Kept out of line so GCC doesn't take the free() for a mismatched
+// new/delete pair.
+__attribute__((noinline)) static void release(void *p)
+{
+    std::free(p);
+}
+
+void operator delete(void *p) throw()
+{
+    release(p);
+}
+
+void operator delete[](void *p) throw()
+{
+    release(p);
+}
+
+static double nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static std::string numbered(const char *prefix, size_t i)
+{
+    std::ostringstream out;
+    out << prefix << i;
+    return out.str();
+}
+
+// A line parsed once, kept together with the text its slices point into.
+struct ParsedLine {
+    std::string text;
+    Message     message;
+
+    explicit ParsedLine(const std::string &line): text(line) {
+        parseMessage(Slice(text.data(), text.size()), message);
+    }
+};
+
+class MicroBench {
+    private:
+        Server  &_server;
+        int     _nextFd;
+
+    public:
+        explicit MicroBench(Server &server): _server(server), _nextFd(FIRST_FD) {}
+
+        Client *addClient(const std::string &nick) {
+            Client *client = _server.clients.create(_nextFd++, 0);
+            run(client, "PASS pw");
+            run(client, "NICK " + nick);
+            run(client, "USER u u u u");
+            discardOutput();
+            return client;
+        }
+
+        void run(Client *client, const std::string &line) {
+            ParsedLine parsed(line);
+            _server.parseCommand(client, parsed.message);
+        }
+
+        Channel *channel(const std::string &name) {
+            return _server.channels[name];
+        }
+
+        // What the event loop would have written: every queue that received
+        // output since the last call is emptied.
+        void discardOutput() {
+            std::vector<int> &dirty = _server.shards[0]->dirty_fds;
+            for (size_t i = 0; i < dirty.size(); ++i) {
+                Client *client = _server.clients.find(dirty[i]);
+                if (!client)
+                    continue;
+                client->consumeSent(client->getSendQueueSize());
+                client->setIsDirty(false);
+            }
+            dirty.clear();
+        }
+
+        void parseCommand(Client *client, const Message &message) {
+            _server.parseCommand(client, message);
+        }
+
+        void handlePRIVMSG(Client *client, const Params &params) {
+            _server.handlePRIVMSG(client, params);
+        }
+
+        size_t prefixLength(Client *client) {
+            return _server.Prefix(client).size();
+        }
+
+        template <typename Op>
+        void measure(const std::string &name, size_t iterations, Op &op) {
+            op();
+            discardOutput();
+
+            double elapsed = 0;
+            unsigned long long allocs = 0;
+            size_t ops = 0;
+            while (ops < iterations) {
+                unsigned long long before = allocations;
+                double start = nowNs();
+                for (int i = 0; i < BATCH; ++i)
+                    op();
+                elapsed += nowNs() - start;
+                allocs += allocations - before;
+                ops += BATCH;
+                discardOutput();
+            }
+            std::cout << name << " " << elapsed / ops << " " << static_cast<double>(allocs) / ops << std::endl;
+        }
+
+        // Channels with a password and an op each, and a ban on one in
+        // SNAPSHOT_BAN_EVERY, go through a snapshot in a scratch directory
+        // and come back into a second server. Both passes are timed once,
+        // the files are removed after.
+        static void measureSnapshot(size_t count) {
+            char dir[] = "/tmp/microbench.XXXXXX";
+            if (!mkdtemp(dir))
+                return;
+            ServerConfig config;
+            config.maxClients = 1;
+            config.stateDir = dir;
+            std::string name = numbered("snapshot/write/", count);
+            {
+                Server source("pw", config);
+                for (size_t i = 0; i < count; ++i) {
+                    Channel *channel = new Channel(numbered("#channel", i), &source);
+                    channel->setPassword("key");
+                    channel->restoreOp(numbered("user", i % CLIENT_COUNT));
+                    if (i % SNAPSHOT_BAN_EVERY == 0)
+                        channel->ban(numbered("banned", i), 0);
+                    source.channels[channel->getName()] = channel;
+                }
+                source.store.open(dir);
+                unsigned long long before = allocations;
+                double start = nowNs();
+                source.store.writeSnapshot(&Server::encodeSnapshot, &source);
+                std::cout << name << " " << (nowNs() - start) / count << " "
+                          << static_cast<double>(allocations - before) / count << std::endl;
+            }
+            name = numbered("snapshot/restore/", count);
+            {
+                Server restored("pw", config);
+                restored.store.open(dir);
+                unsigned long long before = allocations;
+                double start = nowNs();
+                restored.loadChannels();
+                double elapsed = nowNs() - start;
+                if (restored.channels.size() != count)
+                    std::cerr << "restored " << restored.channels.size() << " of " << count << " channels" << std::endl;
+                std::cout << name << " " << elapsed / count << " "
+                          << static_cast<double>(allocations - before) / count << std::endl;
+            }
+            unlink((std::string(dir) + "/" SNAPSHOT_FILE).c_str());
+            unlink((std::string(dir) + "/" JOURNAL_FILE).c_str());
+            rmdir(dir);
+        }
+};
+
+struct ParseMessageOp {
+    const std::string &line;
+    size_t params;
+    explicit ParseMessageOp(const std::string &line): line(line), params(0) {}
+    void operator()() {
+        Message message;
+        parseMessage(Slice(line.data(), line.size()), message);
+        params += message.params.size();
+    }
+};
+
+struct PrefixOp {
+    MicroBench &bench;
+    Client *client;
+    size_t bytes;
+    PrefixOp(MicroBench &bench, Client *client): bench(bench), client(client), bytes(0) {}
+    void operator()() {
+        bytes += bench.prefixLength(client);
+    }
+};
+
+// Parses the line on every call, as processInput does.
+struct CommandOp {
+    MicroBench &bench;
+    Client *client;
+    std::string line;
+    CommandOp(MicroBench &bench, Client *client, const std::string &line): bench(bench), client(client), line(line) {}
+    void operator()() {
+        Message message;
+        parseMessage(Slice(line.data(), line.size()), message);
+        bench.parseCommand(client, message);
+    }
+};
+
+struct PrivmsgOp {
+    MicroBench &bench;
+    Client *client;
+    ParsedLine parsed;
+    PrivmsgOp(MicroBench &bench, Client *client, const std::string &line): bench(bench), client(client), parsed(line) {}
+    void operator()() {
+        bench.handlePRIVMSG(client, parsed.message.params);
+    }
+};
+
+struct BroadcastOp {
+    Channel *channel;
+    Client *sender;
+    std::string text;
+    BroadcastOp(Channel *channel, Client *sender, const std::string &text): channel(channel), sender(sender), text(text) {}
+    void operator()() {
+        channel->broadcastMessage(text, sender);
+    }
+};
+
+// A timer wheel holding TIMER_COUNT deadlines spread over TIMER_SPREAD ticks.
+struct TimerSet {
+    TimerWheel              wheel;
+    std::vector<TimerNode>  nodes;
+    std::vector<TimerNode*> expired;
+    uint32_t                now;
+
+    TimerSet(): nodes(TIMER_COUNT), now(TimerWheel::clock()) {
+        for (size_t i = 0; i < TIMER_COUNT; ++i)
+            wheel.arm(&nodes[i], now + 1 + i % TIMER_SPREAD);
+    }
+};
+
+struct TimerArmOp {
+    TimerSet &timers;
+    size_t next;
+    explicit TimerArmOp(TimerSet &timers): timers(timers), next(0) {}
+    void operator()() {
+        next = (next + 7919) % TIMER_COUNT;
+        timers.wheel.arm(&timers.nodes[next], timers.now + 1 + next % TIMER_SPREAD);
+    }
+};
+
+struct TimerTickOp {
+    TimerSet &timers;
+    explicit TimerTickOp(TimerSet &timers): timers(timers) {}
+    void operator()() {
+        ++timers.now;
+        timers.wheel.advance(timers.now, timers.expired);
+        for (size_t i = 0; i < timers.expired.size(); ++i)
+            timers.wheel.arm(timers.expired[i], timers.now + TIMER_SPREAD);
+        timers.expired.clear();
+    }
+};
+
+int main(int argc, char **argv)
+{
+    size_t iterations = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 1000000;
+
+    // the server logs every join; keep that out of the results
+    Logger::setLevel(LOG_LEVEL_WARN);
+
+    ServerConfig config;
+    config.maxClients = FIRST_FD + CLIENT_COUNT;
+    Server server("pw", config);
+    MicroBench bench(server);
+
+    std::vector<Client *> clients;
+    for (size_t i = 0; i < CLIENT_COUNT; ++i)
+        clients.push_back(bench.addClient(numbered("user", i)));
+
+    size_t sizes[] = { 10, 100, 1000 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s)
+    {
+        std::string name = numbered("#members", sizes[s]);
+        bench.run(clients[0], "CREATE " + name + " key");
+        for (size_t i = 1; i < sizes[s]; ++i)
+        {
+            bench.run(clients[i], "JOIN " + name + " key");
+            bench.discardOutput();
+        }
+    }
+    bench.discardOutput();
+
+    std::string privmsg = "PRIVMSG user1 :hello there, this is a benchmark message";
+    std::cout << "benchmark ns_op allocs_op" << std::endl;
+
+    ParseMessageOp parseOp(privmsg);
+    bench.measure("parseMessage", iterations, parseOp);
+
+    PrefixOp prefixOp(bench, clients[0]);
+    bench.measure("Prefix", iterations, prefixOp);
+
+    CommandOp pingOp(bench, clients[0], "PING token");
+    bench.measure("parseCommand/PING", iterations, pingOp);
+
+    PrivmsgOp privmsgOp(bench, clients[0], privmsg);
+    bench.measure("handlePRIVMSG", iterations, privmsgOp);
+
+    CommandOp commandOp(bench, clients[0], privmsg);
+    bench.measure("parseCommand/PRIVMSG", iterations, commandOp);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s)
+    {
+        BroadcastOp broadcastOp(bench.channel(numbered("#members", sizes[s])), clients[0], "hello channel\r\n");
+        bench.measure(numbered("broadcastMessage/", sizes[s]), std::max<size_t>(BATCH, iterations / sizes[s]), broadcastOp);
+    }
+
+    TimerSet timers;
+    TimerArmOp armOp(timers);
+    bench.measure("TimerWheel/arm", iterations, armOp);
+    TimerTickOp tickOp(timers);
+    bench.measure("TimerWheel/tick", std::max<size_t>(BATCH, iterations / 100), tickOp);
+
+    MicroBench::measureSnapshot(SNAPSHOT_CHANNELS);
+    return EXIT_SUCCESS;
+}
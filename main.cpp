@@ -1,8 +1,8 @@
 #include "Server.hpp"
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: ./ircserv <port> <password>" << std::endl;
+    if (argc < 3) {
+        std::cerr << "Usage: ./ircserv <port> <password> [options]" << std::endl;
         return EXIT_FAILURE;
     }
 
@@ -21,7 +21,23 @@ int main(int argc, char* argv[]) {
         std::exit(EXIT_FAILURE);
     }
 
-    Server server(port, password);
+    ServerConfig config;
+    for (int i = 3; i < argc; ++i)
+    {
+        if (!config.parseOption(argv[i]))
+        {
+            std::cerr << RED_COLOR << "Unknown option: " << argv[i] << RESET_COLOR << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    // only the server's upgrade thread takes the upgrade signal, so it is
+    // blocked before any thread starts
+    Server::blockUpgradeSignal();
+    Logger::setLevel(config.logLevel);
+    Logger::start();
+
+    Server server(port, password, config);
     server.run();
 
     return EXIT_SUCCESS;
@@ -1,313 +1,1591 @@
 #include "Server.hpp"
 
-Server::Server(const std::string &port_str, const std::string &password) : password(password)
+// Shard whose event loop runs on the calling thread.
+static __thread Shard *current_shard = NULL;
+
+Server::Server(const std::string &port_str, const std::string &password, const ServerConfig &config)
+    : password(password), config(config), admin_fd(-1), pause_requested(0), parked(0),
+      handover_clients(0), handover_channels(0), handover_ns(0), restored_channels(0), restored_records(0),
+      restore_ns(0), link_listen_fd(-1), next_link_id(1), links_dirty(0),
+      collision_notice(SharedBuffer::create("ERROR :Nickname collision\r\n"))
 {
+    pthread_mutex_init(&link_lock, NULL);
+    pthread_mutex_init(&pause_lock, NULL);
+    pthread_cond_init(&pause_cond, NULL);
     initServer(port_str);
 }
 
+// Builds a server without sockets or event loops: a single shard with no
+// descriptors, driven by the calling thread. Clients created in the slab can
+// run commands and their output stays in their send queues. This is what the
+// in-process microbenchmarks use (bench/microbench.cpp).
+Server::Server(const std::string &password, const ServerConfig &config)
+    : password(password), config(config), admin_fd(-1), pause_requested(0), parked(0),
+      handover_clients(0), handover_channels(0), handover_ns(0), restored_channels(0), restored_records(0),
+      restore_ns(0), link_listen_fd(-1), next_link_id(1), links_dirty(0),
+      collision_notice(SharedBuffer::create("ERROR :Nickname collision\r\n"))
+{
+    pthread_mutex_init(&link_lock, NULL);
+    pthread_mutex_init(&pause_lock, NULL);
+    pthread_cond_init(&pause_cond, NULL);
+    if (!clients.init(FD_RESERVED + config.maxClients))
+    {
+        LOG_ERROR(RED_COLOR << "Client slab allocation failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+    registerCommands();
+    initFloodControl();
+    shards.push_back(new Shard(0, 1, this));
+    shards[0]->metrics.init(command_count + 2);
+    current_shard = shards[0];
+}
+
 Server::~Server()
 {
-    close(server_fd);
-    for (std::map<int, Client *>::iterator it = clients.begin(); it != clients.end(); ++it)
+    for (size_t fd = 0; fd < clients.capacity(); ++fd)
     {
-        close(it->first);
-        delete it->second;
+        Client *client = clients.find(fd);
+        if (!client)
+            continue;
+        clients.unlink(client);
+        clients.destroy(client);
+        close(fd);
+    }
+#ifndef NO_IO_URING
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        std::map<int, Client *> &detached = shards[i]->detached;
+        for (std::map<int, Client *>::iterator it = detached.begin(); it != detached.end(); ++it)
+        {
+            clients.destroy(it->second);
+            close(it->first);
+        }
     }
+#endif
     for (std::map<std::string, Channel *>::iterator it = channels.begin(); it != channels.end(); ++it)
     {
-        delete it->second;
+        delete it->second;
+    }
+    freeLinks();
+    collision_notice->release();
+    for (size_t i = 0; i < shards.size(); ++i)
+        delete shards[i];
+    if (admin_fd != -1)
+    {
+        close(admin_fd);
+        unlink(config.adminSocket.c_str());
+    }
+    pthread_cond_destroy(&pause_cond);
+    pthread_mutex_destroy(&pause_lock);
+    pthread_mutex_destroy(&link_lock);
+}
+
+void Server::setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+}
+
+uint32_t Server::readEvents() const
+{
+    if (config.edgeTriggered)
+        return EPOLLIN | EPOLLRDHUP | EPOLLET;
+    return EPOLLIN | EPOLLRDHUP;
+}
+
+bool Server::isNumber(const std::string& input)
+{
+    for (size_t j = 0; j < input.size(); j++)
+        if (!std::isdigit(input[j]))
+                return false;
+    return true;
+}
+
+// A process started by a hot upgrade takes the listening sockets, clients
+// and channels over from its predecessor instead of binding the port.
+void Server::initServer(const std::string &port_str)
+{
+    int port = std::atoi(port_str.c_str());
+    int handover = -1;
+    const char *inherited = std::getenv(HANDOVER_ENV);
+    if (inherited)
+    {
+        handover = std::atoi(inherited);
+        unsetenv(HANDOVER_ENV);
+    }
+
+    char path[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (length > 0)
+        exe_path.assign(path, length);
+
+    if (!clients.init(raiseFdLimit()))
+    {
+        LOG_ERROR(RED_COLOR << "Client slab allocation failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+    if (!config.stateDir.empty() && !store.open(config.stateDir))
+    {
+        LOG_ERROR(RED_COLOR << "Channel store: " << config.stateDir << " cannot be opened: "
+                  << strerror(errno) << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+    registerCommands();
+    initFloodControl();
+    for (int i = 0; i < config.threads; ++i)
+    {
+        shards.push_back(new Shard(i, config.threads, this));
+        shards.back()->metrics.init(command_count + 2);
+        if (handover == -1)
+            shards.back()->listen_fd = openListener(port);
+        initShard(*shards.back());
+    }
+    if (handover != -1 && !receiveHandover(handover))
+    {
+        LOG_ERROR(RED_COLOR << "Handover from the previous process failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+    if (handover == -1 && store.isOpen())
+        loadChannels();
+    store.start(&Server::encodeSnapshot, this, config.snapshotInterval);
+    if (!config.adminSocket.empty() && admin_fd == -1)
+        initAdminSocket();
+    initLinks(port_str);
+
+    const char *backend = " (epoll, level-triggered, ";
+    if (shards[0]->usesRing())
+        backend = " (io_uring, ";
+    else if (config.edgeTriggered)
+        backend = " (epoll, edge-triggered, ";
+    LOG_INFO(GREEN_COLOR << "Server listening on port " << port << backend
+             << config.threads << (config.threads == 1 ? " thread)" : " threads)") << RESET_COLOR);
+    LOG_INFO(GREEN_COLOR << "Accepting up to " << config.maxClients << " clients, "
+             << clientSlotBytes() << " bytes per client slot" << RESET_COLOR);
+}
+
+// Sets the soft descriptor limit to what the client limit needs, as far as
+// the hard limit allows, and caps the client limit to what fits next to the
+// shards' own descriptors. A soft limit above that is lowered as well, so
+// no descriptor can outgrow the client slab. Returns how many descriptors
+// the process may hold, which bounds every fd the slab has to index.
+size_t Server::raiseFdLimit()
+{
+    rlim_t reserved = FD_RESERVED + FD_PER_SHARD * config.threads;
+    rlim_t wanted = reserved + config.maxClients;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+        return wanted;
+
+    rlim_t target = (limit.rlim_max == RLIM_INFINITY) ? wanted : std::min(limit.rlim_max, wanted);
+    if (limit.rlim_cur != target)
+    {
+        struct rlimit raised = limit;
+        raised.rlim_cur = target;
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0)
+            limit = raised;
+    }
+
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < wanted)
+    {
+        int usable = limit.rlim_cur > reserved ? limit.rlim_cur - reserved : 1;
+        LOG_WARN(RED_COLOR << "RLIMIT_NOFILE is " << limit.rlim_cur << ", lowering the client limit from "
+                 << config.maxClients << " to " << usable << RESET_COLOR);
+        config.maxClients = usable;
+    }
+    return limit.rlim_cur == RLIM_INFINITY ? wanted : std::min(limit.rlim_cur, wanted);
+}
+
+// Size of one client slab slot, the fixed part of every connection. An
+// idle client holds more than this: the heap parts of its name strings,
+// its nickname's hash map slot and its channel set nodes. bench/connstorm
+// measures the whole figure as server RSS growth per connection.
+size_t Server::clientSlotBytes()
+{
+    return sizeof(Client);
+}
+
+int Server::openListener(int port)
+{
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+    {
+        LOG_ERROR(RED_COLOR << "Socket creation failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+
+    setNonBlocking(listen_fd);
+
+    int opt = 1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
+    {
+        LOG_ERROR(RED_COLOR << "Set socket options failed" << RESET_COLOR);
+    }
+    // Each shard binds its own listener and the kernel spreads new
+    // connections across them.
+    if (config.threads > 1 && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))
+    {
+        LOG_ERROR(RED_COLOR << "Set socket options failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+
+    address.sin_family = AF_INET;
+
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        LOG_ERROR(RED_COLOR << "Bind failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (listen(listen_fd, SOMAXCONN) < 0)
+    {
+        LOG_ERROR(RED_COLOR << "Listen failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+    return listen_fd;
+}
+
+// Sets up the shard's event loop around its listener, if it has one yet.
+void Server::initShard(Shard &shard)
+{
+    shard.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard.wake_fd == -1)
+    {
+        LOG_ERROR(RED_COLOR << "Eventfd creation failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (config.ioUring && initRing(shard))
+        return;
+
+    shard.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (shard.epoll_fd == -1)
+    {
+        LOG_ERROR(RED_COLOR << "Epoll creation failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event wake_event;
+    wake_event.events = EPOLLIN;
+    wake_event.data.fd = shard.wake_fd;
+    if (epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, shard.wake_fd, &wake_event) == -1)
+    {
+        LOG_ERROR(RED_COLOR << "Epoll registration failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+    if (shard.listen_fd != -1)
+        adoptListener(shard, shard.listen_fd);
+}
+
+// Makes `fd` the shard's listener. The io_uring loop arms its accept when
+// it starts.
+void Server::adoptListener(Shard &shard, int fd)
+{
+    shard.listen_fd = fd;
+    if (shard.usesRing())
+        return;
+    struct epoll_event listen_event;
+    listen_event.events = config.edgeTriggered ? (EPOLLIN | EPOLLET) : EPOLLIN;
+    listen_event.data.fd = fd;
+    if (epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, fd, &listen_event) == -1)
+    {
+        LOG_ERROR(RED_COLOR << "Epoll registration failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+void *Server::shardMain(void *arg)
+{
+    Shard *shard = static_cast<Shard *>(arg);
+    shard->server->runShard(*shard);
+    return NULL;
+}
+
+// Shard 0 runs on the calling thread, the others get a thread each. One more
+// thread waits for UPGRADE_SIGNAL.
+void Server::run()
+{
+    if (pthread_create(&upgrade_thread, NULL, &Server::upgradeMain, this) != 0)
+    {
+        LOG_ERROR(RED_COLOR << "Thread creation failed" << RESET_COLOR);
+        std::exit(EXIT_FAILURE);
+    }
+    for (size_t i = 1; i < shards.size(); ++i)
+    {
+        if (pthread_create(&shards[i]->thread, NULL, &Server::shardMain, shards[i]) != 0)
+        {
+            LOG_ERROR(RED_COLOR << "Thread creation failed" << RESET_COLOR);
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    runShard(*shards[0]);
+}
+
+void Server::runShard(Shard &shard)
+{
+    current_shard = &shard;
+
+    if (shard.usesRing())
+        runShardRing(shard);
+    else
+        runShardEpoll(shard);
+}
+
+void Server::runShardEpoll(Shard &shard)
+{
+    while (true)
+    {
+        // Clients that failed a write in the last batch are reaped right away;
+        // deliveries that did not fit into a full mailbox are retried soon.
+        // Throttled clients are picked up again as soon as one may run, and
+        // the timer wheel is served at its nearest deadline.
+        int timeout = -1;
+        if (!shard.closing_fds.empty() || !shard.resume_fds.empty())
+            timeout = 0;
+        else if (shard.hasOverflow())
+            timeout = 1;
+        if (shard.throttle_wait >= 0 && (timeout == -1 || shard.throttle_wait < timeout))
+            timeout = shard.throttle_wait;
+        uint32_t deadline;
+        if (timeout != 0 && shard.timers.nextTick(deadline))
+        {
+            int wait = TimerWheel::msUntil(deadline);
+            if (timeout == -1 || wait < timeout)
+                timeout = wait;
+        }
+        int ready = epoll_wait(shard.epoll_fd, &shard.events[0], shard.events.size(), timeout);
+        ++shard.tick;
+        shard.timer_now = TimerWheel::clock();
+
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR(RED_COLOR << "Epoll error: " << strerror(errno) << RESET_COLOR);
+            std::exit(EXIT_FAILURE);
+        }
+        uint64_t started = config.metrics ? Metrics::now() : 0;
+
+        for (int i = 0; i < ready; ++i)
+        {
+            int fd = shard.events[i].data.fd;
+
+            if (fd == shard.listen_fd)
+            {
+                acceptNewClient(shard);
+                continue;
+            }
+            if (fd == shard.wake_fd)
+            {
+                drainMailboxes(shard);
+                continue;
+            }
+            if (fd == admin_fd)
+            {
+                serveAdmin();
+                continue;
+            }
+            if (shard.index == 0 && serveLink(shard, fd, shard.events[i].events))
+                continue;
+            if (shard.events[i].events & EPOLLOUT)
+                handleClientWritable(shard, fd);
+            if (shard.events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                handleClientMessage(shard, fd);
+        }
+
+        runTimers(shard);
+        resumeInput(shard);
+        resumeListings(shard);
+        enforceMemoryBudget(shard);
+        reapClosingClients(shard);
+        finishBatch(shard);
+        if (config.metrics)
+            shard.metrics.loopDone(Metrics::now() - started);
+        if (__atomic_load_n(&pause_requested, __ATOMIC_ACQUIRE))
+            parkShard(shard);
+    }
+}
+
+void Server:: acceptNewClient(Shard &shard)
+{
+    // In edge-triggered mode the listening socket only reports new readiness
+    // once, so keep accepting until the backlog is empty.
+    do
+    {
+        sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_fd = accept(shard.listen_fd, (struct sockaddr *)&client_addr, &client_len);
+
+        if (client_fd == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_ERROR(RED_COLOR << "Accept failed" << RESET_COLOR);
+            break;
+        }
+
+        setNonBlocking(client_fd);
+
+        Client *client = addClient(shard, client_fd);
+        if (client && !client->watch(shard.epoll_fd, readEvents()))
+        {
+            LOG_ERROR(RED_COLOR << "Epoll registration failed: FD " << client_fd << RESET_COLOR);
+            removeClient(client);
+        }
+    } while (config.edgeTriggered);
+}
+
+// Registers a freshly accepted connection with the shard and the shared
+// registries. Returns NULL when the server is full.
+Client *Server::addClient(Shard &shard, int client_fd)
+{
+    if (config.tcpPolicy != TCP_POLICY_NAGLE)
+    {
+        int on = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    lockState();
+    if (clients.size() >= static_cast<size_t>(config.maxClients))
+    {
+        unlockState();
+        if (config.metrics)
+            shard.metrics.count(Metrics::CONNECTIONS_REJECTED);
+        std::string msg = "ERROR :Server full\r\n";
+        send(client_fd, msg.c_str(), msg.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(client_fd);
+        return NULL;
+    }
+
+    Client *client = clients.create(client_fd, shard.index);
+    if (!client)
+    {
+        unlockState();
+        if (config.metrics)
+            shard.metrics.count(Metrics::CONNECTIONS_REJECTED);
+        LOG_ERROR(RED_COLOR << "FD " << client_fd << " is beyond the client slab" << RESET_COLOR);
+        close(client_fd);
+        return NULL;
+    }
+
+    if (config.floodRate)
+        client->resetTokens(config.floodBurst * FLOOD_TOKEN_UNIT, floodClock());
+    client->touch(shard.timer_now);
+    client->setActiveAt(shard.timer_now);
+    if (config.registrationTimeout)
+        shard.timers.arm(&client->getTimer(), shard.timer_now + timeoutTicks(config.registrationTimeout));
+    else
+        armTimer(shard, client);
+    if (config.metrics)
+        shard.metrics.count(Metrics::CONNECTIONS_ACCEPTED);
+    LOG_INFO(GREEN_COLOR << "New client connected: FD " << client_fd << RESET_COLOR);
+    Slice greeting("You must log in with PASS first\r\n", 33);
+    sendPieces(client, &greeting, 1);
+    unlockState();
+    return client;
+}
+
+// The client on `fd` if this shard owns it. Safe without the lock: only the
+// owning shard creates and destroys the clients it accepted.
+Client *Server::localClient(Shard &shard, int fd)
+{
+    Client *client = clients.find(fd);
+    if (!client || client->getShard() != shard.index)
+        return NULL;
+    return client;
+}
+
+// Runs on the owning shard. The client is unlinked from every shared
+// registry under the lock first; after that no other thread can reach it
+// and its socket and memory are released without holding the lock.
+void Server::removeClient(Client *client)
+{
+    Shard &shard = *shards[client->getShard()];
+    int fd = client->getFd();
+
+    lockState();
+    // a client that lost its nickname to another server's no longer holds it
+    const std::string &nickname = client->getNickname();
+    if (!nickname.empty() && findClientByNickname(nickname) == client)
+    {
+        nicknames.erase(nickname);
+        if (!links.empty())
+            relayLine("QUIT " + nickname + " " + config.serverName);
+    }
+    while (!client->getChannels().empty())
+        (*client->getChannels().begin())->leaveChannel(client);
+    clients.unlink(client);
+    unlockState();
+    shard.timers.cancel(&client->getTimer());
+    metricAdd(shard.client_memory, -static_cast<uint64_t>(client->getAccounted().total()));
+    if (client->isHeavy())
+    {
+        metricAdd(shard.heavy_memory, -static_cast<uint64_t>(client->getAccounted().total()));
+        shard.heavy.erase(std::find(shard.heavy.begin(), shard.heavy.end(), client->getHandle()));
+    }
+    client->setAccounted(ClientMemory());
+    if (config.metrics)
+        shard.metrics.count(Metrics::CONNECTIONS_CLOSED);
+
+#ifndef NO_IO_URING
+    // Ring operations keep the socket referenced until they complete, so
+    // they are ended with shutdown() and the fd is closed by the last one.
+    if (shard.usesRing())
+    {
+        shutdown(fd, SHUT_RDWR);
+        if (client->getRingOps() > 0)
+        {
+            shard.detached[fd] = client;
+            LOG_INFO(RED_COLOR << "Client disconnected: FD " << fd << RESET_COLOR);
+            return;
+        }
+    }
+#endif
+    client->unwatch(shard.epoll_fd);
+    clients.destroy(client);
+    close(fd);
+
+    LOG_INFO(RED_COLOR << "Client disconnected: FD " << fd << RESET_COLOR);
+}
+
+void Server::handleClientMessage(Shard &shard, int fd)
+{
+    Client *client = localClient(shard, fd);
+    if (!client || client->isClosing())
+        return;
+    if (client->isThrottled())
+    {
+        readBacklog(shard, client);
+        return;
+    }
+    LineBuffer &input = client->getInputBuffer();
+    int &budget = client->lineBudget(shard.tick, config.lineBudget);
+
+    // Drain the socket until EAGAIN so lines split across segments are
+    // reassembled and edge-triggered descriptors never miss data.
+    while (true)
+    {
+        size_t room = input.writable();
+        ssize_t bytes_received = recv(fd, input.writePtr(), room, 0);
+
+        if (bytes_received == -1 && errno == EINTR)
+            continue;
+        if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            input.release();
+            account(shard, client);
+            return;
+        }
+        if (bytes_received <= 0)
+        {
+            removeClient(client);
+            return;
+        }
+
+        input.commit(bytes_received);
+        if (config.metrics)
+            shard.metrics.count(Metrics::BYTES_IN, bytes_received);
+        bool done = processInput(client, budget);
+
+        // the output waits for the end of the loop iteration, see finishBatch
+        if (client->isClosing())
+            return;
+        if (!done)
+        {
+            throttleClient(shard, client);
+            readBacklog(shard, client);
+            return;
+        }
+    }
+}
+
+// Frames and runs the complete lines sitting in the client's input buffer,
+// at most `budget` of them and, with flood control, only while the client
+// has tokens left. Returns false when lines are left for a later turn.
+// Each line takes as much of the state lock as its command needs, and
+// gives it back before the next one.
+bool Server::processInput(Client *client, int &budget)
+{
+    LineBuffer &input = client->getInputBuffer();
+    bool done = true;
+
+    client->touch(current_shard->timer_now);
+    if (config.floodRate)
+        client->refillTokens(floodClock(), config.floodRate, config.floodBurst * FLOOD_TOKEN_UNIT);
+    Slice line;
+    LineBuffer::Status status;
+    while (true)
+    {
+        if (budget == 0 || (config.floodRate && client->getTokens() <= 0))
+        {
+            done = !input.hasLine();
+            break;
+        }
+        if ((status = input.nextLine(line)) == LineBuffer::LINE_NONE)
+            break;
+        --budget;
+        if (status == LineBuffer::LINE_TOO_LONG)
+        {
+            lockShard();
+            replyError(client, "ERROR :Line too long\r\n");
+            unlockShard();
+            continue;
+        }
+
+        Message message;
+        if (parseMessage(line, message))
+        {
+            // unknown commands and channel text only read the registries
+            const CommandSpec *spec = findCommand(message.command);
+            bool whole = spec && spec->locking == LOCK_ALL;
+            if (whole)
+                lockState();
+            else
+                lockShard();
+            parseCommand(client, message, spec);
+            if (whole)
+                unlockState();
+            else
+                unlockShard();
+        }
+
+        // QUIT and failed writes only mark the client, stop reading it.
+        if (client->isClosing())
+            break;
+    }
+    return done;
+}
+
+// Holds the client's input back until resumeInput gives it another turn.
+void Server::throttleClient(Shard &shard, Client *client)
+{
+    if (client->isThrottled())
+        return;
+    client->startThrottle();
+    shard.throttled.push_back(client->getHandle());
+}
+
+// Takes in what a throttled client sends meanwhile, up to about max-recvq
+// bytes; anything beyond stays in the socket until the backlog drains.
+void Server::readBacklog(Shard &shard, Client *client)
+{
+    char chunk[4096];
+    while (client->getBacklogSize() < static_cast<size_t>(config.maxRecvq))
+    {
+        ssize_t bytes_received = recv(client->getFd(), chunk, sizeof(chunk), 0);
+
+        if (bytes_received == -1 && errno == EINTR)
+            continue;
+        if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (bytes_received <= 0)
+        {
+            removeClient(client);
+            return;
+        }
+        client->appendBacklog(chunk, bytes_received);
+        if (config.metrics)
+            shard.metrics.count(Metrics::BYTES_IN, bytes_received);
+    }
+    account(shard, client);
+    checkRecvq(shard, client);
+}
+
+// A client that keeps sending while flood control holds it back, until
+// max-recvq bytes wait, is disconnected with "ERROR :Excess Flood". One
+// that is only waiting for its next turn is not. Returns false when the
+// client was dropped.
+bool Server::checkRecvq(Shard &shard, Client *client)
+{
+    size_t waiting = client->getBacklogSize() + client->getInputBuffer().size();
+    if (!config.floodRate || client->getTokens() > 0 || waiting < static_cast<size_t>(config.maxRecvq))
+        return true;
+
+    LOG_INFO(RED_COLOR << "Excess flood: FD " << client->getFd() << RESET_COLOR);
+    if (config.metrics)
+        shard.metrics.count(Metrics::FLOOD_DISCONNECTS);
+    closeWithError(client, "Excess Flood");
+    return false;
+}
+
+// Drops the client with a last "ERROR :<reason>" line, written straight to
+// the socket and only when nothing is queued, so it cannot land in the
+// middle of a line.
+void Server::closeWithError(Client *client, const char *reason)
+{
+    if (!client->hasPendingOutput())
+    {
+        std::string line = std::string("ERROR :") + reason + "\r\n";
+        send(client->getFd(), line.data(), line.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    scheduleRemoval(client);
+}
+
+// Brings the shard's total up to date with the client's memory, and notes
+// the client as a candidate for budget evictions once it holds
+// MEMORY_HEAVY_SIZE bytes. Runs on the owning shard whenever a buffer grew
+// or drained.
+void Server::account(Shard &shard, Client *client)
+{
+    ClientMemory memory = client->memoryUsage();
+    uint64_t change = memory.total() - client->getAccounted().total();
+    metricAdd(shard.client_memory, change);
+    if (client->isHeavy())
+        metricAdd(shard.heavy_memory, change);
+    client->setAccounted(memory);
+    if (!client->isHeavy() && memory.total() >= MEMORY_HEAVY_SIZE)
+    {
+        client->setIsHeavy(true);
+        shard.heavy.push_back(client->getHandle());
+        metricAdd(shard.heavy_memory, memory.total());
+    }
+}
+
+// Drops a client holding too much memory. Output it was not sent a byte of
+// is discarded first, so the ERROR line can follow the last line it got;
+// a client that stopped reading may still never see it.
+void Server::evictClient(Shard &shard, Client *client, Metrics::Counter counter, const char *reason)
+{
+    LOG_WARN(RED_COLOR << reason << ": FD " << client->getFd() << " holds "
+             << client->getAccounted().total() << " bytes" << RESET_COLOR);
+#ifndef NO_IO_URING
+    // an io_uring send in flight still points into the queue
+    if (!shard.sends.count(client->getFd()))
+#endif
+        client->discardUnsent();
+    account(shard, client);
+    if (config.metrics)
+        shard.metrics.count(counter);
+    closeWithError(client, reason);
+}
+
+// While all clients together hold more than the memory budget, evicts the
+// largest consumers of this shard. The shards run this independently, so
+// each one frees only its share of the excess, in proportion to the bytes
+// its eviction candidates hold against those of every shard: the shares
+// add up to the excess, and the shard holding the most gives up the most.
+// Clients already closing count toward the share until they are gone.
+void Server::enforceMemoryBudget(Shard &shard)
+{
+    if (!config.memoryBudget || shard.heavy.empty())
+        return;
+    uint64_t total = clientMemory();
+    if (total <= config.memoryBudget)
+        return;
+    uint64_t candidates = 0;
+    for (size_t i = 0; i < shards.size(); ++i)
+        candidates += metricRead(shards[i]->heavy_memory);
+    uint64_t own = metricRead(shard.heavy_memory);
+    if (!candidates || !own)
+        return;
+    uint64_t excess = total - config.memoryBudget;
+    // rounded up, so a share never comes out as nothing
+    uint64_t share = excess >= candidates ? own
+        : static_cast<uint64_t>(static_cast<double>(excess) * own / candidates) + 1;
+
+    uint64_t freed = 0;
+    for (size_t i = 0; i < shard.heavy.size(); ++i)
+    {
+        Client *client = clients.get(shard.heavy[i]);
+        if (client && client->isClosing())
+            freed += client->getAccounted().total();
+    }
+    while (freed < share)
+    {
+        Client *largest = NULL;
+        for (size_t i = 0; i < shard.heavy.size(); ++i)
+        {
+            Client *client = clients.get(shard.heavy[i]);
+            if (client && !client->isClosing()
+                && (!largest || client->getAccounted().total() > largest->getAccounted().total()))
+                largest = client;
+        }
+        if (!largest)
+            break;
+        freed += largest->getAccounted().total();
+        evictClient(shard, largest, Metrics::BUDGET_EVICTIONS, "Memory budget exceeded");
+    }
+}
+
+// Bytes held by every client, summed over the shards. Any thread.
+uint64_t Server::clientMemory() const
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < shards.size(); ++i)
+        total += metricRead(shards[i]->client_memory);
+    return total;
+}
+
+// The TOP_CONSUMERS clients holding the most memory, largest first. Walks
+// the whole slab, so it is meant for STATS and the admin socket only. Must
+// be called with the whole state lock held, which keeps the clients found
+// linked. Their owners account them without any lock, so the sizes are a
+// racy snapshot: each is a recent figure, not all from the same moment.
+void Server::topConsumers(std::vector<Client*> &top)
+{
+    top.clear();
+    for (size_t fd = 0; fd < clients.capacity(); ++fd)
+    {
+        Client *client = clients.find(fd);
+        if (!client)
+            continue;
+        size_t bytes = client->getAccounted().total();
+        if (top.size() == TOP_CONSUMERS && bytes <= top.back()->getAccounted().total())
+            continue;
+        if (top.size() == TOP_CONSUMERS)
+            top.pop_back();
+        size_t at = top.size();
+        while (at > 0 && top[at - 1]->getAccounted().total() < bytes)
+            --at;
+        top.insert(top.begin() + at, client);
+    }
+}
+
+// Gives every throttled client the rest of its turn: the lines left in its
+// buffer run first, then the backlog is fed in as they are consumed. A client
+// whose backlog is drained goes back to reading its socket. Also works out
+// how long the loop may sleep before one of them may run again.
+void Server::resumeInput(Shard &shard)
+{
+    shard.throttle_wait = -1;
+    size_t count = shard.throttled.size();
+    size_t kept = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        Client *client = clients.get(shard.throttled[i]);
+        if (!client || client->isClosing() || !client->isThrottled())
+            continue;
+
+        int &budget = client->lineBudget(shard.tick, config.lineBudget);
+        bool done;
+        while ((done = processInput(client, budget)) && !client->isClosing() && client->refillInput())
+            ;
+        if (client->isClosing())
+            continue;
+#ifndef NO_IO_URING
+        if (shard.usesRing() && !resumeRecv(shard, client))
+            done = false;
+#endif
+        if (done)
+        {
+            client->endThrottle();
+            client->getInputBuffer().release();
+            account(shard, client);
+            // edge-triggered descriptors report no new data for what was
+            // left in the socket
+            if (!shard.usesRing())
+                handleClientMessage(shard, client->getFd());
+            continue;
+        }
+
+        account(shard, client);
+        if (!checkRecvq(shard, client))
+            continue;
+        shard.throttled[kept++] = shard.throttled[i];
+        int wait = 0;
+        if (config.floodRate && client->getTokens() <= 0 && client->getInputBuffer().hasLine())
+            wait = -client->getTokens() / config.floodRate + 1;
+        if (shard.throttle_wait == -1 || wait < shard.throttle_wait)
+            shard.throttle_wait = wait;
+    }
+    shard.throttled.erase(shard.throttled.begin() + kept, shard.throttled.begin() + count);
+    // throttled during this pass: their turn comes with the next one
+    if (shard.throttled.size() > kept)
+        shard.throttle_wait = 0;
+}
+
+// Each client has one timer. Input does not touch it: it only records the
+// tick, and the timer is moved on when it expires. While the client is
+// unregistered it runs to the registration deadline, then to the nearest
+// of its keepalive and idle deadlines, or to the PONG deadline while a PING
+// is out.
+void Server::armTimer(Shard &shard, Client *client)
+{
+    bool found = false;
+    uint32_t deadline = 0;
+    if (config.pingInterval)
+    {
+        deadline = client->getSeenAt() + timeoutTicks(config.pingInterval);
+        found = true;
+    }
+    if (config.idleTimeout)
+    {
+        uint32_t idle = client->getActiveAt() + timeoutTicks(config.idleTimeout);
+        if (!found || static_cast<int32_t>(idle - deadline) < 0)
+            deadline = idle;
+        found = true;
+    }
+    if (found)
+        shard.timers.arm(&client->getTimer(), deadline);
+    else
+        shard.timers.cancel(&client->getTimer());
+}
+
+// Serves the timers that expired by the tick read after the last wait. The
+// one timer that is not a client's dials the links that are down.
+void Server::runTimers(Shard &shard)
+{
+    shard.timers.advance(shard.timer_now, shard.expired);
+    if (shard.expired.empty())
+        return;
+
+    // client deadlines are the shard's own business, links are everyone's
+    bool whole = false;
+    for (size_t i = 0; i < shard.expired.size() && !whole; ++i)
+        whole = shard.expired[i]->owner == -1;
+    if (whole)
+        lockState();
+    else
+        lockShard();
+    for (size_t i = 0; i < shard.expired.size(); ++i)
+    {
+        if (shard.expired[i] == &link_timer)
+        {
+            dialLinks(shard);
+            continue;
+        }
+        // link timers have no descriptor
+        if (shard.expired[i]->owner == -1)
+        {
+            expireLink(shard.expired[i]);
+            continue;
+        }
+        Client *client = localClient(shard, shard.expired[i]->owner);
+        if (client && !client->isClosing())
+            checkTimeouts(shard, client);
+    }
+    if (whole)
+        unlockState();
+    else
+        unlockShard();
+    shard.expired.clear();
+}
+
+void Server::checkTimeouts(Shard &shard, Client *client)
+{
+    uint32_t now = shard.timer_now;
+    const char *reason = NULL;
+    if (config.registrationTimeout && registrationOf(client) != REG_DONE)
+        reason = "Registration timeout";
+    else if (client->isPingSent())
+        reason = "Ping timeout";
+    else if (config.idleTimeout && now - client->getActiveAt() >= timeoutTicks(config.idleTimeout))
+        reason = "Idle timeout";
+    if (reason)
+    {
+        LOG_INFO(RED_COLOR << reason << ": FD " << client->getFd() << RESET_COLOR);
+        if (config.metrics)
+            shard.metrics.count(Metrics::TIMEOUT_DISCONNECTS);
+        closeWithError(client, reason);
+        return;
+    }
+
+    if (config.pingInterval && now - client->getSeenAt() >= timeoutTicks(config.pingInterval))
+    {
+        Slice ping("PING :ircserv\r\n", 15);
+        sendPieces(client, &ping, 1);
+        if (config.pingTimeout)
+        {
+            client->setPingSent(true);
+            shard.timers.arm(&client->getTimer(), now + timeoutTicks(config.pingTimeout));
+            return;
+        }
+        // without a PONG deadline the PING only restarts the interval
+        client->touch(now);
+    }
+    armTimer(shard, client);
+}
+
+void Server::handleClientWritable(Shard &shard, int fd)
+{
+    Client *client = localClient(shard, fd);
+    if (!client || client->isClosing())
+        return;
+    flushClient(shard, client);
+}
+
+// Queues output produced by another shard for clients of this one. The
+// owning thread is the only one touching these queues, so no lock is taken.
+void Server::drainMailboxes(Shard &shard)
+{
+    uint64_t wakeups;
+    while (read(shard.wake_fd, &wakeups, sizeof(wakeups)) > 0)
+        ;
+
+    for (size_t i = 0; i < shard.inbox.size(); ++i)
+    {
+        Delivery delivery;
+        while (shard.inbox[i]->pop(delivery))
+        {
+            Client *client = clients.get(delivery.client);
+            if (client && !client->isClosing() && delivery.buffer == collision_notice)
+                closeWithError(client, "Nickname collision");
+            else if (client && !client->isClosing())
+            {
+                size_t queued = client->getSendQueueSize();
+                client->queueBuffer(delivery.buffer);
+                afterQueue(client, queued);
+            }
+            delivery.buffer->release();
+        }
+    }
+}
+
+// Writes out everything queued while commands ran, retries deliveries that
+// found a full mailbox and wakes the shards that were posted to. Shard 0
+// writes the server links as well. Runs once per event-loop iteration, after
+// every ready event was handled, so a client written to by several senders
+// in one iteration gets a single sendmsg.
+void Server::finishBatch(Shard &shard)
+{
+    if (shard.index == 0)
+        flushLinks(shard);
+    for (size_t i = 0; i < shard.dirty_fds.size(); ++i)
+    {
+        Client *client = localClient(shard, shard.dirty_fds[i]);
+        if (!client)
+            continue;
+        client->setIsDirty(false);
+        if (!client->isClosing())
+            flushClient(shard, client);
+    }
+    shard.dirty_fds.clear();
+
+    for (size_t target = 0; target < shard.overflow.size(); ++target)
+    {
+        std::deque<Delivery> &pending = shard.overflow[target];
+        while (!pending.empty() && shards[target]->inbox[shard.index]->push(pending.front()))
+        {
+            pending.pop_front();
+            shard.wake_pending[target] = 1;
+        }
+    }
+
+    for (size_t target = 0; target < shard.wake_pending.size(); ++target)
+    {
+        if (!shard.wake_pending[target])
+            continue;
+        uint64_t one = 1;
+        if (write(shards[target]->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            LOG_ERROR(RED_COLOR << "Shard wakeup failed: " << strerror(errno) << RESET_COLOR);
+        shard.wake_pending[target] = 0;
+    }
+}
+
+// Must be called with the state lock held.
+void Server::sendMessage(int fd, const std::string &message)
+{
+    Client *client = clients.find(fd);
+    if (!client)
+        return;
+
+    if (client->getShard() != current_shard->index)
+    {
+        SharedBuffer *buffer = SharedBuffer::create(message);
+        post(client, buffer);
+        buffer->release();
+        return;
+    }
+    if (client->isClosing())
+        return;
+
+    size_t queued = client->getSendQueueSize();
+    client->queueMessage(message);
+    afterQueue(client, queued);
+}
+
+// Queues a reference to an already encoded payload; the buffer itself is
+// shared with every other recipient. Must be called with the state lock
+// held.
+void Server::sendBuffer(Client *client, SharedBuffer *buffer)
+{
+    if (client->getShard() != current_shard->index)
+    {
+        post(client, buffer);
+        return;
+    }
+    if (client->isClosing())
+        return;
+
+    size_t queued = client->getSendQueueSize();
+    client->queueBuffer(buffer);
+    afterQueue(client, queued);
+}
+
+// Output is not written while commands run; the client is remembered and
+// flushed by finishBatch once the lock has been released.
+void Server::afterQueue(Client *client, size_t queued)
+{
+    if (config.metrics)
+        current_shard->metrics.count(Metrics::MESSAGES_OUT);
+    if (!client->isDirty())
+    {
+        client->setIsDirty(true);
+        current_shard->dirty_fds.push_back(client->getFd());
+    }
+    if (queued < SENDQ_WARN_SIZE && client->getSendQueueSize() >= SENDQ_WARN_SIZE)
+        LOG_WARN(RED_COLOR << "Slow consumer: FD " << client->getFd() << " has " << client->getSendQueueSize()
+                 << " bytes queued" << RESET_COLOR);
+    account(*current_shard, client);
+    if (client->getSendQueueSize() > config.maxSendq)
+        evictClient(*current_shard, client, Metrics::SENDQ_EVICTIONS, "SendQ exceeded");
+}
+
+// Error lines sent as given to the client whose command is running; the
+// command is counted as failed in the metrics. replyError adds the prefix.
+void Server::sendError(Client *client, const char *message)
+{
+    if (current_shard)
+        current_shard->command_failed = true;
+    Slice piece(message, std::strlen(message));
+    sendPieces(client, &piece, 1);
+}
+
+// Queues the pieces as one message. On the recipient's own shard they are
+// appended straight into its send queue; a message for another shard is
+// joined once in the shard's scratch string.
+void Server::sendPieces(Client *client, const Slice *pieces, size_t count)
+{
+    if (client->getShard() != current_shard->index)
+    {
+        std::string &joined = current_shard->scratch;
+        joined.clear();
+        for (size_t i = 0; i < count; ++i)
+            joined.append(pieces[i].data(), pieces[i].size());
+        SharedBuffer *buffer = SharedBuffer::create(joined);
+        post(client, buffer);
+        buffer->release();
+        return;
     }
+    if (client->isClosing())
+        return;
+
+    size_t queued = client->getSendQueueSize();
+    for (size_t i = 0; i < count; ++i)
+        client->queueMessage(pieces[i].data(), pieces[i].size());
+    afterQueue(client, queued);
 }
 
-void Server::setNonBlocking(int fd)
+// The client's cached prefix followed by a fixed text.
+void Server::sendReply(Client *client, const char *text)
 {
-    fcntl(fd, F_SETFL, O_NONBLOCK);
+    const std::string &prefix = client->getPrefix();
+    Slice pieces[] = { Slice(prefix.data(), prefix.size()), Slice(text, std::strlen(text)) };
+    sendPieces(client, pieces, 2);
 }
 
-bool Server::isNumber(const std::string& input)
+// The prefix, a fixed text and one argument, ending the line.
+void Server::sendReply(Client *client, const char *text, const Slice &argument)
 {
-    for (size_t j = 0; j < input.size(); j++)
-        if (!std::isdigit(input[j]))
-                return false;
-    return true;
+    const std::string &prefix = client->getPrefix();
+    Slice pieces[] = {
+        Slice(prefix.data(), prefix.size()),
+        Slice(text, std::strlen(text)),
+        argument,
+        Slice("\r\n", 2)
+    };
+    sendPieces(client, pieces, 4);
 }
 
-void Server::initServer(const std::string &port_str)
+void Server::sendReply(Client *client, const char *text, const std::string &argument)
 {
-    int port = std::atoi(port_str.c_str());
+    sendReply(client, text, Slice(argument.data(), argument.size()));
+}
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1)
+void Server::replyError(Client *client, const char *text)
+{
+    if (current_shard)
+        current_shard->command_failed = true;
+    sendReply(client, text);
+}
+
+// Fills a reply template: $n becomes the nickname and $h the hostname. The
+// text between placeholders is queued straight from the template.
+void Server::sendTemplate(Client *client, const char *text)
+{
+    const std::string &nickname = client->getNickname();
+    const std::string &hostname = client->getHostname();
+    Slice pieces[TEMPLATE_PIECES];
+    size_t count = 0;
+    const char *literal = text;
+    for (const char *p = text; *p; ++p)
     {
-        std::cerr << RED_COLOR << "Socket creation failed" << RESET_COLOR << std::endl;
-        std::exit(EXIT_FAILURE);
+        if (p[0] != '$' || (p[1] != 'n' && p[1] != 'h'))
+            continue;
+        pieces[count++] = Slice(literal, p - literal);
+        const std::string &value = p[1] == 'n' ? nickname : hostname;
+        pieces[count++] = Slice(value.data(), value.size());
+        literal = ++p + 1;
+        if (count + 2 > TEMPLATE_PIECES)
+        {
+            sendPieces(client, pieces, count);
+            count = 0;
+        }
     }
+    pieces[count++] = Slice(literal, std::strlen(literal));
+    sendPieces(client, pieces, count);
+}
 
-    setNonBlocking(server_fd);
+// Hands a payload to the shard that owns the recipient.
+void Server::post(Client *client, SharedBuffer *buffer)
+{
+    Shard &shard = *current_shard;
+    int target = client->getShard();
+    Delivery delivery;
+    delivery.client = client->getHandle();
+    delivery.buffer = buffer;
+
+    buffer->retain();
+    if (!shard.overflow[target].empty() || !shards[target]->inbox[shard.index]->push(delivery))
+        shard.overflow[target].push_back(delivery);
+    shard.wake_pending[target] = 1;
+}
 
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
+// Pushes pending output to the socket and keeps EPOLLOUT registered only
+// while something is left in the queue.
+void Server::flushClient(Shard &shard, Client *client)
+{
+#ifndef NO_IO_URING
+    if (shard.usesRing())
     {
-        std::cerr << RED_COLOR << "Set socket options failed" << RESET_COLOR << std::endl;
+        submitSend(shard, client);
+        return;
     }
-
-    sockaddr_in address;
-    std::memset(&address, 0, sizeof(address));
-
-    address.sin_family = AF_INET;
-
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+#endif
+    size_t queued = client->getSendQueueSize();
+    size_t calls = 0;
+    bool flushed = client->flushSendQueue(calls);
+    if (config.metrics)
     {
-        std::cerr << RED_COLOR << "Bind failed" << RESET_COLOR << std::endl;
-        std::exit(EXIT_FAILURE);
+        shard.metrics.sendQueued(queued);
+        shard.metrics.count(Metrics::SEND_CALLS, calls);
+        shard.metrics.count(Metrics::BYTES_OUT, queued - client->getSendQueueSize());
     }
-
-    if (listen(server_fd, SOMAXCONN) < 0)
+    account(shard, client);
+    if (!flushed)
     {
-        std::cerr << RED_COLOR << "Listen failed" << RESET_COLOR << std::endl;
-        std::exit(EXIT_FAILURE);
+        scheduleRemoval(client);
+        return;
     }
+    uint32_t wanted = readEvents();
+    if (client->hasPendingOutput())
+        wanted |= EPOLLOUT;
+    client->rewatch(shard.epoll_fd, wanted);
+    listingDrained(shard, client);
+}
 
-    struct pollfd server_pollfd;
-    server_pollfd.fd = server_fd;
-    server_pollfd.events = POLLIN;
-    poll_fds.push_back(server_pollfd);
-
-    registerCommands();
-
-    std::cout << GREEN_COLOR << "Server listening on port " << port << RESET_COLOR << std::endl;
+// Send failures surface in the middle of command handlers, so the client is
+// only marked here and released once the current event batch is done. Only
+// the owning shard marks its clients.
+void Server::scheduleRemoval(Client *client)
+{
+    if (client->isClosing())
+        return;
+    client->setIsClosing(true);
+    shards[client->getShard()]->closing_fds.push_back(client->getFd());
 }
 
-void Server::run()
+void Server::reapClosingClients(Shard &shard)
 {
-    while (true)
+    for (size_t i = 0; i < shard.closing_fds.size(); ++i)
     {
-        int poll_count = poll(&poll_fds[0], poll_fds.size(), -1);
-
-        if (poll_count == -1)
-        {
-            std::cerr << RED_COLOR << "Poll error: " << strerror(errno) << RESET_COLOR << std::endl;
-            std::exit(EXIT_FAILURE);
-        }
+        Client *client = localClient(shard, shard.closing_fds[i]);
+        if (client && client->isClosing())
+            removeClient(client);
+    }
+    shard.closing_fds.clear();
+}
 
-        for (size_t i = 0; i < poll_fds.size(); ++i)
+// Queues the next part of the client's listing until LIST_HIGH_WATER bytes
+// are waiting; the rest follows from resumeListings once they are written.
+// Must be called with the state lock held, on the shard owning the client.
+void Server::continueListing(Client *client)
+{
+    ListCursor *cursor;
+    while ((cursor = client->getListing()) != NULL && !client->isClosing()
+           && client->getSendQueueSize() < LIST_HIGH_WATER)
+    {
+        std::string chunk;
+        bool done;
+        if (cursor->kind == ListCursor::LIST_CHANNELS)
+            done = appendChannels(*cursor, chunk);
+        else
         {
-            if (poll_fds[i].revents & POLLIN)
-            {
-                if (poll_fds[i].fd == server_fd)
-                {
-                    acceptNewClient();
-                }
-                else
-                {
-                    handleClientMessage(poll_fds[i].fd);
-                }
-            }
+            // a channel deleted in the meantime ends its member list
+            std::map<std::string, Channel *>::iterator it = channels.find(cursor->channel);
+            done = it == channels.end() || it->second->appendMembers(chunk, cursor->member, cursor->remote,
+                                                                        LIST_CHUNK_SIZE);
         }
+        if (done)
+            client->endListing();
+        if (!chunk.empty())
+            sendMessage(client->getFd(), chunk);
     }
 }
 
-void Server:: acceptNewClient()
+// Appends channels after the cursor until LIST_CHUNK_SIZE bytes are
+// reached. Returns true once the last channel is written.
+bool Server::appendChannels(ListCursor &cursor, std::string &out)
 {
-    sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-
-    if (client_fd == -1)
+    std::map<std::string, Channel *>::iterator it = channels.upper_bound(cursor.channel);
+    for (; it != channels.end() && out.size() < LIST_CHUNK_SIZE; ++it)
     {
-        std::cerr << RED_COLOR << "Accept failed" << RESET_COLOR << std::endl;
-        return;
+        std::stringstream ss;
+        ss << it->second->getMemberCount();
+
+        out += it->first + " (" + ss.str() + " members)\r\n";
+        cursor.channel = it->first;
     }
+    return it == channels.end();
+}
 
-    setNonBlocking(client_fd);
+// Called after output was written: a client whose listing is unfinished is
+// picked up by the next resumeListings once little enough is queued. The
+// cursor is only touched by the owning shard, so no lock is needed here.
+void Server::listingDrained(Shard &shard, Client *client)
+{
+    ListCursor *cursor = client->getListing();
+    if (!cursor || cursor->queued || client->isClosing() || client->getSendQueueSize() >= LIST_LOW_WATER)
+        return;
+    cursor->queued = true;
+    shard.resume_fds.push_back(client->getFd());
+}
 
-    if (clients.size() >= MAX_CLIENTS)
-    {
-        std::string msg = "ERROR :Server full\r\n";
-        send(client_fd, msg.c_str(), msg.length(), 0);
-        close(client_fd);
+void Server::resumeListings(Shard &shard)
+{
+    if (shard.resume_fds.empty())
         return;
-    }
 
-    clients[client_fd] = new Client(client_fd);
+    lockShard();
+    for (size_t i = 0; i < shard.resume_fds.size(); ++i)
+    {
+        Client *client = localClient(shard, shard.resume_fds[i]);
+        if (!client || !client->getListing())
+            continue;
+        client->getListing()->queued = false;
+        continueListing(client);
+    }
+    unlockShard();
+    shard.resume_fds.clear();
+}
 
-    struct pollfd client_pollfd;
-    client_pollfd.fd = client_fd;
-    client_pollfd.events = POLLIN;
-    poll_fds.push_back(client_pollfd);
+void Server::sendWelcomeMessage(Client *client)
+{
+    static const char welcome_template[] =
+        ":$h 001 $n :Welcome to the Internet Relay Network $n!@$h\r\n"
+        ":$h 002 $n :Your host is $h\r\n"
+        ":$h 003 $n :This server was created\r\n";
 
-    std::cout << GREEN_COLOR << "New client connected: FD " << client_fd << RESET_COLOR << std::endl;
-    sendMessage(client_fd, "You must log in with PASS first\r\n");
+    sendTemplate(client, welcome_template);
 }
 
-void Server::removeClient(Client *client, const std::vector<std::string> &params)
+#define COMMAND(name) name, sizeof(name) - 1
+
+// Every verb the server understands, with the registration step it needs,
+// whether it acts on the sender's active channel and its default flood
+// control cost (--command-cost overrides it).
+const Server::CommandSpec Server::command_table[] = {
+    { COMMAND("PASS"),       &Server::handlePASS,    NULL,                           REG_NONE, SCOPE_ANY,     LOCK_ALL,    1 },
+    { COMMAND("NICK"),       &Server::handleNICK,    NULL,                           REG_PASS, SCOPE_ANY,     LOCK_ALL,    1 },
+    { COMMAND("USER"),       &Server::handleUSER,    NULL,                           REG_NICK, SCOPE_ANY,     LOCK_ALL,    1 },
+    { COMMAND("CREATE"),     &Server::createChannel, NULL,                           REG_DONE, SCOPE_ANY,     LOCK_ALL,    2 },
+    { COMMAND("JOIN"),       &Server::joinChannel,   NULL,                           REG_DONE, SCOPE_ANY,     LOCK_ALL,    2 },
+    { COMMAND("QUIT"),       &Server::handleQUIT,    NULL,                           REG_DONE, SCOPE_ANY,     LOCK_ALL,    1 },
+    { COMMAND("PRIVMSG"),    &Server::handlePRIVMSG, NULL,                           REG_DONE, SCOPE_ANY,     LOCK_SHARD,  1 },
+    { COMMAND("PING"),       &Server::handlePING,    NULL,                           REG_DONE, SCOPE_ANY,     LOCK_SHARD,  1 },
+    { COMMAND("PONG"),       &Server::handlePONG,    NULL,                           REG_NONE, SCOPE_ANY,     LOCK_SHARD,  1 },
+    { COMMAND("LIST"),       &Server::listChannels,  NULL,                           REG_DONE, SCOPE_ANY,     LOCK_SHARD, 10 },
+    { COMMAND("HELP"),       &Server::handleHelp,    NULL,                           REG_DONE, SCOPE_ANY,     LOCK_SHARD,  2 },
+    { COMMAND("OPER"),       &Server::handleOPER,    NULL,                           REG_DONE, SCOPE_ANY,     LOCK_ALL,    1 },
+    { COMMAND("STATS"),      &Server::handleSTATS,   NULL,                           REG_DONE, SCOPE_ANY,     LOCK_ALL,    5 },
+    { COMMAND("DELETE"),     NULL,                   &Server::deleteChannel,         REG_DONE, SCOPE_CHANNEL, LOCK_ALL,    1 },
+    { COMMAND("LEAVE"),      NULL,                   &Server::leaveChannel,          REG_DONE, SCOPE_CHANNEL, LOCK_ALL,    1 },
+    { COMMAND("ADDOP"),      NULL,                   &Server::addOpToChannel,        REG_DONE, SCOPE_CHANNEL, LOCK_ALL,    1 },
+    { COMMAND("KICK"),       NULL,                   &Server::kickMemberFromChannel, REG_DONE, SCOPE_CHANNEL, LOCK_ALL,    1 },
+    { COMMAND("BAN"),        NULL,                   &Server::banFromChannel,        REG_DONE, SCOPE_CHANNEL, LOCK_ALL,    1 },
+    { COMMAND("UNBAN"),      NULL,                   &Server::unbanFromChannel,      REG_DONE, SCOPE_CHANNEL, LOCK_ALL,    1 },
+    { COMMAND("LSTMEMBERS"), NULL,                   &Server::listChannelMembers,    REG_DONE, SCOPE_CHANNEL, LOCK_SHARD, 10 },
+    { NULL, 0, NULL, NULL, REG_NONE, SCOPE_ANY, LOCK_ALL, 0 }
+};
+
+#undef COMMAND
+
+// Slot i holds the 1-based index of a command_table entry (0 = empty).
+unsigned char Server::command_slots[COMMAND_SLOTS];
+size_t Server::command_count = 0;
+
+static uint32_t hashCommand(const char *name, size_t length)
 {
-    (void)params;
-    int fd = client->getFd();
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash ^= static_cast<unsigned char>(name[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-    close(fd);
-    delete clients[fd];
-    clients.erase(fd);
+// Resolves the tokens charged per metrics slot: the table's costs, one for
+// text sent to the active channel and unknown commands, then the
+// --command-cost overrides, which may also name those two slots.
+void Server::initFloodControl()
+{
+    command_costs.assign(command_count + 2, FLOOD_TOKEN_UNIT);
+    for (size_t i = 0; i < command_count; ++i)
+        command_costs[i] = command_table[i].cost * FLOOD_TOKEN_UNIT;
 
-    for (std::vector<struct pollfd>::iterator it = poll_fds.begin(); it != poll_fds.end(); ++it)
+    for (size_t i = 0; i < config.commandCosts.size(); ++i)
     {
-        if (it->fd == fd)
+        const std::string &name = config.commandCosts[i].first;
+        size_t slot = 0;
+        while (slot < command_costs.size() && name != slotName(slot))
+            ++slot;
+        if (slot == command_costs.size())
         {
-            poll_fds.erase(it);
-            break;
+            LOG_ERROR(RED_COLOR << "Unknown command in --command-cost: " << name << RESET_COLOR);
+            std::exit(EXIT_FAILURE);
         }
+        command_costs[slot] = config.commandCosts[i].second * FLOOD_TOKEN_UNIT;
     }
+}
 
-    std::cout << RED_COLOR << "Client disconnected: FD " << fd << RESET_COLOR << std::endl;
+uint32_t Server::floodClock()
+{
+    return static_cast<uint32_t>(Metrics::now() / 1000000);
 }
 
-void Server::handleClientMessage(int fd)
+// Timeout options are given in seconds, the timer wheel counts ticks.
+uint32_t Server::timeoutTicks(int seconds)
 {
-    char buffer[BUFFER_SIZE];
-    int bytes_received = recv(fd, buffer, BUFFER_SIZE - 1, 0);
+    return static_cast<uint32_t>(seconds) * 1000 / TIMER_TICK_MS;
+}
 
-    if (bytes_received <= 0)
+// Builds the open-addressed slot index over command_table. The current verb
+// set hashes without collisions, so a lookup is one hash and one compare.
+void Server::registerCommands()
+{
+    std::memset(command_slots, 0, sizeof(command_slots));
+    for (size_t i = 0; command_table[i].name; ++i)
     {
-        Client *client = clients[fd];
-        std::vector<std::string> params;
-        removeClient(client, params);
-        return;
+        size_t slot = hashCommand(command_table[i].name, command_table[i].length) % COMMAND_SLOTS;
+        while (command_slots[slot])
+            slot = (slot + 1) % COMMAND_SLOTS;
+        command_slots[slot] = i + 1;
+        command_count = i + 1;
     }
-
-    buffer[bytes_received] = '\0';
-    std::string message(buffer);
-
-    Client *client = clients[fd];
-
-    parseCommand(client, message);
 }
 
-void Server::sendMessage(int fd, const std::string &message)
+const Server::CommandSpec *Server::findCommand(const Slice &name)
 {
-    send(fd, message.c_str(), message.length(), 0);
+    size_t slot = hashCommand(name.data(), name.size()) % COMMAND_SLOTS;
+    while (command_slots[slot])
+    {
+        const CommandSpec &spec = command_table[command_slots[slot] - 1];
+        if (spec.length == name.size() && std::memcmp(spec.name, name.data(), name.size()) == 0)
+            return &spec;
+        slot = (slot + 1) % COMMAND_SLOTS;
+    }
+    return NULL;
 }
 
-void Server::sendWelcomeMessage(Client *client)
+Server::Registration Server::registrationOf(const Client *client)
 {
-    sendMessage(client->getFd(), ":" + client->getHostname() + " 001 " + client->getNickname() + " :Welcome to the Internet Relay Network " + client->getNickname() + "!" + "@" + client->getHostname() + "\r\n");
-    sendMessage(client->getFd(), ":" + client->getHostname() + " 002 " + client->getNickname() + " :Your host is " + client->getHostname() + "\r\n");
-    sendMessage(client->getFd(), ":" + client->getHostname() + " 003 " + client->getNickname() + " :This server was created\r\n");
+    if (!client->getIsAuthenticated())
+        return REG_NONE;
+    if (client->getNickname().empty())
+        return REG_PASS;
+    if (client->getHostname().empty())
+        return REG_NICK;
+    return REG_DONE;
 }
 
-void Server::registerCommands()
+void Server::parseCommand(Client *client, const Message &message)
 {
-    command_map["PASS"] = &Server::handlePASS;
-    command_map["NICK"] = &Server::handleNICK;
-    command_map["USER"] = &Server::handleUSER;
-    command_map["CREATE"] = &Server::createChannel;
-    command_map["JOIN"] = &Server::joinChannel;
-    command_map["QUIT"] = &Server::removeClient;
-
-    channel_command_map["DELETE"] = &Server::deleteChannel;
-    channel_command_map["LEAVE"] = &Server::leaveChannel;
-    channel_command_map["ADDOP"] = &Server::addOpToChannel;
-    channel_command_map["KICK"] = &Server::kickMemberFromChannel;
-    channel_command_map["LSTMEMBERS"] = &Server::listChannelMembers;
-
-    common_command_map["PRIVMSG"] = &Server::handlePRIVMSG;
-    common_command_map["PING"] = &Server::handlePING;
-    common_command_map["LIST"] = &Server::listChannels;
-    common_command_map["HELP"] = &Server::handleHelp;
+    parseCommand(client, message, findCommand(message.command));
 }
 
-void Server::parseCommand(Client *client, const std::string &message)
+// Runs one line and records its latency, and whether it failed, under the
+// command it named; `spec` is that command, NULL for none.
+void Server::parseCommand(Client *client, const Message &message, const CommandSpec *spec)
 {
-    std::string msg = message;
-    size_t pos;
-    while ((pos = msg.find("\n")) != std::string::npos)
+    Shard &shard = *current_shard;
+    uint64_t started = config.metrics ? Metrics::now() : 0;
+    shard.command_failed = false;
+
+    size_t slot = dispatchCommand(client, message, spec);
+
+    if (config.floodRate)
+        client->spendTokens(command_costs[slot]);
+    // keepalive traffic does not count as activity
+    if (config.idleTimeout && (slot >= command_count || (command_table[slot].handler != &Server::handlePING
+                                                         && command_table[slot].handler != &Server::handlePONG)))
+        client->setActiveAt(shard.timer_now);
+    if (config.metrics)
     {
-        std::string line = msg.substr(0, pos);
-        msg.erase(0, pos + 2);
-
-        if (line.empty())
-            continue;
-
-        std::istringstream iss(line);
-        std::string command;
-        iss >> command;
-
-        std::vector<std::string> params;
-        std::string param;
-        while (iss >> param)
-        {
-            params.push_back(param);
-        }
-
-        if (!client->getIsAuthenticated() && command != "PASS")
-        {
-            sendMessage(client->getFd(), Prefix(client) + "You must log in with PASS first\r\n");
-            continue;
-        }
-
-        if (client->getNickname().empty() && command != "NICK" && command != "PASS")
-        {
-            sendMessage(client->getFd(), Prefix(client) + "ERROR You must set a nickname first with NICK\r\n");
-            continue;
-        }
+        shard.metrics.count(Metrics::MESSAGES_IN);
+        shard.metrics.commandDone(slot, Metrics::now() - started, shard.command_failed);
+    }
+}
 
-        if (client->getHostname().empty() && command != "USER" && command != "PASS" && command != "NICK")
-        {
-            sendMessage(client->getFd(), Prefix(client) + "ERROR You must set a username first with USER\r\n");
-            continue;
-        }
+// Returns the metrics slot of the line: its command_table index,
+// command_count for text sent to the active channel, command_count + 1 for
+// an unknown command.
+size_t Server::dispatchCommand(Client *client, const Message &message, const CommandSpec *spec)
+{
+    Registration state = registrationOf(client);
+    size_t slot = spec ? spec - command_table : command_count + 1;
 
-        for (std::map<std::string, Channel *>::iterator it = channels.begin(); it != channels.end(); ++it)
+    if (state < (spec ? spec->required : REG_DONE))
+    {
+        if (state == REG_NONE)
         {
-            if (it->second->isMember(client))
-            {
-                if (channel_command_map.find(command) != channel_command_map.end())
-                    (this->*channel_command_map[command])(it->second, client, params);
-                else if (common_command_map.find(command) != common_command_map.end())
-                    (this->*common_command_map[command])(client, params);
-                else
-                    it->second->broadcastMessage(message, client);
-                return;
-            }
+            current_shard->command_failed = true;
+            sendReply(client, "You must log in with PASS first\r\n");
         }
-
-        if (command_map.find(command) != command_map.end())
-            (this->*command_map[command])(client, params);
-        else if (common_command_map.find(command) != common_command_map.end())
-            (this->*common_command_map[command])(client, params);
+        else if (state == REG_PASS)
+            replyError(client, "ERROR You must set a nickname first with NICK\r\n");
         else
-            sendMessage(client->getFd(), Prefix(client) + "ERROR :Unknown command\r\n");
+            replyError(client, "ERROR You must set a username first with USER\r\n");
+        return slot;
+    }
+
+    Channel *channel = client->getActiveChannel();
+    if (spec && spec->scope == SCOPE_ANY)
+        (this->*spec->handler)(client, message.params);
+    else if (spec && channel)
+        (this->*spec->channelHandler)(channel, client, message.params);
+    else if (channel)
+    {
+        channel->broadcastMessage(message.line.str() + "\r\n", client);
+        if (!channel->getLinks().empty())
+            relayChannelText(channel, "CMSG " + channel->getName() + " " + client->getNickname() + " "
+                             + message.line.str(), NULL);
+        return command_count;
     }
+    else
+        replyError(client, "ERROR :Unknown command\r\n");
+    return slot;
 }
 
-void Server::listChannels(Client *client, const std::vector<std::string> &params)
+void Server::listChannels(Client *client, const Params &params)
 {
     (void)params;
 
     if (channels.empty())
     {
-        sendMessage(client->getFd(), Prefix(client) + "ERRROR :No available channels.\r\n");
+        replyError(client, "ERRROR :No available channels.\r\n");
         return;
     }
 
-    std::string channel_list = "Available channels:\r\n";
-    for (std::map<std::string, Channel *>::iterator it = channels.begin(); it != channels.end(); ++it)
-    {
-        std::string channel_name = it->first;
-        int member_count = it->second->getMembers().size();
-
-        std::stringstream ss;
-        ss << member_count;
-
-        channel_list += channel_name + " (" + ss.str() + " members)\r\n";
-    }
-
-    sendMessage(client->getFd(), Prefix(client) + channel_list);
+    sendReply(client, "Available channels:\r\n");
+    client->startListing(ListCursor::LIST_CHANNELS, "");
+    continueListing(client);
 }
 
-void Server::deleteChannel(Channel *channel, Client *client, const std::vector<std::string> &params)
+void Server::deleteChannel(Channel *channel, Client *client, const Params &params)
 {
     (void)params;
 
@@ -317,36 +1595,41 @@ void Server::deleteChannel(Channel *channel, Client *client, const std::vector<s
 void Server::removeChannel(Channel *channel)
 {
     channels.erase(channel->getName());
+    journalChannel(RECORD_DELETE, channel->getName());
 }
 
-void Server::leaveChannel(Channel *channel, Client *client, const std::vector<std::string> &params)
+void Server::leaveChannel(Channel *channel, Client *client, const Params &params)
 {
     (void)params;
 
+    if (!links.empty())
+        relayLine("PART " + channel->getName() + " " + client->getNickname() + " " + config.serverName);
     channel->leaveChannel(client);
 }
 
-void Server::listChannelMembers(Channel *channel, Client *client, const std::vector<std::string> &params)
+void Server::listChannelMembers(Channel *channel, Client *client, const Params &params)
 {
     (void)params;
 
-    channel->listMembers(client);
+    sendMessage(client->getFd(), "Members of channel " + channel->getName() + ":\r\n");
+    client->startListing(ListCursor::LIST_MEMBERS, channel->getName());
+    continueListing(client);
 }
 
-void Server::createChannel(Client *client, const std::vector<std::string> &params)
+void Server::createChannel(Client *client, const Params &params)
 {
     if (params.size() < 2)
     {
-        sendMessage(client->getFd(), Prefix(client) + "Error: Usage: CREATE <channel name> <password>\r\n");
+        replyError(client, "Error: Usage: CREATE <channel name> <password>\r\n");
         return;
     }
 
-    std::string name = params[0];
-    std::string pass = params[1];
+    std::string name = params[0].str();
+    std::string pass = params[1].str();
 
     if (channels.find(name) != channels.end())
     {
-        sendMessage(client->getFd(), Prefix(client) + "Error: Channel already exists.\r\n");
+        replyError(client, "Error: Channel already exists.\r\n");
         return;
     }
 
@@ -355,216 +1638,494 @@ void Server::createChannel(Client *client, const std::vector<std::string> &param
     new_channel->addMember(client);
     new_channel->addOp(client);
     channels[name] = new_channel;
+    journalChannel(RECORD_CREATE, name, client->getNickname(), 0, pass);
+    if (!links.empty())
+    {
+        relayLine("CHANNEL " + name + " " + pass + " " + config.serverName);
+        relayLine("JOIN " + name + " " + client->getNickname() + " " + config.serverName);
+    }
 
-    sendMessage(client->getFd(), Prefix(client) + "Channel created successfully: " + name + "\r\n");
+    sendReply(client, "Channel created successfully: ", name);
 }
 
-void Server::joinChannel(Client *client, const std::vector<std::string> &params)
+void Server::joinChannel(Client *client, const Params &params)
 {
     if (params.size() != 2)
     {
-        sendMessage(client->getFd(), Prefix(client) + "Error Usage: JOIN <channel name> <password>\r\n");
+        replyError(client, "Error Usage: JOIN <channel name> <password>\r\n");
         return;
     }
 
-    std::string name = params[0];
-    std::string pass = params[1];
+    std::string name = params[0].str();
+    std::string pass = params[1].str();
 
     if (channels.find(name) == channels.end())
-        sendMessage(client->getFd(), Prefix(client) + "ERROR :Channel does not exist\r\n");
+        replyError(client, "ERROR :Channel does not exist\r\n");
     else
     {
-        if (channels[name]->isBlacklisted(client))
+        if (channels[name]->isMember(client))
+        {
+            client->setActiveChannel(channels[name]);
+            sendReply(client, "SUCCESS :Switched to channel ", name);
+            return;
+        }
+        if (channels[name]->isBanned(client))
         {
-            sendMessage(client->getFd(), Prefix(client) + "ERROR :You have been banned from this channel\r\n");
+            replyError(client, "ERROR :You have been banned from this channel\r\n");
             return;
         }
         if (channels[name]->getPassword() == pass)
         {
             channels[name]->addMember(client);
-            std::cout << GREEN_COLOR << client->getNickname() << " joined channel: " << name << RESET_COLOR << std::endl;
+            LOG_INFO(GREEN_COLOR << client->getNickname() << " joined channel: " << name << RESET_COLOR);
             channels[name]->broadcastMessage(client->getNickname() + " has joined the channel\r\n", client);
-            sendMessage(client->getFd(), Prefix(client) + "SUCCESS :You have joined the channel\r\n");
+            if (!links.empty())
+                relayLine("JOIN " + name + " " + client->getNickname() + " " + config.serverName);
+            sendReply(client, "SUCCESS :You have joined the channel\r\n");
         }
         else
-            sendMessage(client->getFd(), Prefix(client) + "ERROR :Invalid password\r\n");
+            replyError(client, "ERROR :Invalid password\r\n");
     }
 }
 
-void Server::kickMemberFromChannel(Channel *channel, Client *client, const std::vector<std::string> &params)
+void Server::kickMemberFromChannel(Channel *channel, Client *client, const Params &params)
 {
     if (params.size() != 1)
     {
-        sendMessage(client->getFd(), Prefix(client) + "ERROR :No nickname given\r\n");
+        replyError(client, "ERROR :No nickname given\r\n");
         return;
     }
 
-    std::string nickname = params[0];
+    std::string nickname = params[0].str();
 
     channel->kickMember(client, nickname);
 }
 
-void Server::addOpToChannel(Channel *channel, Client *client, const std::vector<std::string> &params)
+// BAN <mask> [seconds]: mask is nick, nick!user@host or user@host with '*'
+// and '?' wildcards. Without a duration the ban is permanent.
+void Server::banFromChannel(Channel *channel, Client *client, const Params &params)
+{
+    if (params.size() != 1 && params.size() != 2)
+    {
+        replyError(client, "ERROR : Usage: BAN <mask> [seconds]\r\n");
+        return;
+    }
+    if (!channel->isOp(client))
+    {
+        replyError(client, "ERROR :You are not op\r\n");
+        return;
+    }
+
+    time_t expires = 0;
+    if (params.size() == 2)
+    {
+        std::string seconds = params[1].str();
+        if (seconds.empty() || !isNumber(seconds))
+        {
+            replyError(client, "ERROR :Invalid ban duration\r\n");
+            return;
+        }
+        expires = time(NULL) + std::atol(seconds.c_str());
+    }
+
+    std::string mask = BanList::normalize(params[0].str());
+    journalChannel(RECORD_BAN, channel->getName(), mask, expires);
+    if (!links.empty())
+    {
+        std::ostringstream line;
+        line << "BAN " << channel->getName() << " " << mask << " " << expires;
+        relayLine(line.str());
+    }
+    if (channel->ban(mask, expires))
+        sendReply(client, "SUCCESS :Banned ", mask);
+    else
+        sendReply(client, "SUCCESS :Updated ban on ", mask);
+}
+
+void Server::unbanFromChannel(Channel *channel, Client *client, const Params &params)
+{
+    if (params.size() != 1)
+    {
+        replyError(client, "ERROR : Usage: UNBAN <mask>\r\n");
+        return;
+    }
+    if (!channel->isOp(client))
+    {
+        replyError(client, "ERROR :You are not op\r\n");
+        return;
+    }
+
+    std::string mask = BanList::normalize(params[0].str());
+    if (channel->unban(mask))
+    {
+        journalChannel(RECORD_UNBAN, channel->getName(), mask);
+        if (!links.empty())
+            relayLine("UNBAN " + channel->getName() + " " + mask);
+        sendReply(client, "SUCCESS :Removed ban on ", mask);
+    }
+    else
+        replyError(client, "ERROR :No such ban\r\n");
+}
+
+void Server::addOpToChannel(Channel *channel, Client *client, const Params &params)
 {
     if (params.size() != 1)
     {
-        sendMessage(client->getFd(), Prefix(client) + "ERROR :No nickname given\r\n");
+        replyError(client, "ERROR :No nickname given\r\n");
         return;
     }
 
-    std::string nickname = params[0];
+    std::string nickname = params[0].str();
     if (channel->isOp(client))
     {
         if (client->getNickname() == nickname)
         {
-            sendMessage(client->getFd(), Prefix(client) + "ERROR :You cannot make yourself op\r\n");
+            replyError(client, "ERROR :You cannot make yourself op\r\n");
             return;
         }
-        std::set<Client *> members = channel->getMembers();
-        for (std::set<Client *>::iterator memberIt = members.begin(); memberIt != members.end(); ++memberIt)
+        Client *target = findClientByNickname(nickname);
+        if (target && channel->isMember(target))
         {
-
-            if ((*memberIt)->getNickname() == nickname)
-            {
-                channel->addOp(*memberIt);
-                sendMessage(client->getFd(), Prefix(client) + "SUCCESS :User has been made op\r\n");
-                return;
-            }
+            channel->addOp(target);
+            journalChannel(RECORD_ADDOP, channel->getName(), nickname);
+            sendReply(client, "SUCCESS :User has been made op\r\n");
+            return;
+        }
+        // the server of a member connected elsewhere keeps its op
+        RemoteUser *remote = target ? NULL : channel->findRemoteMember(nickname);
+        if (remote)
+        {
+            sendLine(remote->link, "OP " + channel->getName() + " " + nickname);
+            sendReply(client, "SUCCESS :User has been made op\r\n");
+            return;
         }
-        sendMessage(client->getFd(), Prefix(client) + "ERROR :User not found in this channel\r\n");
+        replyError(client, "ERROR :User not found in this channel\r\n");
         return;
     }
-    sendMessage(client->getFd(), Prefix(client) + "ERROR :You are not op\r\n");
+    replyError(client, "ERROR :You are not op\r\n");
 }
 
-void Server::handlePASS(Client *client, const std::vector<std::string> &params)
+void Server::handlePASS(Client *client, const Params &params)
 {
     if (params.empty())
     {
-        sendMessage(client->getFd(), Prefix(client) + "ERROR :No password given\r\n");
+        replyError(client, "ERROR :No password given\r\n");
         return;
     }
 
     if (params[0] == password)
     {
         client->setIsAuthenticated(true);
-        sendMessage(client->getFd(), Prefix(client) + "SUCCESS :Auth Password accepted\r\n");
+        sendReply(client, "SUCCESS :Auth Password accepted\r\n");
     }
     else
     {
-        sendMessage(client->getFd(), Prefix(client) + "ERROR :Invalid password\r\n");
+        replyError(client, "ERROR :Invalid password\r\n");
     }
 }
 
-void Server::handleNICK(Client *client, const std::vector<std::string> &params)
+void Server::handleNICK(Client *client, const Params &params)
 {
     if (params.empty())
     {
-        sendMessage(client->getFd(), Prefix(client) + "ERROR :No nickname given\r\n");
+        replyError(client, "ERROR :No nickname given\r\n");
         return;
     }
 
-    std::string new_nickname = params[0];
+    std::string new_nickname = params[0].str();
+
+    Client *owner = findClientByNickname(new_nickname);
+    if ((owner && owner != client) || (!owner && !links.empty() && remote_users.find(new_nickname)))
+    {
+        sendError(client, "ERROR :Nickname is already in use\r\n");
+        return;
+    }
 
-    for (std::map<int, Client *>::const_iterator it = clients.begin(); it != clients.end(); ++it)
+    // Swap the index entry together with the field so lookups never see a
+    // stale or missing nickname.
+    if (!owner)
     {
-        if (it->second->getNickname() == new_nickname && it->first != client->getFd())
+        const std::string old_nickname = client->getNickname();
+        bool renamed = !old_nickname.empty() && findClientByNickname(old_nickname) == client;
+        if (renamed)
+            nicknames.erase(old_nickname);
+        nicknames.insert(new_nickname, client);
+        client->setNickname(new_nickname);
+        if (!links.empty() && renamed)
+            relayLine("RENAME " + old_nickname + " " + new_nickname + " " + config.serverName);
+        else if (!links.empty())
+            relayLine("NICK " + new_nickname + " " + config.serverName);
+        // ops are kept on disk by nickname
+        const std::set<Channel *> &joined = client->getChannels();
+        for (std::set<Channel *>::const_iterator it = joined.begin(); it != joined.end(); ++it)
         {
-            sendMessage(client->getFd(), "ERROR :Nickname is already in use\r\n");
-            return;
+            if (!(*it)->isOp(client))
+                continue;
+            journalChannel(RECORD_DEOP, (*it)->getName(), old_nickname);
+            journalChannel(RECORD_ADDOP, (*it)->getName(), new_nickname);
         }
     }
-
-    client->setNickname(new_nickname);
-    sendMessage(client->getFd(), Prefix(client) + "SUCCESS :Nickname set to " + new_nickname + "\r\n");
+    sendReply(client, "SUCCESS :Nickname set to ", new_nickname);
 }
 
-void Server::handleUSER(Client *client, const std::vector<std::string> &params)
+void Server::handleUSER(Client *client, const Params &params)
 {
     if (params.size() != 4)
     {
-        sendMessage(client->getFd(), Prefix(client) + "ERROR : Usage: USER <username> <hostname> <servername> <realname>\r\n");
+        replyError(client, "ERROR : Usage: USER <username> <hostname> <servername> <realname>\r\n");
         return;
     }
 
-    client->setUsername(params[0]);
-    client->setHostname(params[1]);
-    client->setServername(params[2]);
-    client->setRealname(params[3]);
+    client->setUsername(params[0].str());
+    client->setHostname(params[1].str());
+    client->setServername(params[2].str());
+    client->setRealname(params[3].str());
 
-    sendMessage(client->getFd(), Prefix(client) + "SUCCESS :User registered\r\n");
+    sendReply(client, "SUCCESS :User registered\r\n");
     sendWelcomeMessage(client);
+    // the registration deadline is met, keepalive and idle checks take over
+    if (config.registrationTimeout)
+        armTimer(*current_shard, client);
 }
 
-void Server::handlePING(Client *client, const std::vector<std::string> &params)
+void Server::handlePING(Client *client, const Params &params)
 {
     if (params.size() < 1)
     {
-        sendMessage(client->getFd(), Prefix(client) + "ERROR :No PING token given\r\n");
+        replyError(client, "ERROR :No PING token given\r\n");
         return;
     }
 
-    std::string response = "PONG :" + params[0] + "\r\n";
-    sendMessage(client->getFd(), Prefix(client) + response);
+    sendReply(client, "PONG :", params[0]);
 }
 
-void Server::handlePRIVMSG(Client *client, const std::vector<std::string> &params)
+// Answers a keepalive PING; receiving the line already did all there is.
+void Server::handlePONG(Client *client, const Params &params)
 {
-    if (params.size() < 2)
+    (void)client;
+    (void)params;
+}
+
+void Server::handleOPER(Client *client, const Params &params)
+{
+    if (params.size() != 1)
+    {
+        replyError(client, "ERROR : Usage: OPER <password>\r\n");
+        return;
+    }
+    if (config.operPassword.empty() || params[0] != config.operPassword)
     {
-        sendMessage(client->getFd(), Prefix(client) + "ERROR :Not enough parameters\r\n");
+        replyError(client, "ERROR :Password incorrect\r\n");
         return;
     }
+    client->setIsOperator(true);
+    sendReply(client, "SUCCESS :You are now a server operator\r\n");
+}
+
+// Summary of the metrics: the counters, then the latency percentiles of
+// the event loop and of every command that ran. The full histograms are on
+// the admin socket.
+void Server::handleSTATS(Client *client, const Params &params)
+{
+    (void)params;
 
-    std::string recipient = params[0];
-    std::string message = params[1];
+    if (!client->getIsOperator())
+    {
+        replyError(client, "ERROR :You are not a server operator\r\n");
+        return;
+    }
+    if (!config.metrics)
+    {
+        replyError(client, "ERROR :Metrics are disabled\r\n");
+        return;
+    }
 
-    for (size_t i = 2; i < params.size(); ++i)
+    Metrics total;
+    collectMetrics(total);
+
+    std::ostringstream stats;
+    stats << "Server statistics:\r\n";
+    stats << "connections accepted " << total.counter(Metrics::CONNECTIONS_ACCEPTED)
+          << " rejected " << total.counter(Metrics::CONNECTIONS_REJECTED)
+          << " closed " << total.counter(Metrics::CONNECTIONS_CLOSED) << "\r\n";
+    stats << "messages in " << total.counter(Metrics::MESSAGES_IN)
+          << " out " << total.counter(Metrics::MESSAGES_OUT) << "\r\n";
+    stats << "bytes in " << total.counter(Metrics::BYTES_IN)
+          << " out " << total.counter(Metrics::BYTES_OUT) << "\r\n";
+    stats << "send calls " << total.counter(Metrics::SEND_CALLS) << "\r\n";
+    stats << "flood disconnects " << total.counter(Metrics::FLOOD_DISCONNECTS) << "\r\n";
+    stats << "timeout disconnects " << total.counter(Metrics::TIMEOUT_DISCONNECTS) << "\r\n";
+    stats << "evictions sendq " << total.counter(Metrics::SENDQ_EVICTIONS)
+          << " budget " << total.counter(Metrics::BUDGET_EVICTIONS) << "\r\n";
+    stats << "client memory " << clientMemory() << " bytes budget " << config.memoryBudget << "\r\n";
+    std::vector<Client*> top;
+    topConsumers(top);
+    for (size_t i = 0; i < top.size(); ++i)
+    {
+        ClientMemory memory = top[i]->getAccounted();
+        const std::string &nickname = top[i]->getNickname();
+        stats << "top consumer " << (nickname.empty() ? "*" : nickname) << " fd " << top[i]->getFd()
+              << " bytes " << memory.total() << " input " << memory.input << " output " << memory.output
+              << " shared " << memory.shared << "\r\n";
+    }
+    const Histogram &loop = total.loopTime();
+    stats << "loop iterations " << loop.count() << " p50_ns " << loop.percentile(0.5)
+          << " p99_ns " << loop.percentile(0.99) << "\r\n";
+    const Histogram &queue = total.sendQueue();
+    stats << "sendq flushes " << queue.count() << " p50_bytes " << queue.percentile(0.5)
+          << " p99_bytes " << queue.percentile(0.99) << "\r\n";
+    stats << "log lines dropped " << Logger::dropped() << "\r\n";
+    if (handover_ns)
+        stats << "handover clients " << handover_clients << " channels " << handover_channels
+              << " took_ns " << handover_ns << "\r\n";
+    if (store.isOpen())
+    {
+        StoreStats persisted = store.stats();
+        stats << "channel store records " << persisted.records << " journal_bytes " << persisted.journalBytes
+              << " snapshots " << persisted.snapshots << " snapshot_bytes " << persisted.snapshotBytes
+              << " snapshot_ns " << persisted.snapshotNs << " errors " << persisted.errors << "\r\n";
+        stats << "restored channels " << restored_channels << " records " << restored_records
+              << " took_ns " << restore_ns << "\r\n";
+    }
+    if (!links.empty() || link_listen_fd != -1)
+        renderLinks(stats);
+    for (size_t i = 0; i < total.commandCount(); ++i)
     {
-        message += " " + params[i];
+        const CommandStats &command = total.command(i);
+        if (!command.calls)
+            continue;
+        stats << slotName(i) << " calls " << command.calls << " errors " << command.errors
+              << " p50_ns " << command.latency.percentile(0.5)
+              << " p99_ns " << command.latency.percentile(0.99)
+              << " p999_ns " << command.latency.percentile(0.999) << "\r\n";
     }
 
-    Client *targetClient = NULL;
-    for (std::map<int, Client *>::const_iterator it = clients.begin(); it != clients.end(); ++it)
+    sendMessage(client->getFd(), Prefix(client) + stats.str());
+}
+
+void Server::handlePRIVMSG(Client *client, const Params &params)
+{
+    if (params.size() < 2)
     {
-        if (it->second->getNickname() == recipient)
-        {
-            targetClient = it->second;
-            break;
-        }
+        replyError(client, "ERROR :Not enough parameters\r\n");
+        return;
     }
 
+    Client *targetClient = findClientByNickname(params[0]);
+
     if (targetClient)
     {
-        std::string full_message = ":" + client->getNickname() + " PRIVMSG " + recipient + " " + message + "\r\n";
-        sendMessage(targetClient->getFd(), Prefix(client) + full_message);
+        const std::string &prefix = client->getPrefix();
+        const std::string &sender = client->getNickname();
+        const std::string &target = targetClient->getNickname();
+        Slice pieces[] = {
+            Slice(prefix.data(), prefix.size()),
+            Slice(":", 1),
+            Slice(sender.data(), sender.size()),
+            Slice(" PRIVMSG ", 9),
+            Slice(target.data(), target.size()),
+            Slice(" ", 1),
+            params.rest(1),
+            Slice("\r\n", 2)
+        };
+        sendPieces(targetClient, pieces, sizeof(pieces) / sizeof(*pieces));
+    }
+    else if (!links.empty() && remote_users.find(params[0].data(), params[0].size()))
+    {
+        // the receiving server rebuilds the line from the sender's mask
+        const std::string &prefix = client->getPrefix();
+        RemoteUser *target = *remote_users.find(params[0].data(), params[0].size());
+        std::string line = "PRIVMSG " + target->nickname + " ";
+        line.append(prefix.data() + 1, prefix.size() - 2);
+        line += " ";
+        line.append(params.rest(1).data(), params.rest(1).size());
+        sendLine(target->link, line);
     }
     else
     {
-        sendMessage(client->getFd(), Prefix(client) + "ERROR :No such nick\r\n");
+        replyError(client, "ERROR :No such nick\r\n");
     }
 }
 
-const std::string Server::Prefix(Client *client) const
+Shard *Server::currentShard()
+{
+    return current_shard;
+}
+
+// The calling shard's part of the state lock, see the threading model in
+// Server.hpp.
+void Server::lockShard()
+{
+    pthread_mutex_lock(&current_shard->state_lock);
+}
+
+void Server::unlockShard()
+{
+    pthread_mutex_unlock(&current_shard->state_lock);
+}
+
+// Every shard's part, always in index order, so that two threads taking
+// the whole lock cannot deadlock.
+void Server::lockState()
+{
+    for (size_t i = 0; i < shards.size(); ++i)
+        pthread_mutex_lock(&shards[i]->state_lock);
+}
+
+void Server::unlockState()
+{
+    for (size_t i = shards.size(); i > 0; --i)
+        pthread_mutex_unlock(&shards[i - 1]->state_lock);
+}
+
+Client *Server::getClient(const ClientHandle &handle) const
+{
+    return clients.get(handle);
+}
+
+Client *Server::findClientByNickname(const std::string &nickname)
+{
+    Client **client = nicknames.find(nickname);
+    return client ? *client : NULL;
+}
+
+Client *Server::findClientByNickname(const Slice &nickname)
 {
-    return ":" + client->getNickname() + "!" + client->getUsername() + "@" + client->getHostname() + " ";
+    Client **client = nicknames.find(nickname.data(), nickname.size());
+    return client ? *client : NULL;
+}
+
+const std::string &Server::Prefix(Client *client) const
+{
+    return client->getPrefix();
+}
+
+void Server::handleQUIT(Client *client, const Params &params)
+{
+    (void)params;
+
+    scheduleRemoval(client);
 }
 
-void Server::handleHelp(Client *client, const std::vector<std::string> &params)
+void Server::handleHelp(Client *client, const Params &params)
 {
     (void)params;
 
-    std::string help_message = "Available commands:\r\n";
-    help_message += "PASS <password> - Authenticate with server\r\n";
-    help_message += "NICK <nickname> - Set your nickname\r\n";
-    help_message += "USER <username> <hostname> <servername> <realname> - Set your user information\r\n";
-    help_message += "PING <token> - Ping the server\r\n";
-    help_message += "CREATE <channel name> <password> - Create a new channel\r\n";
-    help_message += "JOIN <channel name> <password> - Join a channel\r\n";
-    help_message += "LIST - List available channels\r\n";
-    help_message += "PRIVMSG <nickname> <message> - Send a private message to a user\r\n";
-    help_message += "HELP - Display this help message\r\n";
-    help_message += "QUIT - Disconnect from the server\r\n";
-
-    sendMessage(client->getFd(), Prefix(client) + help_message);
+    static const char help_message[] =
+        "Available commands:\r\n"
+        "PASS <password> - Authenticate with server\r\n"
+        "NICK <nickname> - Set your nickname\r\n"
+        "USER <username> <hostname> <servername> <realname> - Set your user information\r\n"
+        "PING <token> - Ping the server\r\n"
+        "PONG <token> - Answer a PING from the server\r\n"
+        "CREATE <channel name> <password> - Create a new channel\r\n"
+        "JOIN <channel name> <password> - Join a channel\r\n"
+        "LIST - List available channels\r\n"
+        "PRIVMSG <nickname> <message> - Send a private message to a user\r\n"
+        "OPER <password> - Become a server operator\r\n"
+        "STATS - Show server statistics (operators only)\r\n"
+        "HELP - Display this help message\r\n"
+        "QUIT - Disconnect from the server\r\n";
+
+    sendReply(client, help_message);
 }
\ No newline at end of file